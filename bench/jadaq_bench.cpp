@@ -0,0 +1,723 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Decode and output micro benchmarks on synthetic digitizer data. The SIMD
+ * waveform decoders are checked against the scalar reference before any
+ * benchmark is run.
+ *
+ */
+
+#include "DataGenerator.hpp"
+#include "DataHandler.hpp"
+#include "DataWriter.hpp"
+#include "DataWriterAsync.hpp"
+#include "DataWriterCompress.hpp"
+#include "DataWriterEventBuilder.hpp"
+#include "DataWriterHDF5.hpp"
+#include "DataWriterHDF5Columns.hpp"
+#include "DataWriterHDF5PerDigitizer.hpp"
+#include "DataWriterNetwork.hpp"
+#include "DataWriterText.hpp"
+#include "EventIterator.hpp"
+#include "WaveformDecode.hpp"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr size_t readoutSize = 1 << 20;
+constexpr size_t readoutBuffers = 16; // cycled to keep time tags increasing and caches cold
+constexpr size_t eventsPerGroup = 32;
+
+/* A set of readout buffers with continuous synthetic data */
+struct Readout {
+  std::vector<std::vector<char>> data;
+  std::vector<caen::ReadoutBuffer> buffers;
+  uint64_t events = 0;
+  uint64_t bytes = 0;
+  template <typename Generator, typename... Args> static Readout generate(Generator &generator, Args... args) {
+    Readout readout;
+    readout.data.resize(readoutBuffers);
+    for (auto &d : readout.data) {
+      d.resize(readoutSize);
+      caen::ReadoutBuffer b;
+      b.data = d.data();
+      b.size = readoutSize;
+      b.dataSize = (uint32_t)generator.fill(d.data(), d.size(), args...);
+      readout.bytes += b.dataSize;
+      readout.buffers.push_back(b);
+    }
+    readout.events = generator.events();
+    return readout;
+  }
+  /* Events and bytes per buffer - all buffers hold the same amount */
+  uint64_t bufferEvents() const { return events / readoutBuffers; }
+  uint64_t bufferBytes() const { return bytes / readoutBuffers; }
+};
+
+Readout dppqdcReadout(uint8_t groupMask, bool extras, uint16_t samples) {
+  generator::DPPQDC generator(groupMask, extras, samples);
+  return Readout::generate(generator, eventsPerGroup);
+}
+
+Readout std751Readout(uint8_t channelMask, uint16_t samples) {
+  generator::Std751 generator(channelMask, samples);
+  return Readout::generate(generator);
+}
+
+void setCounters(benchmark::State &state, uint64_t events, uint64_t bytes) {
+  state.SetItemsProcessed(events);
+  state.SetBytesProcessed(bytes);
+}
+
+/* Args: group mask, extras, samples */
+void DPPQDCIterator(benchmark::State &state) {
+  Readout readout = dppqdcReadout((uint8_t)state.range(0), state.range(1), (uint16_t)state.range(2));
+  size_t i = 0;
+  uint64_t events = 0;
+  for (auto _ : state) {
+    uint32_t sum = 0;
+    DPPQDCEventIterator it{readout.buffers[i++ % readoutBuffers]};
+    for (; it != it.end(); ++it) {
+      DPPQDCEvent event = it.event<DPPQDCEvent>();
+      sum += event.timeTag() + event.charge() + it.group();
+    }
+    benchmark::DoNotOptimize(sum);
+    events += readout.bufferEvents();
+  }
+  setCounters(state, events, i * readout.bufferBytes());
+}
+BENCHMARK(DPPQDCIterator)
+    ->Args({0xff, 0, 0})
+    ->Args({0xff, 1, 0})
+    ->Args({0x0f, 1, 0})
+    ->Args({0x01, 1, 0})
+    ->Args({0xff, 1, 448});
+
+/* Args: channel mask, samples */
+void StdBLTIterator(benchmark::State &state) {
+  Readout readout = std751Readout((uint8_t)state.range(0), (uint16_t)state.range(1));
+  size_t i = 0;
+  uint64_t events = 0;
+  for (auto _ : state) {
+    uint32_t sum = 0;
+    StdBLTEventIterator it{readout.buffers[i++ % readoutBuffers]};
+    for (; it != it.end(); ++it) {
+      sum += it.event<StdEvent751>().timeTag();
+    }
+    benchmark::DoNotOptimize(sum);
+    events += readout.bufferEvents();
+  }
+  setCounters(state, events, i * readout.bufferBytes());
+}
+BENCHMARK(StdBLTIterator)->Args({0xff, 1024})->Args({0x01, 1024});
+
+template <typename E> struct Layout;
+template <> struct Layout<Data::ListElement422> {
+  static const bool extras = false;
+  static const uint16_t samples = 0;
+};
+template <> struct Layout<Data::ListElement8222> {
+  static const bool extras = true;
+  static const uint16_t samples = 0;
+};
+template <> struct Layout<Data::ListElement822> {
+  static const bool extras = false;
+  static const uint16_t samples = 0;
+};
+template <typename L> struct Layout<Data::DPPQDCWaveformElement<L>> {
+  static const bool extras = Layout<L>::extras;
+  static const uint16_t samples = 448;
+};
+template <typename L> struct Layout<Data::DPPQDCPackedWaveformElement<L>> {
+  static const bool extras = Layout<L>::extras;
+  static const uint16_t samples = 448;
+};
+
+/* Counts what a DataHandler hands to its writer */
+struct WriterCounts {
+  uint64_t writes = 0;
+  uint64_t elements = 0;
+  uint64_t bytes = 0;
+};
+class DataWriterCount {
+  WriterCounts &counts;
+
+public:
+  explicit DataWriterCount(WriterCounts &counts_) : counts(counts_) {}
+  void addDigitizer(uint32_t) {}
+  void split(const std::string &) {}
+  template <typename E> void operator()(const jadaq::buffer<E> *buffer, uint32_t, uint64_t) {
+    counts.writes++;
+    counts.elements += buffer->size();
+    counts.bytes += buffer->data_size() - buffer->header_size();
+  }
+};
+
+/* Args: sorted
+ * bytes_per_event is what the handler writes per event - every byte of it
+ * is copied once, from the readout buffer into the output buffer - and
+ * events_per_write the number of events per writer call */
+template <typename E> void DPPQDCHandler(benchmark::State &state) {
+  Readout readout = dppqdcReadout(0xff, Layout<E>::extras, Layout<E>::samples);
+  WriterCounts counts;
+  DataWriter dataWriter;
+  dataWriter = new DataWriterCount(counts);
+  uint32_t jitter[8] = {0};
+  DataHandler dataHandler;
+  dataHandler.setSorted(state.range(0));
+  dataHandler.initialize<E>(dataWriter, 1, 8, Layout<E>::samples, jitter);
+  size_t i = 0;
+  uint64_t events = 0;
+  for (auto _ : state) {
+    DPPQDCEventIterator it{readout.buffers[i++ % readoutBuffers]};
+    events += dataHandler(it);
+  }
+  setCounters(state, events, i * readout.bufferBytes());
+  if (counts.elements > 0) {
+    state.counters["bytes_per_event"] = (double)counts.bytes / counts.elements;
+    state.counters["events_per_write"] = (double)counts.elements / counts.writes;
+  }
+}
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::ListElement422)->Arg(1)->Arg(0);
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::ListElement8222)->Arg(1)->Arg(0);
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::ListElement822)->Arg(1)->Arg(0);
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::DPPQDCWaveformElement<Data::ListElement422>)->Arg(1)->Arg(0);
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::DPPQDCWaveformElement<Data::ListElement8222>)->Arg(1)->Arg(0);
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::DPPQDCPackedWaveformElement<Data::ListElement422>)->Arg(1)->Arg(0);
+BENCHMARK_TEMPLATE(DPPQDCHandler, Data::DPPQDCPackedWaveformElement<Data::ListElement8222>)->Arg(1)->Arg(0);
+
+/* Args: sorted
+ * NOTE: an element must fit in one output buffer so 8 x 512 samples is
+ * about the longest record supported */
+void Std751Handler(benchmark::State &state) {
+  const uint16_t samples = 512;
+  Readout readout = std751Readout(0xff, samples);
+  DataWriter dataWriter;
+  dataWriter = new DataWriterNull();
+  uint32_t jitter[8] = {0};
+  DataHandler dataHandler;
+  dataHandler.setSorted(state.range(0));
+  dataHandler.initialize<Data::StdElement751>(dataWriter, 1, 8, samples * 8, jitter);
+  size_t i = 0;
+  uint64_t events = 0;
+  for (auto _ : state) {
+    StdBLTEventIterator it{readout.buffers[i++ % readoutBuffers]};
+    events += dataHandler(it);
+  }
+  setCounters(state, events, i * readout.bufferBytes());
+}
+BENCHMARK(Std751Handler)->Arg(1)->Arg(0);
+
+/* Args: digitizers, coincidence window in ticks
+ * Time sorted list mode buffers from each digitizer in turn with a hit every
+ * ~100 ticks per digitizer */
+void EventBuilder(benchmark::State &state) {
+  const size_t digitizers = state.range(0);
+  std::mt19937 rng(1);
+  std::vector<std::vector<std::unique_ptr<jadaq::buffer<Data::ListElement422>>>> buffers(digitizers);
+  for (size_t d = 0; d < digitizers; ++d) {
+    uint32_t time = 0;
+    for (size_t i = 0; i < readoutBuffers; ++i) {
+      auto buffer = new jadaq::buffer<Data::ListElement422>(Data::maxBufferSize, Data::ListElement422::size(),
+                                                            sizeof(Data::Header));
+      while (!buffer->full()) {
+        Data::ListElement422 e;
+        time += 1 + rng() % 200;
+        e.time = time;
+        e.channel = (uint16_t)(rng() % 64);
+        e.charge = (uint16_t)rng();
+        buffer->append(&e);
+      }
+      buffers[d].emplace_back(buffer);
+    }
+  }
+  DataWriter inner;
+  inner = new DataWriterNull();
+  DataWriter dataWriter;
+  dataWriter = new DataWriterEventBuilder(std::move(inner), state.range(1));
+  for (size_t d = 0; d < digitizers; ++d) {
+    dataWriter.addDigitizer((uint32_t)d);
+  }
+  size_t i = 0;
+  uint64_t hits = 0;
+  for (auto _ : state) {
+    for (size_t d = 0; d < digitizers; ++d) {
+      const jadaq::buffer<Data::ListElement422> *buffer = buffers[d][i % readoutBuffers].get();
+      dataWriter(buffer, (uint32_t)d, 0);
+      hits += buffer->size();
+    }
+    ++i;
+  }
+  setCounters(state, hits, hits * Data::ListElement422::size());
+}
+BENCHMARK(EventBuilder)->Args({2, 50})->Args({6, 50})->Args({6, 1000})->Args({16, 50});
+
+/* Arg: 1 - buffers from a shared BufferPool, 0 - from the heap
+ * Create, fill and drop an output buffer */
+void BufferAllocation(benchmark::State &state) {
+  std::unique_ptr<jadaq::BufferPool> pool;
+  if (state.range(0)) {
+    pool.reset(new jadaq::BufferPool(Data::maxBufferSize, 64));
+    jadaq::BufferPool::setShared(pool.get());
+  }
+  Data::ListElement422 e;
+  memset(&e, 0, sizeof(e));
+  uint64_t buffers = 0;
+  for (auto _ : state) {
+    jadaq::buffer<Data::ListElement422> buffer(Data::maxBufferSize, Data::ListElement422::size(),
+                                               sizeof(Data::Header));
+    while (!buffer.full()) {
+      buffer.append(&e);
+    }
+    benchmark::DoNotOptimize(buffer.data());
+    buffers++;
+  }
+  jadaq::BufferPool::setShared(nullptr);
+  setCounters(state, buffers, buffers * Data::maxBufferSize);
+}
+BENCHMARK(BufferAllocation)->Arg(0)->Arg(1);
+
+/* Arg: 1 - try_emplace_back, 0 - emplace_back catching length_error
+ * Fill list mode output buffers, emptying them when full */
+void BufferFull(benchmark::State &state) {
+  Readout readout = dppqdcReadout(0x01, false, 0);
+  DPPQDCEventIterator it{readout.buffers[0]};
+  const DPPQDCEvent event = it.event<DPPQDCEvent>();
+  jadaq::buffer<Data::ListElement422> buffer(Data::maxBufferSize, Data::ListElement422::size(),
+                                             sizeof(Data::Header));
+  const size_t n = 1024;
+  uint64_t events = 0;
+  for (auto _ : state) {
+    for (size_t i = 0; i < n; ++i) {
+      if (state.range(0)) {
+        if (!buffer.try_emplace_back(event, (uint16_t)0)) {
+          buffer.clear();
+          buffer.emplace_back(event, (uint16_t)0);
+        }
+      } else {
+        try {
+          buffer.emplace_back(event, (uint16_t)0);
+        } catch (std::length_error &) {
+          buffer.clear();
+          buffer.emplace_back(event, (uint16_t)0);
+        }
+      }
+    }
+    benchmark::DoNotOptimize(buffer.data());
+    events += n;
+  }
+  setCounters(state, events, events * Data::ListElement422::size());
+}
+BENCHMARK(BufferFull)->Arg(0)->Arg(1);
+
+/* Sum the charges in a full output buffer */
+template <typename E> void BufferScan(benchmark::State &state) {
+  Readout readout = dppqdcReadout(0xff, Layout<E>::extras, Layout<E>::samples);
+  jadaq::buffer<E> buffer(Data::maxBufferSize, E::size(Layout<E>::samples), sizeof(Data::Header));
+  for (DPPQDCEventIterator it{readout.buffers[0]};
+       it != it.end() && buffer.try_emplace_back(it.event<typename E::EventType>(), it.group()); ++it) {
+  }
+  uint64_t events = 0;
+  for (auto _ : state) {
+    uint32_t sum = 0;
+    for (const E &e : buffer) {
+      sum += e.charge;
+    }
+    benchmark::DoNotOptimize(sum);
+    events += buffer.size();
+  }
+  setCounters(state, events, events * E::size(Layout<E>::samples));
+}
+BENCHMARK_TEMPLATE(BufferScan, Data::ListElement422);
+BENCHMARK_TEMPLATE(BufferScan, Data::ListElement8222);
+
+/* Output directory for file writers - tmpfs when available */
+const std::string &outputPath() {
+  static const std::string path = access("/dev/shm", W_OK) == 0 ? "/dev/shm/" : "/tmp/";
+  return path;
+}
+const std::string basename = "jadaq_bench_";
+
+/* A full output buffer of decoded elements */
+template <typename E> jadaq::buffer<E> *elements() {
+  Readout readout = dppqdcReadout(0xff, Layout<E>::extras, Layout<E>::samples);
+  auto buffer = new jadaq::buffer<E>(Data::maxBufferSize, E::size(Layout<E>::samples), sizeof(Data::Header));
+  DPPQDCEventIterator it{readout.buffers[0]};
+  for (; it != it.end() && buffer->try_emplace_back(it.event<typename E::EventType>(), it.group()); ++it) {
+  }
+  return buffer;
+}
+
+template <typename W, typename E> void writer(benchmark::State &state, W *w) {
+  std::unique_ptr<jadaq::buffer<E>> buffer(elements<E>());
+  DataWriter dataWriter;
+  dataWriter = w;
+  dataWriter.addDigitizer(1);
+  uint64_t timeStamp = DataHandler::getTimeMsecs();
+  for (auto _ : state) {
+    dataWriter(buffer.get(), 1, timeStamp);
+  }
+  setCounters(state, state.iterations() * buffer->size(),
+              state.iterations() * (buffer->data_size() - buffer->header_size()));
+}
+
+template <typename E> void NullWriter(benchmark::State &state) { writer<DataWriterNull, E>(state, new DataWriterNull()); }
+template <typename E> void TextWriter(benchmark::State &state) {
+  writer<DataWriterText, E>(state, new DataWriterText(outputPath(), basename, "text"));
+  std::remove((outputPath() + basename + "text.txt").c_str());
+}
+template <typename E> void HDF5Writer(benchmark::State &state) {
+  writer<DataWriterHDF5, E>(state, new DataWriterHDF5(outputPath(), basename, "hdf5"));
+  std::remove((outputPath() + basename + "hdf5.h5").c_str());
+}
+/* HDF5 behind the writer thread - the queue bounds how far the caller can
+ * run ahead, so this is the sustained rate */
+template <typename E> void HDF5AsyncWriter(benchmark::State &state) {
+  DataWriter hdf5;
+  hdf5 = new DataWriterHDF5(outputPath(), basename, "async");
+  writer<DataWriterAsync, E>(state, new DataWriterAsync(std::move(hdf5), 256));
+  std::remove((outputPath() + basename + "async.h5").c_str());
+}
+/* Column layout, args: compression (0 none, 1 shuffle + deflate), direct chunk writes */
+template <typename E> void HDF5ColumnsWriter(benchmark::State &state) {
+  DataWriterHDF5Columns::Options options;
+  options.compression = state.range(0) ? DataWriterHDF5Columns::Compression::Deflate
+                                       : DataWriterHDF5Columns::Compression::None;
+  options.direct = state.range(1);
+  writer<DataWriterHDF5Columns, E>(state, new DataWriterHDF5Columns(outputPath(), basename, "columns", options));
+  std::remove((outputPath() + basename + "columns.h5").c_str());
+}
+/* A thread per digitizer, writing to one file, arg 0, or to a file per
+ * digitizer, arg 1 */
+DataWriter *digitizersWriter = nullptr;
+void HDF5Digitizers(benchmark::State &state) {
+  if (state.thread_index() == 0) {
+    digitizersWriter = new DataWriter;
+    if (state.range(0)) {
+      *digitizersWriter = new DataWriterHDF5PerDigitizer(
+          outputPath(), basename, "digitizers", [](const std::string &basename_, const std::string &id) {
+            DataWriter dataWriter;
+            dataWriter = new DataWriterHDF5(outputPath(), basename_, std::string(id));
+            return dataWriter;
+          });
+    } else {
+      *digitizersWriter = new DataWriterHDF5(outputPath(), basename, "digitizers");
+    }
+  }
+  std::unique_ptr<jadaq::buffer<Data::ListElement422>> buffer(elements<Data::ListElement422>());
+  const uint32_t digitizerID = state.thread_index() + 1;
+  uint64_t timeStamp = DataHandler::getTimeMsecs();
+  for (auto _ : state) {
+    (*digitizersWriter)(buffer.get(), digitizerID, timeStamp);
+  }
+  setCounters(state, state.iterations() * buffer->size(),
+              state.iterations() * (buffer->data_size() - buffer->header_size()));
+  if (state.thread_index() == 0) {
+    delete digitizersWriter;
+    std::remove((outputPath() + basename + "digitizers.h5").c_str());
+    for (int i = 1; i <= state.threads(); ++i)
+      std::remove((outputPath() + basename + "d" + std::to_string(i) + "-digitizers.h5").c_str());
+  }
+}
+/* Sends to a bound but otherwise idle localhost socket, args: datagrams per
+ * batch (1 sends from the caller), UDP GSO. Batches are sent by the sender
+ * thread, the queue bounds how far the caller can run ahead. */
+template <typename E> void NetworkWriter(benchmark::State &state) {
+  boost::asio::io_service ioService;
+  udp::socket receiver(ioService, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+  std::string port = std::to_string(receiver.local_endpoint().port());
+  DataWriterNetwork::Options options;
+  options.batch = state.range(0);
+  options.gso = state.range(1);
+  writer<DataWriterNetwork, E>(state, new DataWriterNetwork("127.0.0.1", port, 0, options));
+}
+/* Compress a full buffer by one method, the counter ratio is bytes in over
+ * bytes out */
+const char *compressMethods[] = {"delta", "deflate", "delta+deflate", "lz4", "delta+lz4", "zstd", "delta+zstd"};
+template <typename E> void Compress(benchmark::State &state) {
+  jadaq::compress::Method method;
+  try {
+    method = jadaq::compress::parse(compressMethods[state.range(0)]);
+  } catch (std::invalid_argument &e) {
+    state.SkipWithError(e.what());
+    return;
+  }
+  state.SetLabel(jadaq::compress::name(method));
+  std::unique_ptr<jadaq::buffer<E>> buffer(elements<E>());
+  const size_t bytes = buffer->data_size() - buffer->header_size();
+  const size_t elementSize = bytes / buffer->size();
+  const size_t headSize = jadaq::fixed_size<E>::value ? elementSize : E::size(0);
+  std::vector<char> block(2 * Data::maxBufferSize), scratch;
+  size_t size = 0;
+  for (auto _ : state) {
+    size = jadaq::compress::encode(method, E::type(), buffer->data() + buffer->header_size(), buffer->size(),
+                                   elementSize, headSize, block.data(), block.size(), scratch);
+    benchmark::DoNotOptimize(size);
+  }
+  setCounters(state, state.iterations() * buffer->size(), state.iterations() * bytes);
+  state.counters["ratio"] = size ? (double)bytes / size : 0.0;
+}
+/* The compression pool in front of the null writer, arg: worker threads */
+template <typename E> void CompressWriter(benchmark::State &state) {
+  DataWriter null;
+  null = new DataWriterNull();
+  DataWriterCompress *compress =
+      new DataWriterCompress(std::move(null), jadaq::compress::parse("delta+deflate"), state.range(0), 256);
+  DataWriter dataWriter;
+  dataWriter = compress;
+  dataWriter.addDigitizer(1);
+  std::unique_ptr<jadaq::buffer<E>> buffer(elements<E>());
+  uint64_t timeStamp = DataHandler::getTimeMsecs();
+  for (auto _ : state) {
+    dataWriter(buffer.get(), 1, timeStamp);
+  }
+  compress->flush();
+  setCounters(state, state.iterations() * buffer->size(),
+              state.iterations() * (buffer->data_size() - buffer->header_size()));
+}
+BENCHMARK_TEMPLATE(NullWriter, Data::ListElement422);
+BENCHMARK_TEMPLATE(NullWriter, Data::DPPQDCWaveformElement<Data::ListElement422>);
+BENCHMARK_TEMPLATE(TextWriter, Data::ListElement422);
+BENCHMARK_TEMPLATE(TextWriter, Data::DPPQDCWaveformElement<Data::ListElement422>);
+BENCHMARK_TEMPLATE(HDF5Writer, Data::ListElement422);
+BENCHMARK_TEMPLATE(HDF5Writer, Data::ListElement8222);
+BENCHMARK_TEMPLATE(HDF5Writer, Data::DPPQDCWaveformElement<Data::ListElement422>);
+BENCHMARK_TEMPLATE(HDF5Writer, Data::DPPQDCPackedWaveformElement<Data::ListElement422>);
+BENCHMARK_TEMPLATE(HDF5AsyncWriter, Data::ListElement422);
+BENCHMARK_TEMPLATE(HDF5AsyncWriter, Data::DPPQDCWaveformElement<Data::ListElement422>);
+BENCHMARK_TEMPLATE(HDF5ColumnsWriter, Data::ListElement422)->ArgsProduct({{0, 1}, {0, 1}});
+BENCHMARK_TEMPLATE(HDF5ColumnsWriter, Data::ListElement8222)->ArgsProduct({{0, 1}, {0, 1}});
+BENCHMARK_TEMPLATE(HDF5ColumnsWriter, Data::DPPQDCWaveformElement<Data::ListElement422>)->ArgsProduct({{0, 1}, {0, 1}});
+BENCHMARK(HDF5Digitizers)->Arg(0)->Arg(1)->ThreadRange(1, 4)->UseRealTime();
+BENCHMARK_TEMPLATE(NetworkWriter, Data::ListElement422)->Args({1, 0})->Args({32, 0})->Args({32, 1})->UseRealTime();
+BENCHMARK_TEMPLATE(NetworkWriter, Data::DPPQDCWaveformElement<Data::ListElement422>)->Args({1, 0})->Args({32, 0})->Args({32, 1})->UseRealTime();
+BENCHMARK_TEMPLATE(NetworkWriter, Data::DPPQDCPackedWaveformElement<Data::ListElement422>)->Args({1, 0})->Args({32, 0})->Args({32, 1})->UseRealTime();
+BENCHMARK_TEMPLATE(Compress, Data::ListElement422)->DenseRange(0, 6);
+BENCHMARK_TEMPLATE(Compress, Data::DPPQDCWaveformElement<Data::ListElement422>)->DenseRange(0, 6);
+BENCHMARK_TEMPLATE(CompressWriter, Data::DPPQDCWaveformElement<Data::ListElement422>)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+const waveform::ISA isas[] = {waveform::ISA::Scalar, waveform::ISA::SSE2, waveform::ISA::SSSE3, waveform::ISA::AVX2};
+
+/* Args: ISA, samples */
+void DPPQDCWaveformDecode(benchmark::State &state) {
+  waveform::ISA isa = (waveform::ISA)state.range(0);
+  if (isa > waveform::supported()) {
+    state.SkipWithError("not supported by this CPU");
+    return;
+  }
+  size_t words = state.range(1) / 2;
+  std::vector<uint32_t> data(words);
+  std::mt19937 rng(1);
+  for (uint32_t &w : data) {
+    w = rng() & (rng() % 8 ? 0x0fff0fffu : 0xffffffffu);
+  }
+  std::vector<char> out(DPPQDCWaveform::size(words * 2));
+  for (auto _ : state) {
+    waveform::dppqdc(data.data(), words, *(DPPQDCWaveform *)out.data(), isa);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(waveform::name(isa));
+  setCounters(state, state.iterations() * words * 2, state.iterations() * words * 4);
+}
+BENCHMARK(DPPQDCWaveformDecode)
+    ->Args({(int)waveform::ISA::Scalar, 448})
+    ->Args({(int)waveform::ISA::SSE2, 448})
+    ->Args({(int)waveform::ISA::AVX2, 448});
+
+/* Args: ISA, samples per channel */
+void Std751WaveformDecode(benchmark::State &state) {
+  waveform::ISA isa = (waveform::ISA)state.range(0);
+  if (isa > waveform::supported()) {
+    state.SkipWithError("not supported by this CPU");
+    return;
+  }
+  generator::Std751 generator(0xff, (uint16_t)state.range(1));
+  std::vector<char> event(generator.eventWords() * 4);
+  generator.fill(event.data(), event.size(), 1);
+  const uint32_t *words = (const uint32_t *)event.data() + 4;
+  size_t nWords = generator.eventWords() - 4;
+  std::vector<char> out(StdWaveform::size(nWords * 3));
+  for (auto _ : state) {
+    waveform::std751(words, nWords, *(StdWaveform *)out.data(), isa);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(waveform::name(isa));
+  setCounters(state, state.iterations() * ((StdWaveform *)out.data())->num_samples, state.iterations() * nWords * 4);
+}
+BENCHMARK(Std751WaveformDecode)
+    ->Args({(int)waveform::ISA::Scalar, 1024})
+    ->Args({(int)waveform::ISA::SSSE3, 1024});
+
+/* Args: ISA, bits - 448 samples packed and unpacked again */
+void WaveformPack(benchmark::State &state) {
+  waveform::ISA isa = (waveform::ISA)state.range(0);
+  if (isa > waveform::supported()) {
+    state.SkipWithError("not supported by this CPU");
+    return;
+  }
+  const unsigned bits = state.range(1);
+  const size_t samples = 448;
+  std::vector<uint16_t> in(samples), out(samples);
+  std::mt19937 rng(1);
+  for (uint16_t &s : in) {
+    s = rng() & ((1u << bits) - 1);
+  }
+  std::vector<char> packed(waveform::packedSize(samples, bits));
+  for (auto _ : state) {
+    waveform::pack((const char *)in.data(), samples, bits, packed.data(), isa);
+    waveform::unpack(packed.data(), samples, bits, (char *)out.data(), isa);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(waveform::name(isa));
+  setCounters(state, state.iterations() * samples, state.iterations() * samples * 2);
+}
+BENCHMARK(WaveformPack)
+    ->Args({(int)waveform::ISA::Scalar, 12})
+    ->Args({(int)waveform::ISA::SSSE3, 12})
+    ->Args({(int)waveform::ISA::Scalar, 10})
+    ->Args({(int)waveform::ISA::SSSE3, 10});
+
+/* Randomized comparison of every supported SIMD decoder against the scalar
+ * reference, and of every available compression method decoded against its
+ * input. Returns the number of mismatches */
+size_t verify(size_t cases) {
+  std::mt19937_64 rng(42);
+  std::vector<uint32_t> words(4096);
+  std::vector<char> expected(1 << 16);
+  std::vector<char> actual(1 << 16);
+  std::vector<char> input, block, output, scratch;
+  size_t mismatches = 0;
+  auto compare = [&](const char *what, waveform::ISA isa, size_t n) {
+    if (memcmp(expected.data(), actual.data(), expected.size()) != 0) {
+      if (mismatches++ < 10)
+        std::cerr << "MISMATCH: " << what << " " << waveform::name(isa) << " on " << n << " words" << std::endl;
+    }
+  };
+  for (size_t c = 0; c < cases; ++c) {
+    size_t n = rng() % (c % 8 == 0 ? words.size() : 300);
+    // DPP-QDC: random words or quiet words with sparse probes
+    uint32_t probes = c % 2 ? 0xf000f000u : 0;
+    for (size_t i = 0; i < n; ++i) {
+      words[i] = (uint32_t)rng() & (0x0fff0fffu | (rng() % 16 == 0 ? 0xf000f000u : probes));
+    }
+    for (waveform::ISA isa : isas) {
+      if (isa == waveform::ISA::Scalar || isa > waveform::supported())
+        continue;
+      memset(expected.data(), 0x5a, expected.size());
+      memset(actual.data(), 0x5a, actual.size());
+      waveform::dppqdc(words.data(), n, *(DPPQDCWaveform *)expected.data(), waveform::ISA::Scalar);
+      waveform::dppqdc(words.data(), n, *(DPPQDCWaveform *)actual.data(), isa);
+      compare("DPP-QDC", isa, n);
+    }
+    // 751: three samples per word except at random places
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t count = rng() % 8 ? 3 : rng() % 4;
+      words[i] = ((uint32_t)rng() & 0x3fffffff) | (count << 30);
+    }
+    for (waveform::ISA isa : isas) {
+      if (isa == waveform::ISA::Scalar || isa > waveform::supported())
+        continue;
+      memset(expected.data(), 0x5a, expected.size());
+      memset(actual.data(), 0x5a, actual.size());
+      waveform::std751(words.data(), n, *(StdWaveform *)expected.data(), waveform::ISA::Scalar);
+      waveform::std751(words.data(), n, *(StdWaveform *)actual.data(), isa);
+      compare("751", isa, n);
+    }
+    // packing: n samples of 10 or 12 bits, from and to unaligned addresses
+    const unsigned bits = c % 2 ? 12 : 10;
+    for (size_t i = 0; i < n; ++i) {
+      uint16_t sample = (uint16_t)(rng() & ((1u << bits) - 1));
+      memcpy((char *)words.data() + 1 + 2 * i, &sample, sizeof(sample));
+    }
+    for (waveform::ISA isa : isas) {
+      if (isa == waveform::ISA::Scalar || isa > waveform::supported())
+        continue;
+      memset(expected.data(), 0x5a, expected.size());
+      memset(actual.data(), 0x5a, actual.size());
+      waveform::pack((const char *)words.data() + 1, n, bits, expected.data() + 1, waveform::ISA::Scalar);
+      waveform::pack((const char *)words.data() + 1, n, bits, actual.data() + 1, isa);
+      compare("pack", isa, n);
+      waveform::unpack(expected.data() + 1, n, bits, actual.data() + 1 + (1 << 14), isa);
+      waveform::unpack(expected.data() + 1, n, bits, expected.data() + 1 + (1 << 14), waveform::ISA::Scalar);
+      compare("unpack", isa, n);
+      if (memcmp(expected.data() + 1 + (1 << 14), (const char *)words.data() + 1, 2 * n) != 0 && mismatches++ < 10)
+        std::cerr << "MISMATCH: unpack does not restore the samples on " << n << " samples" << std::endl;
+    }
+    // compression: slowly varying samples with jumps, every few cases as it is slow
+    if (c % 16 != 0)
+      continue;
+    const size_t elementSize = 2 * (rng() % 80) + c / 16 % 2; // odd sizes have no whole samples
+    const size_t headSize = rng() % (elementSize + 1);
+    const size_t elements = c % 64 == 0 ? 0 : rng() % 300;
+    input.resize(elements * elementSize);
+    uint16_t sample = 0;
+    for (size_t i = 0; i < input.size(); i += 2) {
+      sample = (uint16_t)(rng() % 32 ? sample + rng() % 9 - 4 : rng());
+      memcpy(input.data() + i, &sample, std::min<size_t>(2, input.size() - i));
+    }
+    block.resize(2 * input.size() + 1024);
+    for (const char *name : compressMethods) {
+      jadaq::compress::Method method;
+      try {
+        method = jadaq::compress::parse(name);
+      } catch (std::invalid_argument &) {
+        continue; // built without the codec
+      }
+      const size_t size = jadaq::compress::encode(method, Data::ListElement422::type(), input.data(), elements,
+                                                  elementSize, headSize, block.data(), block.size(), scratch);
+      try {
+        const Data::CompressedHeader header = jadaq::compress::decode(block.data(), size, output, scratch);
+        if (header.numElements == elements && header.elementSize == elementSize && output == input)
+          continue;
+      } catch (std::runtime_error &) {
+      }
+      if (mismatches++ < 10)
+        std::cerr << "MISMATCH: " << name << " does not restore " << elements << " elements of " << elementSize
+                  << " bytes" << std::endl;
+    }
+  }
+  return mismatches;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const size_t cases = 20000;
+  size_t mismatches = verify(cases);
+  std::cout << "Waveform decoders and packing (" << waveform::name(waveform::supported()) << ") and compression: "
+            << cases << " randomized cases checked, " << mismatches << " mismatches" << std::endl;
+  if (mismatches > 0) {
+    return 1;
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,234 @@
+#!/usr/bin/python
+
+"""Decompress a jadaq HDF5 file written with --compress. INPUT is copied to
+OUTPUT with the blocks of every digitizer of type Compressed decoded to the
+elements they hold - one table per globalTime (packets layout) or one
+dataset per field with a new index (columns layout) - and JADAQ_DATA_TYPE
+set to the element type, so OUTPUT reads like a file written without
+compression. The blocks are decoded like jadaq::compress::decode in
+src/Compress.cpp. deflate only needs zlib, lz4 needs the lz4 module and
+zstd the zstandard module.
+
+Usage: hdf5decompress.py INPUT OUTPUT
+"""
+
+from __future__ import print_function
+
+import struct
+import sys
+import zlib
+import h5py
+import numpy
+
+COMPRESSED = 6
+EVENT = 4
+STANDARD = 3
+WAVEFORM_BASE = 1 << 8
+PACKED_BASE = 1 << 9
+# Data::CompressedHeader: element type, filter, codec, element size, head
+# size, number of elements, filtered size and compressed size
+HEADER = struct.Struct('<HBBIIIII')
+DELTA = 1
+DEFLATE, LZ4, ZSTD = 1, 2, 3
+# samples bit packed with one width by the delta filter
+RUN = 16
+
+INTERVAL = [('start', '<u2'), ('end', '<u2')]
+LIST = {1: [('time', '<u4'), ('channel', '<u2'), ('charge', '<u2')],
+        2: [('time', '<u8'), ('channel', '<u2'), ('charge', '<u2'),
+            ('baseline', '<u2')],
+        5: [('time', '<u8'), ('channel', '<u2'), ('charge', '<u2')]}
+DPPQDC_WAVEFORM = [('num_samples', '<u2'), ('trigger', '<u2'),
+                   ('gate', INTERVAL), ('holdoff', INTERVAL),
+                   ('overthreshold', INTERVAL)]
+STANDARD_HEAD = [('time', '<u4'), ('channelMask', 'u1'), ('eventNo', '<u4'),
+                 ('num_samples', '<u2')]
+EVENT_FIELDS = [('eventNo', '<u8'), ('time', '<u8'), ('digitizerID', '<u4'),
+                ('channel', '<u2'), ('charge', '<u2')]
+
+def element_dtype(element_type, element_size):
+    """Compound dtype of elements of element_type, laid out like the HDF5
+    type jadaq writes for them"""
+    base = element_type & 0xff
+    samples = None
+    if element_type == EVENT:
+        fields = list(EVENT_FIELDS)
+    elif base == STANDARD:
+        fields = list(STANDARD_HEAD)
+        samples = 'samples10' if element_type & PACKED_BASE else 'samples'
+    elif base in LIST:
+        fields = list(LIST[base])
+        if element_type & (WAVEFORM_BASE | PACKED_BASE):
+            fields += DPPQDC_WAVEFORM
+            samples = 'samples12' if element_type & PACKED_BASE else 'samples'
+    else:
+        raise ValueError('Unknown element type %d' % element_type)
+    rest = element_size - numpy.dtype(fields).itemsize
+    if samples == 'samples' and rest > 0:
+        fields.append((samples, '<u2', (rest // 2,)))
+    elif samples and rest > 0:
+        fields.append((samples, 'u1', (rest,)))
+    dtype = numpy.dtype(fields)
+    if dtype.itemsize != element_size:
+        raise ValueError('Elements of type %d are not %d bytes'
+                         % (element_type, element_size))
+    return dtype
+
+def decompress(codec, data, expected):
+    """Undo the codec of a block"""
+    if codec == DEFLATE:
+        data = zlib.decompress(data)
+    elif codec == LZ4:
+        import lz4.block
+        data = lz4.block.decompress(data, uncompressed_size=expected)
+    elif codec == ZSTD:
+        import zstandard
+        data = zstandard.ZstdDecompressor().decompress(
+            data, max_output_size=expected)
+    elif codec != 0:
+        raise ValueError('Unknown codec %d' % codec)
+    if len(data) != expected:
+        raise ValueError('Compressed block data is not valid')
+    return data
+
+def unpack_samples(data, pos, count):
+    """Reverse the delta coding and bit packing of count samples at pos,
+    returns the samples and the position after them"""
+    samples = numpy.empty(count, numpy.uint16)
+    previous = 0
+    for i in range(0, count, RUN):
+        k = min(RUN, count - i)
+        width = data[pos]
+        end = pos + 1 + (k * width + 7) // 8
+        bits = 0
+        for shift, byte in enumerate(data[pos + 1:end]):
+            bits |= byte << (8 * shift)
+        mask = (1 << width) - 1
+        for j in range(k):
+            z = bits >> (j * width) & mask
+            previous = (previous + ((z >> 1) ^ -(z & 1))) & 0xffff
+            samples[i + j] = previous
+        pos = end
+    return samples, pos
+
+def unfilter(data, n, element_size, head_size):
+    """Reverse the delta filter: the heads are byte transposed, the 16 bit
+    samples after them delta coded and bit packed per element"""
+    data = bytearray(data)
+    out = numpy.empty((n, element_size), numpy.uint8)
+    heads = numpy.frombuffer(bytes(data[:n * head_size]), numpy.uint8)
+    out[:, :head_size] = heads.reshape(head_size, n).T
+    count = (element_size - head_size) // 2
+    pos = n * head_size
+    if count > 0:
+        for i in range(n):
+            samples, pos = unpack_samples(data, pos, count)
+            out[i, head_size:] = samples.view(numpy.uint8)
+    if pos != len(data):
+        raise ValueError('Compressed block samples are not valid')
+    return out.tobytes()
+
+def decode(stream):
+    """Decode a stream of blocks, returns the element type and the elements
+    of all of them"""
+    stream = stream.tobytes()
+    element_type = None
+    dtype = None
+    parts = []
+    pos = 0
+    while pos < len(stream):
+        if len(stream) - pos < HEADER.size:
+            raise ValueError('Compressed block too short')
+        (block_type, filter_, codec, element_size, head_size, n,
+         filtered_size, size) = HEADER.unpack_from(stream, pos)
+        pos += HEADER.size
+        if element_type is None:
+            element_type = block_type
+            dtype = element_dtype(element_type, element_size)
+        elif block_type != element_type or element_size != dtype.itemsize:
+            raise ValueError('Element type changed within a digitizer')
+        data = decompress(codec, stream[pos:pos + size], filtered_size)
+        pos += size
+        if filter_ == DELTA:
+            data = unfilter(data, n, element_size, head_size)
+        parts.append(numpy.frombuffer(data, dtype))
+    if not parts:
+        return None, numpy.empty(0, numpy.uint8)
+    return element_type, numpy.concatenate(parts)
+
+def copy_attrs(source, target, element_type):
+    for key, value in source.attrs.items():
+        if key == 'JADAQ_DATA_TYPE' and element_type is not None:
+            value = numpy.uint16(element_type)
+        target.attrs[key] = value
+
+def create(group, name, data):
+    return group.create_dataset(name, data=data,
+                                maxshape=(None,) + data.shape[1:], chunks=True)
+
+def copy_columns(source, target):
+    """Columns layout: the byte column is decoded per index entry"""
+    column = source['byte']
+    index = source['index'][()]
+    element_type = None
+    parts = []
+    new_index = numpy.zeros(len(index), index.dtype)
+    rows = 0
+    for i, entry in enumerate(index):
+        first = int(entry['first'])
+        last = first + int(entry['rows'])
+        element_type_, elements = decode(column[first:last])
+        if element_type is None:
+            element_type = element_type_
+        elif element_type_ not in (None, element_type):
+            raise ValueError('Element type changed within a digitizer')
+        new_index[i] = (entry['globalTime'], rows, len(elements))
+        rows += len(elements)
+        parts.append(elements)
+    copy_attrs(source, target, element_type)
+    if element_type is None:
+        return
+    elements = numpy.concatenate([p for p in parts if len(p)])
+    for field in elements.dtype.names:
+        create(target, field, elements[field])
+    create(target, 'index', new_index)
+
+def copy_packets(source, target):
+    """Packets layout: a table of bytes per globalTime"""
+    element_type = None
+    for name, item in source.items():
+        if item.dtype.names != ('byte',):
+            source.copy(item, target, name) # passed on uncompressed
+            continue
+        element_type_, elements = decode(item['byte'][()])
+        if element_type is None:
+            element_type = element_type_
+        elif element_type_ not in (None, element_type):
+            raise ValueError('Element type changed within a digitizer')
+        if element_type_ is not None:
+            create(target, name, elements)
+    copy_attrs(source, target, element_type)
+
+def copy_group(source, target, columns):
+    if source.attrs.get('JADAQ_DATA_TYPE') == COMPRESSED:
+        if columns:
+            copy_columns(source, target)
+        else:
+            copy_packets(source, target)
+        return
+    copy_attrs(source, target, None)
+    for name, item in source.items():
+        if isinstance(item, h5py.Group):
+            copy_group(item, target.create_group(name), columns)
+        else:
+            source.copy(item, target, name)
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    with h5py.File(sys.argv[1], 'r') as inp, h5py.File(sys.argv[2], 'w') as out:
+        layout = inp.attrs.get('JADAQ_LAYOUT', b'')
+        if isinstance(layout, bytes):
+            layout = layout.decode()
+        copy_group(inp, out, layout == 'columns')
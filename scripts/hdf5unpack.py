@@ -0,0 +1,120 @@
+#!/usr/bin/python
+
+"""Unpack the bit packed waveform samples of a jadaq HDF5 file written with
+--packed-waveforms. INPUT is copied to OUTPUT with every samples12 or
+samples10 member (packets layout) or column (columns layout) replaced by 16
+bit samples and JADAQ_DATA_TYPE set to the unpacked element type, so OUTPUT
+reads like a file written without packing.
+
+Usage: hdf5unpack.py INPUT OUTPUT
+"""
+
+from __future__ import print_function
+
+import sys
+import h5py
+import numpy
+
+PACKED_BASE = 1 << 9
+WAVEFORM_BASE = 1 << 8
+STANDARD = 3
+# bits per sample for the names of packed samples
+PACKED = {'samples12': 12, 'samples10': 10}
+# rows unpacked at a time
+ROWS = 1 << 16
+
+def unpack(packed, bits):
+    """Unpack rows of packed bytes to rows of uint16 samples. The samples are
+    a little endian bit stream, sample k at bit k * bits."""
+    rows, size = packed.shape
+    n = size * 8 // bits
+    # whole groups of bytes: 3 bytes hold 2 12 bit samples, 5 hold 4 10 bit
+    group = 3 if bits == 12 else 5
+    padded = numpy.zeros((rows, -(-size // group) * group), numpy.uint16)
+    padded[:, :size] = packed
+    b = [padded[:, i::group] for i in range(group)]
+    if bits == 12:
+        s = [b[0] | (b[1] & 0xf) << 8, b[1] >> 4 | b[2] << 4]
+    else:
+        s = [b[0] | (b[1] & 0x3) << 8, b[1] >> 2 | (b[2] & 0xf) << 6,
+             b[2] >> 4 | (b[3] & 0x3f) << 4, b[3] >> 6 | b[4] << 2]
+    return numpy.stack(s, axis=-1).reshape(rows, -1)[:, :n]
+
+def unpacked_type(element_type):
+    """Element type written without --packed-waveforms"""
+    if not element_type & PACKED_BASE:
+        return element_type
+    list_type = element_type & 0xff
+    return list_type if list_type == STANDARD else WAVEFORM_BASE | list_type
+
+def unpacked_dtype(dtype):
+    """Compound dtype with the packed member replaced by 16 bit samples"""
+    fields = []
+    for name in dtype.names:
+        sub, _ = dtype.fields[name][:2]
+        if name in PACKED:
+            n = sub.shape[0] * 8 // PACKED[name]
+            fields.append(('samples', numpy.uint16, (n,)))
+        else:
+            fields.append((name, sub))
+    return numpy.dtype(fields)
+
+def packed_member(dtype):
+    """Name of the packed member of a compound dtype, or None"""
+    for name in dtype.names or ():
+        if name in PACKED:
+            return name
+    return None
+
+def create_like(group, name, source, shape, dtype):
+    """Empty dataset with the chunking and compression of source"""
+    chunks = (source.chunks[0],) + shape[1:] if source.chunks else None
+    maxshape = (None,) + shape[1:] if source.maxshape[0] is None else None
+    return group.create_dataset(name, shape, dtype, chunks=chunks,
+                                maxshape=maxshape,
+                                compression=source.compression,
+                                compression_opts=source.compression_opts,
+                                shuffle=source.shuffle)
+
+def copy_column(group, name, source):
+    """Columns layout: samples12 / samples10 becomes a samples column"""
+    bits = PACKED[name]
+    rows, size = source.shape
+    out = create_like(group, 'samples', source, (rows, size * 8 // bits),
+                      numpy.uint16)
+    for first in range(0, rows, ROWS):
+        last = min(first + ROWS, rows)
+        out[first:last] = unpack(source[first:last], bits)
+
+def copy_packets(group, name, source, member):
+    """Packets layout: a packet of elements with a packed member"""
+    data = source[()]
+    out = numpy.empty(data.shape, unpacked_dtype(data.dtype))
+    for field in data.dtype.names:
+        if field != member:
+            out[field] = data[field]
+    if len(data):
+        out['samples'] = unpack(data[member], PACKED[member])
+    create_like(group, name, source, out.shape, out.dtype)[()] = out
+
+def copy_group(source, target):
+    for key, value in source.attrs.items():
+        if key == 'JADAQ_DATA_TYPE':
+            value = numpy.uint16(unpacked_type(int(value)))
+        target.attrs[key] = value
+    for name, item in source.items():
+        if isinstance(item, h5py.Group):
+            copy_group(item, target.create_group(name))
+        elif name in PACKED:
+            copy_column(target, name, item)
+        elif packed_member(item.dtype):
+            copy_packets(target, name, item, packed_member(item.dtype))
+        else:
+            source.copy(item, target, name)
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    with h5py.File(sys.argv[1], 'r') as inp, h5py.File(sys.argv[2], 'w') as out:
+        copy_group(inp, out)
@@ -0,0 +1,155 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Pool of fixed size memory blocks backing the jadaq::buffer instances that
+ * carry data from the digitizers to the data writers.
+ *
+ */
+
+#include "BufferPool.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef JADAQ_NUMA
+#include <numa.h>
+#endif
+#include "xtrace.h"
+
+using namespace jadaq;
+
+std::atomic<BufferPool *> BufferPool::shared{nullptr};
+
+static constexpr const size_t cacheLine = 64;
+static constexpr const size_t hugePageSize = 2 << 20;
+
+static size_t roundup(size_t n, size_t multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+BufferPool::BufferPool(size_t blockSize, size_t blocks, int node, bool hugePages)
+    : size(roundup(blockSize, cacheLine)) {
+  if (blocks == 0) {
+    throw std::invalid_argument{"Buffer pool needs at least one block"};
+  }
+  const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  void *p = MAP_FAILED;
+  if (hugePages) {
+    regionSize = roundup(size * blocks, hugePageSize);
+    p = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      XTRACE(MAIN, WAR, "No huge pages reserved for the buffer pool - using transparent huge pages");
+    } else {
+      stats.hugePages = true;
+    }
+  }
+  if (p == MAP_FAILED) {
+    regionSize = roundup(size * blocks, hugePages ? hugePageSize : pageSize);
+    p = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::runtime_error{"Could not map " + std::to_string(regionSize) + " bytes for the buffer pool"};
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugePages) {
+      madvise(p, regionSize, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  region = (char *)p;
+  if (node >= 0) {
+#ifdef JADAQ_NUMA
+    if (numa_available() < 0 || node > numa_max_node()) {
+      XTRACE(MAIN, WAR, "NUMA node %d not available - buffer pool placed by the kernel", node);
+    } else {
+      numa_tonode_memory(region, regionSize, node);
+      stats.node = node;
+    }
+#else
+    XTRACE(MAIN, WAR, "Built without libnuma - buffer pool not bound to node %d", node);
+#endif
+  }
+  // fault every page in now rather than on the acquisition path
+  memset(region, 0, regionSize);
+  stats.blocks = regionSize / size;
+  stats.blockSize = size;
+  free.reserve(stats.blocks);
+  // hand out blocks from the start of the region first
+  for (size_t i = stats.blocks; i > 0; --i) {
+    free.push_back(region + (i - 1) * size);
+  }
+  XTRACE(MAIN, INF, "Buffer pool of %zu blocks of %zu bytes%s", stats.blocks, size,
+         stats.hugePages ? " on huge pages" : "");
+}
+
+BufferPool::~BufferPool() {
+  if (shared.load() == this) {
+    shared.store(nullptr);
+  }
+  if (stats.inUse > 0) {
+    XTRACE(MAIN, WAR, "Buffer pool released with %zu blocks in use", stats.inUse);
+  }
+  munmap(region, regionSize);
+}
+
+char *BufferPool::acquire() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!free.empty()) {
+      char *block = free.back();
+      free.pop_back();
+      stats.highWater = std::max(stats.highWater, ++stats.inUse);
+      return block;
+    }
+    stats.misses++;
+  }
+  return new char[size];
+}
+
+void BufferPool::release(char *block) {
+  if (!owns(block)) {
+    delete[] block;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  free.push_back(block);
+  stats.inUse--;
+}
+
+BufferPool::Stats BufferPool::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+char *BufferPool::allocate(size_t size) {
+  BufferPool *pool = shared.load();
+  if (pool && size <= pool->blockSize()) {
+    return pool->acquire();
+  }
+  return new char[size];
+}
+
+void BufferPool::deallocate(char *block) {
+  BufferPool *pool = shared.load();
+  if (pool && pool->owns(block)) {
+    pool->release(block);
+  } else {
+    delete[] block;
+  }
+}
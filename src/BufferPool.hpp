@@ -0,0 +1,91 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Pool of fixed size memory blocks backing the jadaq::buffer instances that
+ * carry data from the digitizers to the data writers.
+ *
+ */
+
+#ifndef JADAQ_BUFFERPOOL_HPP
+#define JADAQ_BUFFERPOOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace jadaq {
+
+/* All blocks are carved out of one mapping that is faulted in up front, so
+ * taking and returning a block never reaches the system allocator. The
+ * mapping can be backed by huge pages and bound to a NUMA node. When the pool
+ * runs dry blocks are taken from the heap instead and counted as misses.
+ *
+ * One pool can be made the shared pool that jadaq::buffer allocates from. It
+ * must outlive every buffer allocated while it was shared.
+ */
+class BufferPool {
+public:
+  struct Stats {
+    size_t blocks = 0;     // blocks in the pool
+    size_t blockSize = 0;  // bytes per block
+    size_t inUse = 0;      // blocks handed out
+    size_t highWater = 0;  // most blocks handed out at once
+    uint64_t misses = 0;   // allocations served from the heap
+    bool hugePages = false; // backed by explicit huge pages
+    int node = -1;         // NUMA node the memory is bound to, -1 if none
+  };
+
+  /* node < 0 leaves placement to the kernel. Huge pages fall back to
+   * transparent huge pages on normal pages when none are reserved. */
+  BufferPool(size_t blockSize, size_t blocks, int node = -1, bool hugePages = false);
+  ~BufferPool();
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  /* A block of blockSize() bytes - from the heap when the pool is empty */
+  char *acquire();
+  void release(char *block);
+  bool owns(const char *block) const { return block >= region && block < region + regionSize; }
+  size_t blockSize() const { return size; }
+  Stats getStats() const;
+
+  static void setShared(BufferPool *pool) { shared.store(pool); }
+  static BufferPool *getShared() { return shared.load(); }
+  /* size bytes from the shared pool if there is one and the blocks are large
+   * enough, otherwise from the heap */
+  static char *allocate(size_t size);
+  static void deallocate(char *block);
+
+private:
+  static std::atomic<BufferPool *> shared;
+  const size_t size;
+  char *region = nullptr;
+  size_t regionSize = 0;
+  mutable std::mutex mutex;
+  std::vector<char *> free;
+  Stats stats;
+};
+
+} // namespace jadaq
+
+#endif // JADAQ_BUFFERPOOL_HPP
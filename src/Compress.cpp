@@ -0,0 +1,327 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Compression of buffers of elements into self describing blocks.
+ *
+ */
+
+#include "Compress.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <zlib.h>
+#ifdef JADAQ_LZ4
+#include <lz4.h>
+#endif
+#ifdef JADAQ_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+const size_t run = 16; // samples bit packed with one width
+
+/* Bytes the delta filter needs at most */
+size_t filteredBound(size_t n, size_t elementSize, size_t headSize) {
+  const size_t samples = (elementSize - headSize) / 2;
+  return n * (elementSize + (samples + run - 1) / run);
+}
+
+inline uint16_t zigzag(uint16_t value, uint16_t previous) {
+  const int16_t d = (int16_t)(value - previous);
+  return (uint16_t)((d << 1) ^ (d >> 15));
+}
+inline uint16_t unzigzag(uint16_t z, uint16_t previous) {
+  return (uint16_t)(previous + (uint16_t)((z >> 1) ^ -(z & 1)));
+}
+
+/* Delta code and bit pack samples, returns the end of the output */
+char *packSamples(const uint16_t *samples, size_t count, char *out) {
+  uint16_t previous = 0;
+  for (size_t i = 0; i < count; i += run) {
+    const size_t k = std::min(run, count - i);
+    uint16_t z[run];
+    uint16_t any = 0;
+    for (size_t j = 0; j < k; ++j) {
+      uint16_t s;
+      memcpy(&s, samples + i + j, sizeof(s));
+      z[j] = zigzag(s, previous);
+      previous = s;
+      any |= z[j];
+    }
+    const unsigned width = any ? 32 - __builtin_clz(any) : 0;
+    *out++ = (char)width;
+    uint64_t bits = 0;
+    unsigned used = 0;
+    for (size_t j = 0; j < k; ++j) {
+      bits |= (uint64_t)z[j] << used;
+      used += width;
+      while (used >= 8) {
+        *out++ = (char)bits;
+        bits >>= 8;
+        used -= 8;
+      }
+    }
+    if (used > 0)
+      *out++ = (char)bits;
+  }
+  return out;
+}
+
+/* Reverse of packSamples, returns the end of the input or nullptr past end */
+const char *unpackSamples(const char *in, const char *end, size_t count, uint16_t *samples) {
+  uint16_t previous = 0;
+  for (size_t i = 0; i < count; i += run) {
+    const size_t k = std::min(run, count - i);
+    if (in >= end)
+      return nullptr;
+    const unsigned width = (uint8_t)*in++;
+    if (width > 16 || (size_t)(end - in) < (k * width + 7) / 8)
+      return nullptr;
+    const uint32_t mask = (1u << width) - 1;
+    uint64_t bits = 0;
+    unsigned have = 0;
+    for (size_t j = 0; j < k; ++j) {
+      while (have < width) {
+        bits |= (uint64_t)(uint8_t)*in++ << have;
+        have += 8;
+      }
+      const uint16_t s = unzigzag((uint16_t)(bits & mask), previous);
+      bits >>= width;
+      have -= width;
+      memcpy(samples + i + j, &s, sizeof(s));
+      previous = s;
+    }
+  }
+  return in;
+}
+
+size_t deltaFilter(const char *elements, size_t n, size_t elementSize, size_t headSize, char *out) {
+  char *p = out;
+  for (size_t b = 0; b < headSize; ++b) {
+    const char *in = elements + b;
+    for (size_t i = 0; i < n; ++i, in += elementSize)
+      *p++ = *in;
+  }
+  const size_t samples = (elementSize - headSize) / 2;
+  if (samples > 0) {
+    for (size_t i = 0; i < n; ++i)
+      p = packSamples((const uint16_t *)(elements + i * elementSize + headSize), samples, p);
+  }
+  return p - out;
+}
+
+bool deltaUnfilter(const char *in, size_t size, size_t n, size_t elementSize, size_t headSize, char *elements) {
+  const char *end = in + size;
+  if (size < n * headSize)
+    return false;
+  for (size_t b = 0; b < headSize; ++b) {
+    char *out = elements + b;
+    for (size_t i = 0; i < n; ++i, out += elementSize)
+      *out = *in++;
+  }
+  const size_t samples = (elementSize - headSize) / 2;
+  if (samples > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      in = unpackSamples(in, end, samples, (uint16_t *)(elements + i * elementSize + headSize));
+      if (in == nullptr)
+        return false;
+    }
+  }
+  return in == end;
+}
+
+/* Compress size bytes from in to out, returns the compressed size or 0 if it does not fit */
+size_t compressWith(jadaq::compress::Codec codec, const char *in, size_t size, char *out, size_t capacity) {
+  switch (codec) {
+  case jadaq::compress::Codec::None:
+    if (size > capacity)
+      return 0;
+    memcpy(out, in, size);
+    return size;
+  case jadaq::compress::Codec::Deflate: {
+    uLongf outSize = capacity;
+    if (compress2((Bytef *)out, &outSize, (const Bytef *)in, size, 1) != Z_OK)
+      return 0;
+    return outSize;
+  }
+  case jadaq::compress::Codec::LZ4:
+#ifdef JADAQ_LZ4
+    return std::max(0, LZ4_compress_default(in, out, (int)size, (int)capacity));
+#else
+    break;
+#endif
+  case jadaq::compress::Codec::Zstd: {
+#ifdef JADAQ_ZSTD
+    const size_t outSize = ZSTD_compress(out, capacity, in, size, 1);
+    return ZSTD_isError(outSize) ? 0 : outSize;
+#else
+    break;
+#endif
+  }
+  }
+  throw std::invalid_argument("Compression codec not available");
+}
+
+/* Decompress size bytes from in to exactly expected bytes at out */
+bool decompressWith(jadaq::compress::Codec codec, const char *in, size_t size, char *out, size_t expected) {
+  switch (codec) {
+  case jadaq::compress::Codec::None:
+    if (size != expected)
+      return false;
+    memcpy(out, in, size);
+    return true;
+  case jadaq::compress::Codec::Deflate: {
+    uLongf outSize = expected;
+    return uncompress((Bytef *)out, &outSize, (const Bytef *)in, size) == Z_OK && outSize == expected;
+  }
+  case jadaq::compress::Codec::LZ4:
+#ifdef JADAQ_LZ4
+    return LZ4_decompress_safe(in, out, (int)size, (int)expected) == (int)expected;
+#else
+    break;
+#endif
+  case jadaq::compress::Codec::Zstd: {
+#ifdef JADAQ_ZSTD
+    const size_t outSize = ZSTD_decompress(out, expected, in, size);
+    return !ZSTD_isError(outSize) && outSize == expected;
+#else
+    break;
+#endif
+  }
+  }
+  return false;
+}
+} // namespace
+
+namespace jadaq {
+namespace compress {
+Method parse(const std::string &method) {
+  Method m;
+  size_t start = 0;
+  while (start <= method.size()) {
+    size_t end = method.find('+', start);
+    if (end == std::string::npos)
+      end = method.size();
+    const std::string part = method.substr(start, end - start);
+    if (part == "delta" && m.filter == Filter::None)
+      m.filter = Filter::Delta;
+    else if (part == "deflate" && m.codec == Codec::None)
+      m.codec = Codec::Deflate;
+    else if (part == "lz4" && m.codec == Codec::None)
+      m.codec = Codec::LZ4;
+    else if (part == "zstd" && m.codec == Codec::None)
+      m.codec = Codec::Zstd;
+    else
+      throw std::invalid_argument("Unknown compression: " + method);
+    start = end + 1;
+  }
+  if (!available(m.codec))
+    throw std::invalid_argument("jadaq is built without " + name(m));
+  return m;
+}
+
+std::string name(Method method) {
+  static const char *codecs[] = {"", "deflate", "lz4", "zstd"};
+  std::string n = method.filter == Filter::Delta ? "delta" : "";
+  if (method.codec != Codec::None)
+    n += (n.empty() ? "" : "+") + std::string(codecs[(int)method.codec]);
+  return n.empty() ? "none" : n;
+}
+
+bool available(Codec codec) {
+  switch (codec) {
+  case Codec::LZ4:
+#ifdef JADAQ_LZ4
+    return true;
+#else
+    return false;
+#endif
+  case Codec::Zstd:
+#ifdef JADAQ_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  default:
+    return true;
+  }
+}
+
+size_t encode(Method method, uint16_t elementType, const char *elements, size_t n, size_t elementSize,
+              size_t headSize, char *out, size_t capacity, std::vector<char> &scratch) {
+  Data::CompressedHeader header;
+  if (capacity < sizeof(header))
+    return 0;
+  if (headSize > elementSize || (elementSize - headSize) % 2 != 0)
+    headSize = elementSize; // no whole 16 bit samples - filter it all as head
+  header.elementType = elementType;
+  header.filter = (uint8_t)method.filter;
+  header.codec = (uint8_t)method.codec;
+  header.elementSize = (uint32_t)elementSize;
+  header.headSize = (uint32_t)headSize;
+  header.numElements = (uint32_t)n;
+  const char *filtered = elements;
+  size_t filteredSize = n * elementSize;
+  if (method.filter == Filter::Delta) {
+    scratch.resize(filteredBound(n, elementSize, headSize));
+    filteredSize = deltaFilter(elements, n, elementSize, headSize, scratch.data());
+    filtered = scratch.data();
+  }
+  header.filteredSize = (uint32_t)filteredSize;
+  const size_t size =
+      compressWith(method.codec, filtered, filteredSize, out + sizeof(header), capacity - sizeof(header));
+  if (size == 0 && filteredSize > 0)
+    return 0;
+  header.size = (uint32_t)size;
+  memcpy(out, &header, sizeof(header));
+  return sizeof(header) + size;
+}
+
+Data::CompressedHeader decode(const char *block, size_t size, std::vector<char> &elements,
+                              std::vector<char> &scratch) {
+  Data::CompressedHeader header;
+  if (size < sizeof(header))
+    throw std::runtime_error("Compressed block too short");
+  memcpy(&header, block, sizeof(header));
+  if (header.size != size - sizeof(header) || header.headSize > header.elementSize ||
+      header.filter > (uint8_t)Filter::Delta || header.codec > (uint8_t)Codec::Zstd)
+    throw std::runtime_error("Compressed block header is not valid");
+  Method method;
+  method.filter = (Filter)header.filter;
+  method.codec = (Codec)header.codec;
+  elements.resize((size_t)header.numElements * header.elementSize);
+  char *filtered = elements.data();
+  if (method.filter == Filter::Delta) {
+    scratch.resize(header.filteredSize);
+    filtered = scratch.data();
+  } else if (header.filteredSize != elements.size()) {
+    throw std::runtime_error("Compressed block size is not valid");
+  }
+  if (!decompressWith(method.codec, block + sizeof(header), header.size, filtered, header.filteredSize))
+    throw std::runtime_error("Compressed block data is not valid");
+  if (method.filter == Filter::Delta &&
+      !deltaUnfilter(filtered, header.filteredSize, header.numElements, header.elementSize, header.headSize,
+                     elements.data()))
+    throw std::runtime_error("Compressed block samples are not valid");
+  return header;
+}
+} // namespace compress
+} // namespace jadaq
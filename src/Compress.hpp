@@ -0,0 +1,71 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Compression of buffers of elements into self describing blocks.
+ *
+ */
+
+#ifndef JADAQ_COMPRESS_HPP
+#define JADAQ_COMPRESS_HPP
+
+#include "DataFormat.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* A block is a Data::CompressedHeader followed by the compressed data. The
+ * elements are first filtered and then compressed by the codec:
+ *
+ * Delta: the fixed head of each element - everything before the samples -
+ * is byte transposed so equal fields line up, and the 16 bit samples are
+ * delta coded per element and bit packed in runs of 16 with the bit width of
+ * each run in a byte before it, so slowly varying samples take a few bits.
+ */
+namespace jadaq {
+namespace compress {
+enum class Filter : uint8_t { None, Delta };
+enum class Codec : uint8_t { None, Deflate, LZ4, Zstd };
+struct Method {
+  Filter filter = Filter::None;
+  Codec codec = Codec::None;
+};
+
+/* Parse e.g. "delta", "lz4" or "delta+zstd" - throws std::invalid_argument */
+Method parse(const std::string &method);
+std::string name(Method method);
+/* Whether jadaq was built with the codec */
+bool available(Codec codec);
+
+/* Compress n elements of elementSize bytes, each holding 16 bit samples from
+ * headSize bytes on, into a block in out. Returns the size of the block or 0
+ * if it does not fit in capacity. scratch is reused between calls. */
+size_t encode(Method method, uint16_t elementType, const char *elements, size_t n, size_t elementSize,
+              size_t headSize, char *out, size_t capacity, std::vector<char> &scratch);
+
+/* Decompress the block of size bytes at block into elements. Returns the
+ * header of the block - throws std::runtime_error if it is not valid */
+Data::CompressedHeader decode(const char *block, size_t size, std::vector<char> &elements,
+                              std::vector<char> &scratch);
+} // namespace compress
+} // namespace jadaq
+
+#endif // JADAQ_COMPRESS_HPP
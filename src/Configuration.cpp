@@ -102,10 +102,99 @@ static pt::ptree rangeNode(Digitizer &digitizer, FunctionID id, int begin,
   return ptree;
 }
 
+/* Read and remove the SIM_* keys of a simulated digitizer section */
+static Simulator::Settings simulatorSettings(pt::ptree &conf) {
+  Simulator::Settings settings;
+  settings.rate = conf.get<double>("SIM_RATE", settings.rate);
+  settings.groupMask = s2ui8(conf.get<std::string>("SIM_GROUP_MASK", "1"));
+  std::string weights = conf.get<std::string>("SIM_CHANNELS", "");
+  if (!weights.empty()) {
+    settings.channelWeights.clear();
+    std::stringstream ss(weights);
+    std::string weight;
+    while (std::getline(ss, weight, ',')) {
+      settings.channelWeights.push_back(std::stod(weight));
+    }
+  }
+  std::string charge = conf.get<std::string>("SIM_CHARGE", "");
+  if (!charge.empty()) {
+    std::stringstream ss(charge);
+    std::string spectrum;
+    ss >> spectrum >> settings.chargeA >> settings.chargeB;
+    if (ss.fail()) {
+      throw std::invalid_argument{"SIM_CHARGE must be <spectrum> <a> <b>"};
+    }
+    if (spectrum == "uniform") {
+      settings.spectrum = generator::DPPQDC::Spectrum::Uniform;
+    } else if (spectrum == "gauss") {
+      settings.spectrum = generator::DPPQDC::Spectrum::Gauss;
+    } else if (spectrum == "exponential") {
+      settings.spectrum = generator::DPPQDC::Spectrum::Exponential;
+    } else {
+      throw std::invalid_argument{"SIM_CHARGE spectrum must be uniform, gauss or exponential"};
+    }
+  }
+  settings.timeOffset = std::stoull(conf.get<std::string>("SIM_TIME_OFFSET", "0"), nullptr, 0);
+  settings.clock = conf.get<double>("SIM_CLOCK", settings.clock);
+  settings.extras = conf.get<int>("SIM_EXTRAS", settings.extras) != 0;
+  settings.samples = conf.get<uint16_t>("SIM_WAVEFORM", settings.samples);
+  settings.eventsPerAggregate = conf.get<uint32_t>("SIM_EVENTS_PER_AGGREGATE", settings.eventsPerAggregate);
+  settings.burstPeriod = conf.get<uint32_t>("SIM_BURST_PERIOD", settings.burstPeriod);
+  settings.burstLength = conf.get<uint32_t>("SIM_BURST_LENGTH", settings.burstLength);
+  settings.burstRate = conf.get<double>("SIM_BURST_RATE", settings.burstRate);
+  settings.seed = conf.get<uint32_t>("SIM_SEED", settings.seed);
+  settings.bufferSize = conf.get<size_t>("SIM_BUFFER", settings.bufferSize);
+  for (const char *key : {"SIM", "SIM_RATE", "SIM_GROUP_MASK", "SIM_CHANNELS", "SIM_CHARGE", "SIM_TIME_OFFSET",
+                          "SIM_CLOCK", "SIM_EXTRAS", "SIM_WAVEFORM", "SIM_EVENTS_PER_AGGREGATE", "SIM_BURST_PERIOD",
+                          "SIM_BURST_LENGTH", "SIM_BURST_RATE", "SIM_SEED", "SIM_BUFFER"}) {
+    conf.erase(key);
+  }
+  return settings;
+}
+
+static void putSimulatorSettings(pt::ptree &dPtree, const Simulator::Settings &settings) {
+  static const char *spectrum[] = {"uniform", "gauss", "exponential"};
+  dPtree.put("SIM", 1);
+  dPtree.put("SIM_RATE", settings.rate);
+  dPtree.put("SIM_GROUP_MASK", hex_string((uint32_t)settings.groupMask));
+  std::stringstream weights;
+  for (size_t i = 0; i < settings.channelWeights.size(); ++i) {
+    weights << (i ? "," : "") << settings.channelWeights[i];
+  }
+  dPtree.put("SIM_CHANNELS", weights.str());
+  std::stringstream charge;
+  charge << spectrum[(int)settings.spectrum] << ' ' << settings.chargeA << ' ' << settings.chargeB;
+  dPtree.put("SIM_CHARGE", charge.str());
+  dPtree.put("SIM_TIME_OFFSET", hex_string(settings.timeOffset));
+  dPtree.put("SIM_CLOCK", settings.clock);
+  dPtree.put("SIM_EXTRAS", (int)settings.extras);
+  dPtree.put("SIM_WAVEFORM", settings.samples);
+  dPtree.put("SIM_EVENTS_PER_AGGREGATE", settings.eventsPerAggregate);
+  dPtree.put("SIM_BURST_PERIOD", settings.burstPeriod);
+  dPtree.put("SIM_BURST_LENGTH", settings.burstLength);
+  dPtree.put("SIM_BURST_RATE", settings.burstRate);
+  dPtree.put("SIM_SEED", settings.seed);
+  dPtree.put("SIM_BUFFER", settings.bufferSize);
+}
+
 pt::ptree Configuration::readBack() {
   pt::ptree out;
   for (Digitizer &digitizer : digitizers) {
     pt::ptree dPtree;
+    if (digitizer.simulation()) {
+      putSimulatorSettings(dPtree, digitizer.simulation()->getSettings());
+      out.put_child(digitizer.name(), dPtree);
+      continue; // nothing to read back from a simulated board
+    }
+    if (digitizer.replaying()) {
+      const raw::Replay &replay = *digitizer.replaying();
+      dPtree.put("REPLAY", replay.getFilename());
+      dPtree.put("REPLAY_ID", replay.digitizerID());
+      dPtree.put("REPLAY_SPEED", replay.fullSpeed() ? "max" : "recorded");
+      dPtree.put("REPLAY_LOOP", (int)replay.looping());
+      out.put_child(digitizer.name(), dPtree);
+      continue;
+    }
     switch (digitizer.linkType) {
     case CAEN_DGTZ_USB:
       dPtree.put("USB", digitizer.linkNum);
@@ -119,6 +208,11 @@ pt::ptree Configuration::readBack() {
     }
     dPtree.put("VME", hex_string(digitizer.VMEBaseAddress));
     dPtree.put("CONET", digitizer.conetNode);
+    if (digitizer.interruptReadout()) {
+      dPtree.put("IRQ_EVENTS", digitizer.interruptEvents());
+      dPtree.put("IRQ_TIMEOUT", digitizer.interruptTimeout());
+      dPtree.put("IRQ_MODE", digitizer.interruptMode() == CAEN_DGTZ_IRQ_MODE_ROAK ? "ROAK" : "RORA");
+    }
 
     for (FunctionID id = functionIDbegin(); id < functionIDend(); ++id) {
       if (!takeIndex(id)) {
@@ -233,7 +327,42 @@ void Configuration::apply() {
     conf.erase("VME");
     conet = conf.get<int>("CONET", 0);
     conf.erase("CONET");
+    int irqEvents = conf.get<int>("IRQ_EVENTS", 0);
+    conf.erase("IRQ_EVENTS");
+    if (irqEvents < 0 || irqEvents > 0xffff) {
+      std::cerr << "ERROR: [" << name << "] IRQ_EVENTS must be 0 to 65535" << std::endl;
+      throw std::invalid_argument{"Invalid IRQ_EVENTS"};
+    }
+    uint32_t irqTimeout = conf.get<uint32_t>("IRQ_TIMEOUT", 100);
+    conf.erase("IRQ_TIMEOUT");
+    std::string irqMode = conf.get<std::string>("IRQ_MODE", "RORA");
+    conf.erase("IRQ_MODE");
     Digitizer *digitizer = nullptr;
+    if (conf.get<int>("SIM", 0)) {
+      XTRACE(CONF, INF, "[%s] is a simulated digitizer", name.c_str());
+      digitizers.emplace_back((CAEN_DGTZ_ConnectionType)ECDC_NULL_CONNECTION, -1, conet, vme);
+      try {
+        digitizers.rbegin()->simulate(simulatorSettings(conf));
+      } catch (std::invalid_argument &e) {
+        std::cerr << "ERROR: [" << name << "] " << e.what() << std::endl;
+        throw;
+      }
+      continue;
+    }
+    std::string replay = conf.get<std::string>("REPLAY", "");
+    if (!replay.empty()) {
+      uint32_t replayID = conf.get<uint32_t>("REPLAY_ID", 0);
+      std::string speed = conf.get<std::string>("REPLAY_SPEED", "recorded");
+      bool loop = conf.get<int>("REPLAY_LOOP", 0) != 0;
+      if (speed != "recorded" && speed != "max") {
+        std::cerr << "ERROR: [" << name << "] REPLAY_SPEED must be recorded or max" << std::endl;
+        throw std::invalid_argument{"Invalid REPLAY_SPEED"};
+      }
+      XTRACE(CONF, INF, "[%s] replays %s", name.c_str(), replay.c_str());
+      digitizers.emplace_back((CAEN_DGTZ_ConnectionType)ECDC_NULL_CONNECTION, -1, conet, vme);
+      digitizers.rbegin()->replay(replay, replayID, speed == "max", loop);
+      continue;
+    }
     if (usb < 0 && optical < 0) {
       XTRACE(CONF, ERR, "ERROR: [%s] contains neither USB nor OPTICAL number. One is REQUIRED.", name.c_str());
       digitizers.emplace_back((CAEN_DGTZ_ConnectionType)ECDC_NULL_CONNECTION, optical, conet, vme);
@@ -254,6 +383,18 @@ void Configuration::apply() {
     //   XTRACE(MAIN, ERR, "ERROR: Unable to open digitizer [%s]:", name.c_str(), e.what());
     //   throw;
     // }
+    if (irqEvents > 0) {
+      if (irqMode != "RORA" && irqMode != "ROAK") {
+        std::cerr << "ERROR: [" << name << "] IRQ_MODE must be RORA or ROAK" << std::endl;
+        throw std::invalid_argument{"Invalid IRQ_MODE"};
+      }
+      try {
+        digitizer->setInterruptReadout((uint16_t)irqEvents, irqTimeout,
+                                       irqMode == "ROAK" ? CAEN_DGTZ_IRQ_MODE_ROAK : CAEN_DGTZ_IRQ_MODE_RORA);
+      } catch (std::invalid_argument &e) {
+        XTRACE(CONF, ERR, "ERROR: [%s] %s - falling back to polling.", name.c_str(), e.what());
+      }
+    }
     configure(*digitizer, conf, getVerbose());
   }
 }
@@ -43,14 +43,23 @@ namespace Data {
      // store version as Big Endian for backwards compatibility
     const uint16_t currentVersion = (version_min << 8) + version_maj;
     const constexpr uint16_t WaveformBase = 1<<8;
+    const constexpr uint16_t PackedBase = 1<<9; // waveform with bit packed samples
     enum ElementType: uint16_t
     {
         None,
         List422,
         List8222,
         Standard, // non-DPP standard data with waveform
+        Event,    // hits from several digitizers grouped into events
+        List822,  // List422 with the time tag extended to 64 bit
+        Compressed, // a compressed block of elements of another type
         Waveform422 = WaveformBase | List422,
         Waveform8222 = WaveformBase | List8222,
+        Waveform822 = WaveformBase | List822,
+        PackedStandard = PackedBase | Standard,
+        Packed422 = PackedBase | List422,
+        Packed8222 = PackedBase | List8222,
+        Packed822 = PackedBase | List822,
     };
     /* Shared meta data for the entire data package */
     struct __attribute__ ((__packed__)) Header // 32 bytes
@@ -80,6 +89,28 @@ namespace Data {
             channel = event.channel(group);
             charge = event.charge();
         }
+        static constexpr const bool fixedSize = true;
+        /* Batch decode n events of stride words each (as found in one group
+         * aggregate) into the contiguous array out */
+        static constexpr const bool batchDecode = true;
+        static void decode(const uint32_t* events, size_t n, size_t stride, uint16_t group, ListElement422* out)
+        {
+            if (stride == 2)
+                decode_(events, n, 2, group, out); // constant stride for the common layout
+            else
+                decode_(events, n, stride, group, out);
+        }
+        static inline void decode_(const uint32_t* events, size_t n, size_t stride, uint16_t group, ListElement422* out)
+        {
+            const uint16_t base = (uint16_t)(group << 3);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const uint32_t* e = events + i*stride;
+                out[i].time = e[0];
+                out[i].channel = base | (uint16_t)(e[stride-1] >> 28);
+                out[i].charge = (uint16_t)(e[stride-1] & 0x0000ffffu);
+            }
+        }
         bool operator< (const ListElement422& rhs) const
         {
             return time < rhs.time || (time == rhs.time && channel < rhs.channel) ;
@@ -126,6 +157,29 @@ namespace Data {
             charge = event.charge();
             baseline = event.baseline();
         }
+        static constexpr const bool fixedSize = true;
+        /* Batch decode n events of stride words each (as found in one group
+         * aggregate) into the contiguous array out */
+        static constexpr const bool batchDecode = true;
+        static void decode(const uint32_t* events, size_t n, size_t stride, uint16_t group, ListElement8222* out)
+        {
+            if (stride == 3)
+                decode_(events, n, 3, group, out); // constant stride for the common layout
+            else
+                decode_(events, n, stride, group, out);
+        }
+        static inline void decode_(const uint32_t* events, size_t n, size_t stride, uint16_t group, ListElement8222* out)
+        {
+            const uint16_t base = (uint16_t)(group << 3);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const uint32_t* e = events + i*stride;
+                out[i].time = ((uint64_t)e[0]) | (((uint64_t)(e[stride-2] & 0x0000ffffu))<<32);
+                out[i].channel = base | (uint16_t)(e[stride-1] >> 28);
+                out[i].charge = (uint16_t)(e[stride-1] & 0x0000ffffu);
+                out[i].baseline = (uint16_t)(e[stride-2] >> 16);
+            }
+        }
         bool operator< (const ListElement8222& rhs) const
         {
             return time < rhs.time || (time == rhs.time && channel < rhs.channel) ;
@@ -157,6 +211,75 @@ namespace Data {
     };
     static_assert(std::is_pod<ListElement8222>::value, "Data::ListElement8222 must be POD");
 
+    /* ListElement422 with a 64 bit time. The DPP-QDC time tag is 32 bit and
+     * the upper half is the number of rollovers of the group since the start
+     * of the run, counted by the DataHandler - see setEpoch() */
+    struct __attribute__ ((__packed__)) ListElement822
+    {
+        typedef uint64_t time_t;
+        typedef DPPQDCEvent EventType;
+        time_t time;
+        uint16_t channel;
+        uint16_t charge;
+        ListElement822() = default;
+        ListElement822(const EventType& event, uint16_t group)
+        {
+            time = event.timeTag();
+            channel = event.channel(group);
+            charge = event.charge();
+        }
+        static constexpr const bool fixedSize = true;
+        /* Batch decode n events of stride words each (as found in one group
+         * aggregate) into the contiguous array out */
+        static constexpr const bool batchDecode = true;
+        static void decode(const uint32_t* events, size_t n, size_t stride, uint16_t group, ListElement822* out)
+        {
+            if (stride == 2)
+                decode_(events, n, 2, group, out); // constant stride for the common layout
+            else
+                decode_(events, n, stride, group, out);
+        }
+        static inline void decode_(const uint32_t* events, size_t n, size_t stride, uint16_t group, ListElement822* out)
+        {
+            const uint16_t base = (uint16_t)(group << 3);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const uint32_t* e = events + i*stride;
+                out[i].time = e[0];
+                out[i].channel = base | (uint16_t)(e[stride-1] >> 28);
+                out[i].charge = (uint16_t)(e[stride-1] & 0x0000ffffu);
+            }
+        }
+        bool operator< (const ListElement822& rhs) const
+        {
+            return time < rhs.time || (time == rhs.time && channel < rhs.channel) ;
+        };
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(channel) << " " << PRINTD(time) << " " << PRINTD(charge);
+        }
+        static ElementType type() { return List822; }
+        static void insertMembers(H5::CompType& datatype)
+        {
+            datatype.insertMember("time", HOFFSET(ListElement822, time), H5::PredType::NATIVE_UINT64);
+            datatype.insertMember("channel", HOFFSET(ListElement822, channel), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("charge", HOFFSET(ListElement822, charge), H5::PredType::NATIVE_UINT16);
+        }
+        static size_t size() { return sizeof(ListElement822); }
+        static size_t size(size_t) { return size(); }
+        static H5::CompType h5type()
+        {
+            H5::CompType datatype(size());
+            insertMembers(datatype);
+            return datatype;
+        }
+        static void headerOn(std::ostream& os)
+        {
+            os << PRINTH(channel) << " " << PRINTH(time) << " " << PRINTH(charge);
+        }
+    };
+    static_assert(std::is_pod<ListElement822>::value, "Data::ListElement822 must be POD");
+
     struct __attribute__ ((__packed__)) StdElement751
     {
         typedef uint32_t time_t;
@@ -173,6 +296,8 @@ namespace Data {
           waveform{event} { }
         StdElement751(const EventType& event, uint16_t)
           : StdElement751(event) {}
+        static constexpr const bool batchDecode = false;
+        static constexpr const bool fixedSize = false;
         bool operator< (const StdElement751& rhs) const
         {
             return time < rhs.time;
@@ -209,6 +334,58 @@ namespace Data {
     };
     static_assert(std::is_pod<StdElement751>::value, "Data::StdElement751 must be POD");
 
+    /* StdElement751 with the samples packed to 10 bits */
+    struct __attribute__ ((__packed__)) StdPackedElement751
+    {
+        typedef uint32_t time_t;
+        typedef StdEventWaveform<StdEvent751> EventType;
+        time_t time;
+        uint8_t channelMask;
+        uint32_t eventNo;
+        PackedStdWaveform waveform;
+        StdPackedElement751() = default;
+        StdPackedElement751(const EventType& event, uint16_t)
+          : time(event.timeTag()),
+          channelMask(event.channelMask()),
+          eventNo(event.eventNo())
+        {
+            waveform.pack(event);
+        }
+        static constexpr const bool batchDecode = false;
+        static constexpr const bool fixedSize = false;
+        bool operator< (const StdPackedElement751& rhs) const
+        {
+            return time < rhs.time;
+        };
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(channelMask) << " " << PRINTD(time) << " " << PRINTD(eventNo) << " ";
+            waveform.printOn(os);
+        }
+        static ElementType type() { return PackedStandard; }
+        void insertMembers(H5::CompType& datatype) const
+        {
+            datatype.insertMember("time", HOFFSET(StdPackedElement751, time), H5::PredType::NATIVE_UINT32);
+            datatype.insertMember("channelMask", HOFFSET(StdPackedElement751, channelMask), H5::PredType::NATIVE_UINT8);
+            datatype.insertMember("eventNo", HOFFSET(StdPackedElement751, eventNo), H5::PredType::NATIVE_UINT32);
+            waveform.insertMembers(datatype,offsetof(StdPackedElement751,waveform));
+        }
+        static size_t size(size_t samples) {
+          return sizeof(StdPackedElement751) - sizeof(PackedStdWaveform) + PackedStdWaveform::size(samples);
+        }
+        H5::CompType h5type() const
+        {
+          H5::CompType datatype(size(waveform.num_samples));
+          insertMembers(datatype);
+          return datatype;
+        }
+        static void headerOn(std::ostream& os)
+        {
+          StdElement751::headerOn(os);
+        }
+    };
+    static_assert(std::is_pod<StdPackedElement751>::value, "Data::StdPackedElement751 must be POD");
+
 
 
     template <typename ListElementType>
@@ -221,6 +398,8 @@ namespace Data {
         DPPQDCWaveformElement(const EventType& event, uint16_t group)
                 : listElement(event,group)
                 , waveform{event} {}
+        static constexpr const bool batchDecode = false;
+        static constexpr const bool fixedSize = false;
         bool operator< (const DPPQDCWaveformElement& rhs) const
         { return listElement < rhs.listElement; }
         void printOn(std::ostream& os) const
@@ -249,6 +428,154 @@ namespace Data {
     };
     static_assert(std::is_pod<DPPQDCWaveformElement<Data::ListElement422> >::value, "Data::DPPQDCWaveformElement<Data::ListElement422> > must be POD");
     static_assert(std::is_pod<DPPQDCWaveformElement<Data::ListElement8222> >::value, "Data::DPPQDCWaveformElement<Data::ListElement8222> > must be POD");
+    static_assert(std::is_pod<DPPQDCWaveformElement<Data::ListElement822> >::value, "Data::DPPQDCWaveformElement<Data::ListElement822> > must be POD");
+
+    /* DPPQDCWaveformElement with the samples packed to 12 bits, 25% less
+     * than in 16 bit */
+    template <typename ListElementType>
+    struct __attribute__ ((__packed__)) DPPQDCPackedWaveformElement
+    {
+        typedef DPPQDCEventWaveform<typename ListElementType::EventType> EventType;
+        ListElementType listElement;
+        PackedDPPQDCWaveform waveform;
+        DPPQDCPackedWaveformElement() = default;
+        DPPQDCPackedWaveformElement(const EventType& event, uint16_t group)
+                : listElement(event,group)
+        {
+            waveform.pack(event);
+        }
+        static constexpr const bool batchDecode = false;
+        static constexpr const bool fixedSize = false;
+        bool operator< (const DPPQDCPackedWaveformElement& rhs) const
+        { return listElement < rhs.listElement; }
+        void printOn(std::ostream& os) const
+        {
+            listElement.printOn(os); os << " ";
+            waveform.printOn(os);
+        }
+        static void headerOn(std::ostream& os)
+        {
+            ListElementType::headerOn(os);
+            PackedDPPQDCWaveform::headerOn(os);
+        }
+        static ElementType type() { return (ElementType)(PackedBase | ListElementType::type()); }
+        void insertMembers(H5::CompType& datatype) const
+        {
+            listElement.insertMembers(datatype);
+            waveform.insertMembers(datatype,offsetof(DPPQDCPackedWaveformElement,waveform));
+        }
+        static size_t size(size_t samples) { return ListElementType::size() + PackedDPPQDCWaveform::size(samples); }
+        H5::CompType h5type() const
+        {
+            H5::CompType datatype(size(waveform.num_samples));
+            insertMembers(datatype);
+            return datatype;
+        }
+    };
+    static_assert(std::is_pod<DPPQDCPackedWaveformElement<Data::ListElement422> >::value, "Data::DPPQDCPackedWaveformElement<Data::ListElement422> > must be POD");
+    static_assert(std::is_pod<DPPQDCPackedWaveformElement<Data::ListElement8222> >::value, "Data::DPPQDCPackedWaveformElement<Data::ListElement8222> > must be POD");
+    static_assert(std::is_pod<DPPQDCPackedWaveformElement<Data::ListElement822> >::value, "Data::DPPQDCPackedWaveformElement<Data::ListElement822> > must be POD");
+
+    /* Set the upper 32 bit of the time of elements that carry the 64 bit
+     * time of a 32 bit time tag - a no-op for all other elements */
+    template <typename E>
+    static inline void setEpoch(E&, uint64_t) {}
+    static inline void setEpoch(ListElement822& e, uint64_t epoch)
+    { e.time = (epoch << 32) | (uint32_t)e.time; }
+    template <typename ListElementType>
+    static inline void setEpoch(DPPQDCWaveformElement<ListElementType>& e, uint64_t epoch)
+    { setEpoch(e.listElement, epoch); }
+    template <typename ListElementType>
+    static inline void setEpoch(DPPQDCPackedWaveformElement<ListElementType>& e, uint64_t epoch)
+    { setEpoch(e.listElement, epoch); }
+
+    /* One hit of an event built across digitizers. The hits of an event are
+     * consecutive and share eventNo. time is the 64 bit board time. */
+    struct __attribute__ ((__packed__)) EventElement
+    {
+        typedef uint64_t time_t;
+        uint64_t eventNo;
+        time_t time;
+        uint32_t digitizerID;
+        uint16_t channel;
+        uint16_t charge;
+        static constexpr const bool fixedSize = true;
+        bool operator< (const EventElement& rhs) const
+        {
+            return eventNo < rhs.eventNo || (eventNo == rhs.eventNo && time < rhs.time);
+        };
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(eventNo) << " " << PRINTD(digitizerID) << " " << PRINTD(channel) << " " << PRINTD(time) << " " << PRINTD(charge);
+        }
+        static ElementType type() { return Event; }
+        static void insertMembers(H5::CompType& datatype)
+        {
+            datatype.insertMember("eventNo", HOFFSET(EventElement, eventNo), H5::PredType::NATIVE_UINT64);
+            datatype.insertMember("time", HOFFSET(EventElement, time), H5::PredType::NATIVE_UINT64);
+            datatype.insertMember("digitizerID", HOFFSET(EventElement, digitizerID), H5::PredType::NATIVE_UINT32);
+            datatype.insertMember("channel", HOFFSET(EventElement, channel), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("charge", HOFFSET(EventElement, charge), H5::PredType::NATIVE_UINT16);
+        }
+        static size_t size() { return sizeof(EventElement); }
+        static size_t size(size_t) { return size(); }
+        static H5::CompType h5type()
+        {
+            H5::CompType datatype(size());
+            insertMembers(datatype);
+            return datatype;
+        }
+        static void headerOn(std::ostream& os)
+        {
+            os << PRINTH(eventNo) << " " << PRINTH(digitizerID) << " " << PRINTH(channel) << " " << PRINTH(time) << " " << PRINTH(charge);
+        }
+    };
+    static_assert(std::is_pod<EventElement>::value, "Data::EventElement must be POD");
+
+    /* Start of a compressed block: the elements are first filtered, e.g.
+     * delta coded, and then compressed by the codec. See Compress.hpp */
+    struct __attribute__ ((__packed__)) CompressedHeader // 28 bytes
+    {
+        uint16_t elementType;  // of the elements compressed
+        uint8_t filter;
+        uint8_t codec;
+        uint32_t elementSize;
+        uint32_t headSize;     // bytes of each element before its 16 bit samples
+        uint32_t numElements;
+        uint32_t filteredSize; // bytes after the filter
+        uint32_t size;         // bytes of compressed data after the header
+    };
+    static_assert(std::is_pod<CompressedHeader>::value, "Data::CompressedHeader must be POD");
+
+    /* Compressed blocks are written as a stream of bytes - each block is a
+     * CompressedHeader followed by its data */
+    struct __attribute__ ((__packed__)) CompressedElement
+    {
+        uint8_t byte;
+        static constexpr const bool fixedSize = true;
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD((unsigned)byte);
+        }
+        static ElementType type() { return Compressed; }
+        static void insertMembers(H5::CompType& datatype)
+        {
+            datatype.insertMember("byte", HOFFSET(CompressedElement, byte), H5::PredType::NATIVE_UINT8);
+        }
+        static size_t size() { return sizeof(CompressedElement); }
+        static size_t size(size_t) { return size(); }
+        static H5::CompType h5type()
+        {
+            H5::CompType datatype(size());
+            insertMembers(datatype);
+            return datatype;
+        }
+        static void headerOn(std::ostream& os)
+        {
+            os << PRINTH(byte);
+        }
+    };
+    static_assert(std::is_pod<CompressedElement>::value, "Data::CompressedElement must be POD");
 
 static constexpr const size_t maxBufferSize = JUMBO_PAYLOAD - (UDP_HEADER + IP_HEADER);
 
@@ -263,5 +590,21 @@ static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCWave
 { e.printOn(os); return os; }
 static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCWaveformElement<Data::ListElement8222>& e)
 { e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::ListElement822& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCWaveformElement<Data::ListElement822>& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::StdPackedElement751& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCPackedWaveformElement<Data::ListElement422>& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCPackedWaveformElement<Data::ListElement8222>& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCPackedWaveformElement<Data::ListElement822>& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::EventElement& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::CompressedElement& e)
+{ e.printOn(os); return os; }
 
 #endif // JADAQ_DATAFORMAT_HPP
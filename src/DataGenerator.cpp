@@ -0,0 +1,192 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Generators of synthetic readout data in the format delivered by the
+ * digitizers: VX1740D DPP-QDC board aggregates and XX751 standard firmware
+ * event blocks.
+ *
+ */
+
+#include "DataGenerator.hpp"
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <stdexcept>
+
+using namespace generator;
+
+DPPQDC::DPPQDC(uint8_t groupMask_, bool extras_, uint16_t samples_, uint32_t timeStep_, uint32_t seed)
+    : groupMask(groupMask_), groupCount(std::bitset<8>(groupMask_).count()), extras(extras_),
+      samples(samples_), timeStep(timeStep_), time(8, 0), rng(seed), interval(1.0 / timeStep_),
+      channel({1, 1, 1, 1, 1, 1, 1, 1}) {
+  if (samples % 8 != 0) {
+    throw std::invalid_argument{"DPP-QDC record length must be a multiple of 8 samples"};
+  }
+}
+
+size_t DPPQDC::eventWords() const { return 2 + (extras ? 1 : 0) + samples / 2; }
+
+size_t DPPQDC::aggregateWords(size_t eventsPerGroup) const {
+  return 4 + groupCount * (2 + eventsPerGroup * eventWords());
+}
+
+void DPPQDC::setTimeOffset(uint64_t offset) {
+  for (uint64_t &t : time) {
+    t = offset;
+  }
+}
+
+void DPPQDC::setTimeStep(double step) {
+  interval.param(std::exponential_distribution<double>::param_type(1.0 / step));
+}
+
+void DPPQDC::setChannelWeights(const std::vector<double> &weights) {
+  if (weights.empty() || weights.size() > 8) {
+    throw std::invalid_argument{"DPP-QDC groups have between 1 and 8 channels"};
+  }
+  channel = std::discrete_distribution<uint32_t>(weights.begin(), weights.end());
+}
+
+void DPPQDC::setCharge(Spectrum spectrum_, double a, double b) {
+  spectrum = spectrum_;
+  chargeA = a;
+  chargeB = b;
+}
+
+uint32_t DPPQDC::charge() {
+  double q;
+  switch (spectrum) {
+  case Spectrum::Gauss:
+    q = std::normal_distribution<double>(chargeA, chargeB)(rng);
+    break;
+  case Spectrum::Exponential:
+    q = chargeB + std::exponential_distribution<double>(1.0 / chargeA)(rng);
+    break;
+  default:
+    q = std::uniform_real_distribution<double>(chargeA, chargeB)(rng);
+  }
+  return (uint32_t)std::min(std::max(q, 0.0), 65535.0);
+}
+
+void DPPQDC::event(uint32_t *&p, size_t group) {
+  uint64_t &t = time[group];
+  t = (t + 1 + (uint64_t)interval(rng)) & 0xffffffffffffull;
+  uint32_t subChannel = channel(rng);
+  uint32_t q = charge();
+  uint32_t baseline = 0x0800 | (rng() & 0x7f);
+  *p++ = (uint32_t)t;
+  if (samples > 0) {
+    // pulse a quarter into the record, gate around it, overthreshold on top
+    uint32_t words = samples / 2;
+    uint32_t trigger = words / 4;
+    uint32_t height = q >> 2;
+    for (uint32_t i = 0; i < words; ++i) {
+      uint32_t s[2];
+      uint32_t probes = 0;
+      for (int k = 0; k < 2; ++k) {
+        uint32_t x = 2 * i + k;
+        uint32_t pulse = 0;
+        if (x >= 2 * trigger && x < 2 * trigger + 32) {
+          pulse = height >> ((x - 2 * trigger) >> 2);
+        }
+        s[k] = std::min<uint32_t>((baseline >> 1) + pulse + (rng() & 0x7), 0x0fff);
+        uint32_t bits = 0;
+        if (x + 8 >= 2 * trigger && x < 2 * trigger + 40)
+          bits |= 0x1; // gate
+        if (x == 2 * trigger)
+          bits |= 0x2; // trigger
+        if (x >= 2 * trigger + 40 && x < 2 * trigger + 56)
+          bits |= 0x4; // holdoff
+        if (pulse > 64)
+          bits |= 0x8; // overthreshold
+        probes |= bits << (12 + 16 * k);
+      }
+      *p++ = s[0] | (s[1] << 16) | probes;
+    }
+  }
+  if (extras) {
+    *p++ = (baseline << 16) | (uint32_t)(t >> 32);
+  }
+  *p++ = (subChannel << 28) | q;
+}
+
+size_t DPPQDC::fill(char *buffer, size_t size, size_t eventsPerGroup, size_t aggregates) {
+  const size_t words = aggregateWords(eventsPerGroup);
+  const size_t groupWords = 2 + eventsPerGroup * eventWords();
+  uint32_t *p = (uint32_t *)buffer;
+  const uint32_t *end = (const uint32_t *)(buffer + size);
+  size_t n = 0;
+  for (; n < aggregates && p + words <= end; ++n) {
+    uint32_t *aggregate = p;
+    *p++ = 0xa0000000u | (uint32_t)words;
+    *p++ = groupMask;
+    *p++ = aggregateCount++ & 0x7fffff;
+    *p++ = (uint32_t)time[0];
+    for (size_t group = 0; group < 8; ++group) {
+      if (!(groupMask & (1 << group)))
+        continue;
+      *p++ = 0x80000000u | (uint32_t)groupWords;
+      *p++ = 0x60000000u | (extras ? 1u << 28 : 0) | (samples ? 1u << 27 : 0) | (samples / 8);
+      for (size_t e = 0; e < eventsPerGroup; ++e) {
+        event(p, group);
+      }
+      eventCount += eventsPerGroup;
+    }
+    assert(p == aggregate + words);
+    (void)aggregate;
+  }
+  return (char *)p - buffer;
+}
+
+Std751::Std751(uint8_t channelMask_, uint16_t samples_, uint32_t timeStep_, uint32_t seed)
+    : channelMask(channelMask_), channels(std::bitset<8>(channelMask_).count()), samples(samples_),
+      timeStep(timeStep_), rng(seed) {}
+
+size_t Std751::eventWords() const { return 4 + channels * ((samples + 2) / 3); }
+
+size_t Std751::fill(char *buffer, size_t size, size_t n) {
+  const size_t words = eventWords();
+  uint32_t *p = (uint32_t *)buffer;
+  const uint32_t *end = (const uint32_t *)(buffer + size);
+  size_t i = 0;
+  for (; i < n && p + words <= end; ++i) {
+    time += timeStep;
+    *p++ = 0xa0000000u | (uint32_t)words;
+    *p++ = channelMask;
+    *p++ = (uint32_t)(eventCount++ & 0x00ffffff);
+    *p++ = time & 0x7fffffff;
+    for (size_t c = 0; c < channels; ++c) {
+      uint32_t baseline = 0x200 | (rng() & 0x3f);
+      const uint32_t trigger = samples / 4;
+      for (uint32_t s = 0; s < samples; s += 3) {
+        uint32_t count = std::min<uint32_t>(3, samples - s);
+        uint32_t word = count << 30;
+        for (uint32_t k = 0; k < count; ++k) {
+          uint32_t x = s + k;
+          uint32_t pulse = (x >= trigger && x < trigger + 16) ? 0x100 >> ((x - trigger) >> 2) : 0;
+          word |= ((baseline - pulse + (rng() & 0x7)) & 0x3ff) << (10 * k);
+        }
+        *p++ = word;
+      }
+    }
+  }
+  return (char *)p - buffer;
+}
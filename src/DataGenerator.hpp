@@ -0,0 +1,110 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Generators of synthetic readout data in the format delivered by the
+ * digitizers: VX1740D DPP-QDC board aggregates and XX751 standard firmware
+ * event blocks.
+ *
+ */
+
+#ifndef JADAQ_DATAGENERATOR_HPP
+#define JADAQ_DATAGENERATOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace generator {
+
+/* DPP-QDC board aggregates. Every enabled group gets its own stream of events
+ * with exponentially distributed time differences (mean of timeStep ticks).
+ * Time tags roll over at 32 bit and are extended to 48 bit in the extras
+ * word. Waveforms are a noisy baseline with a pulse and matching digital
+ * probes. */
+class DPPQDC {
+public:
+  /* samples is the record length in samples and must be a multiple of 8 -
+   * 0 disables waveforms */
+  DPPQDC(uint8_t groupMask, bool extras, uint16_t samples, uint32_t timeStep = 1000, uint32_t seed = 1);
+  /* Size of one event in 32 bit words */
+  size_t eventWords() const;
+  /* Size of a board aggregate with eventsPerGroup events in each group */
+  size_t aggregateWords(size_t eventsPerGroup) const;
+  /* Write as many board aggregates of eventsPerGroup events per group as fit
+   * in size bytes, at most aggregates. Returns the number of bytes written */
+  size_t fill(char *buffer, size_t size, size_t eventsPerGroup, size_t aggregates = SIZE_MAX);
+  size_t groups() const { return groupCount; }
+  uint64_t events() const { return eventCount; }
+  void setTimeOffset(uint64_t offset);
+  /* Mean time between events in a group in ticks */
+  void setTimeStep(double step);
+  /* Relative frequency of the sub channels of a group - at most 8 */
+  void setChannelWeights(const std::vector<double> &weights);
+  /* Charge spectrum: Uniform between a and b, Gauss with mean a and sigma b
+   * or Exponential with slope a above b. Charges are clamped to 16 bit. */
+  enum class Spectrum { Uniform, Gauss, Exponential };
+  void setCharge(Spectrum spectrum, double a, double b);
+
+private:
+  uint8_t groupMask;
+  size_t groupCount;
+  bool extras;
+  uint16_t samples;
+  uint32_t timeStep;
+  uint32_t aggregateCount = 0;
+  uint64_t eventCount = 0;
+  std::vector<uint64_t> time; // per group, 48 bit
+  std::mt19937 rng;
+  std::exponential_distribution<double> interval;
+  std::discrete_distribution<uint32_t> channel;
+  Spectrum spectrum = Spectrum::Uniform;
+  double chargeA = 200;
+  double chargeB = 200 + 0x0fff;
+  uint32_t charge();
+  void event(uint32_t *&p, size_t group);
+};
+
+/* XX751 standard firmware event blocks with samples per enabled channel
+ * packed three 10 bit samples to a word */
+class Std751 {
+public:
+  Std751(uint8_t channelMask, uint16_t samples, uint32_t timeStep = 100000, uint32_t seed = 1);
+  /* Size of one event in 32 bit words */
+  size_t eventWords() const;
+  /* Write as many events as fit in size bytes, at most n. Returns the number
+   * of bytes written */
+  size_t fill(char *buffer, size_t size, size_t n = SIZE_MAX);
+  uint64_t events() const { return eventCount; }
+
+private:
+  uint8_t channelMask;
+  size_t channels;
+  uint16_t samples;
+  uint32_t timeStep;
+  uint32_t time = 0;
+  uint64_t eventCount = 0;
+  std::mt19937 rng;
+};
+
+} // namespace generator
+
+#endif // JADAQ_DATAGENERATOR_HPP
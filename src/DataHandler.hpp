@@ -29,17 +29,44 @@
 #include "DataWriter.hpp"
 #include "EventIterator.hpp"
 #include "container.hpp"
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
 class DataHandler {
 public:
+    /* Time sorter accounting */
+    struct Stats {
+        uint64_t pending = 0; // events waiting for the watermark
+        uint64_t forced = 0;  // events written before the watermark passed them
+        uint64_t late = 0;    // events older than events already written
+        uint64_t resets = 0;  // clock resets i.e. time went far back
+        uint64_t dropped = 0; // unsorted: events of an epoch already written
+    };
     template<typename E>
     void initialize(DataWriter& dataWriter, uint32_t digitizerID, size_t groups, size_t samples, const uint32_t* maxJitter)
     {
-        instance.reset(new Implementation<E>(dataWriter,digitizerID,groups,samples,maxJitter));
+        if (sorted)
+            instance.reset(new Implementation<E>(dataWriter,digitizerID,groups,samples,maxJitter,groupMask));
+        else
+            instance.reset(new UnsortedImplementation<E>(dataWriter,digitizerID,groups,samples));
     }
+    /* Select approximate time ordering (default) or the unsorted fast path.
+     * Must be called before initialize() */
+    void setSorted(bool s) { sorted = s; }
+    /* Groups enabled on the board - the others never hold back the time
+     * sorter. Must be called before initialize() */
+    void setGroupMask(uint32_t mask) { groupMask = mask; }
     void flush() { instance->flush(); }
-    size_t operator()(DataBlockBaseIterator& it) { return instance->operator()(it); }
+    /* Write what is due by time alone - call while no data comes in, so
+     * that a quiet board does not hold back its last events. Returns true
+     * if the statistics changed */
+    bool idle() { return instance->idle(); }
+    const Stats& getStats() const { return instance->stats(); }
+    size_t operator()(DPPQDCEventIterator& it) { return instance->operator()(it); }
+    size_t operator()(StdBLTEventIterator& it) { return instance->operator()(it); }
     static int64_t getTimeMsecs()
     {
         return std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -49,128 +76,452 @@ private:
     struct Interface
     {
         virtual ~Interface() = default;
-        virtual size_t operator()(DataBlockBaseIterator& it) = 0;
+        /* One entry point per concrete iterator type so that there is a single
+         * virtual call per data block and none per event */
+        virtual size_t operator()(DPPQDCEventIterator& it) = 0;
+        virtual size_t operator()(StdBLTEventIterator& it) = 0;
         virtual void flush() = 0;
+        virtual bool idle() { return false; }
+        virtual const Stats& stats() const { static const Stats none; return none; }
     };
-    /* E is element type e.g. Data::ListElementxxx
-     * C is containertype i.e. jadaq::vector, jadaq::set, jadaq::buffer
-    */
+    /* Streaming time sorter. Events arrive time ordered within each group
+     * and are queued in a bounded ring per group. The rings are merged by
+     * picking the oldest group head - a plain scan beats a heap for the at
+     * most 8 groups of a board - and events are written once the
+     * watermark - the oldest of the latest times seen in the groups, less
+     * their jitter - has passed them. Enabled groups that have not
+     * delivered yet hold the watermark back for idleTime from the first
+     * events, as they may still deliver the oldest ones. Groups that have
+     * delivered nothing for idleTime do not hold back the watermark. 32 bit
+     * time tags are extended to 64 bit per group so sorting works across
+     * rollover. A full ring forces out the oldest events before the
+     * watermark has passed them.
+     */
     template <typename E>
     class Implementation: public Interface
     {
         static_assert(std::is_pod<E>::value, "E must be POD");
     private:
+        /* Time ordered events of one group */
+        struct Run {
+            char* data;
+            uint64_t* time;
+            size_t head = 0;
+            size_t count = 0;
+        };
+        /* Older than this is a clock reset and not a late event (~1 s at
+         * 16 ns per tick) */
+        static constexpr const uint64_t resetTicks = 1ull << 26;
+        /* Milliseconds without events before a group no longer holds back
+         * the watermark */
+        static constexpr const int64_t idleTime = 1000;
+        /* Ring capacity per group in output buffers */
+        static constexpr const size_t runBuffers = 64;
+        /* Milliseconds a partly filled output buffer may wait for more events */
+        static constexpr const int64_t maxAge = 100;
         DataWriter& dataWriter;
         uint32_t digitizerID;
         const uint32_t* maxJitter;
+        const uint32_t groupMask;
+        const size_t elementSize;
+        jadaq::buffer<E>* out;
+        uint64_t outEpoch = 0;
+        uint64_t globalTimeStamp = 0;
+        size_t capacity;                 // per group
+        std::vector<char> storage;
+        std::vector<uint64_t> times;
+        std::vector<Run> runs;
+        std::vector<uint64_t> heads;     // time of the oldest event per group, empty if UINT64_MAX
+        std::vector<uint64_t> lastTime;  // latest extended time per group
+        std::vector<uint8_t> seen;
+        std::vector<uint8_t> delivered;  // events since the last touch()
+        std::vector<int64_t> lastSeen;   // wall clock of the latest events per group
+        uint64_t maxTime = 0;            // latest over all groups
+        uint64_t lastWritten = 0;
+        int64_t started = 0;             // wall clock of the first events
+        Stats stats_;
+
+        /* Extend a 32 bit time tag of group to 64 bit. Returns false on a
+         * clock reset. */
+        bool extend(uint16_t group, uint32_t tag, uint64_t& time)
+        {
+            if (!seen[group]) {
+                // pick the epoch that puts the group closest to the others
+                uint64_t epoch = maxTime >> 32;
+                time = (epoch << 32) | tag;
+                if (epoch > 0 && time > maxTime && time - maxTime > 0x80000000ull)
+                    time -= 1ull << 32;
+                else if (time < maxTime && maxTime - time > 0x80000000ull)
+                    time += 1ull << 32;
+                seen[group] = 1;
+                lastTime[group] = time;
+            } else {
+                uint64_t last = lastTime[group];
+                time = (last & ~0xffffffffull) | tag;
+                if (time < last && last - time > 0x80000000ull)
+                    time += 1ull << 32;     // rollover
+                else if (time > last && time - last > 0x80000000ull && time >= (1ull << 32))
+                    time -= 1ull << 32;     // late event from before a rollover
+                if (time + resetTicks < last)
+                    return false;
+                lastTime[group] = std::max(last, time);
+            }
+            maxTime = std::max(maxTime, time);
+            return true;
+        }
+        void write()
+        {
+            if (!out->empty()) {
+                dataWriter(out, digitizerID, globalTimeStamp);
+                out->clear();
+            }
+        }
+        /* Write the events the watermark has passed, and the out buffer
+         * once it has waited for maxAge */
+        void release(int64_t now)
+        {
+            touch(now);
+            const uint64_t mark = watermark(now);
+            for (size_t group = oldest(); stats_.pending > 0 && heads[group] <= mark; group = oldest())
+                pop(group);
+            if (!out->empty() && now - (int64_t)globalTimeStamp >= maxAge)
+                write();
+        }
+        /* Group holding the oldest queued event */
+        size_t oldest() const
+        {
+            size_t group = 0;
+            uint64_t time = heads[0];
+            for (size_t g = 1; g < heads.size(); ++g) {
+                const bool older = heads[g] < time;
+                time = older ? heads[g] : time;
+                group = older ? g : group;
+            }
+            return group;
+        }
+        /* Move the oldest event of group to the output */
+        void pop(size_t group)
+        {
+            const uint64_t time = heads[group];
+            Run& run = runs[group];
+            /* a packet only spans one 32 bit epoch to keep the relation
+             * between the time tags and globalTime */
+            if (out->full() || (!out->empty() && (time >> 32) != outEpoch))
+                write();
+            if (out->empty()) {
+                outEpoch = time >> 32;
+                globalTimeStamp = DataHandler::getTimeMsecs();
+            }
+            if (time < lastWritten)
+                stats_.late++;
+            lastWritten = std::max(lastWritten, time);
+            out->append(run.data + run.head * elementSize);
+            run.head = run.head + 1 == capacity ? 0 : run.head + 1;
+            heads[group] = --run.count > 0 ? run.time[run.head] : UINT64_MAX;
+            stats_.pending--;
+        }
+        /* Note the wall clock of the groups that delivered events */
+        void touch(int64_t now)
+        {
+            for (size_t group = 0; group < runs.size(); ++group) {
+                if (delivered[group]) {
+                    lastSeen[group] = now;
+                    delivered[group] = 0;
+                }
+            }
+        }
+        uint64_t watermark(int64_t now) const
+        {
+            uint64_t mark = UINT64_MAX;
+            for (size_t group = 0; group < runs.size(); ++group) {
+                if (seen[group] && now - lastSeen[group] < idleTime)
+                    mark = std::min(mark, lastTime[group] - std::min<uint64_t>(lastTime[group], maxJitter[group]));
+                else if (!seen[group] && (groupMask >> group & 1) && now - started < idleTime)
+                    mark = 0;
+            }
+            return mark;
+        }
+        void drain()
+        {
+            while (stats_.pending > 0)
+                pop(oldest());
+        }
+        void store(typename E::EventType& event, uint16_t group)
+        {
+            uint64_t time;
+            if (!extend(group, event.timeTag(), time)) {
+                XTRACE(DATAH, INF, "Digitizer %d time went back from 0x%lx to 0x%lx - clock reset", digitizerID, lastTime[group], time);
+                stats_.resets++;
+                drain();
+                std::fill(seen.begin(), seen.end(), 0);
+                maxTime = lastWritten = 0;
+                started = DataHandler::getTimeMsecs();
+                extend(group, event.timeTag(), time);
+            }
+            Run& run = runs[group];
+            if (run.count == capacity) {
+                /* a readout can hold more events than the ring - only those
+                 * the watermark has not passed are forced */
+                const int64_t now = DataHandler::getTimeMsecs();
+                touch(now);
+                const uint64_t mark = watermark(now);
+                while (run.count == capacity) {
+                    const size_t oldestGroup = oldest();
+                    if (heads[oldestGroup] > mark)
+                        stats_.forced++;
+                    pop(oldestGroup);
+                }
+            }
+            size_t slot = run.head + run.count;
+            if (slot >= capacity)
+                slot -= capacity;
+            Data::setEpoch(*new (run.data + slot * elementSize) E(event, group), time >> 32);
+            run.time[slot] = time;
+            if (run.count++ == 0)
+                heads[group] = time;
+            delivered[group] = 1;
+            stats_.pending++;
+        }
+
+    public:
+        Implementation(DataWriter &dw, uint32_t digID, size_t groups,
+                       size_t samples, const uint32_t *jitter, uint32_t mask)
+            : dataWriter(dw), digitizerID(digID), maxJitter(jitter), groupMask(mask), elementSize(E::size(samples)),
+              out(new jadaq::buffer<E>(Data::maxBufferSize, E::size(samples), sizeof(Data::Header))),
+              capacity(runBuffers * out->capacity()), storage(groups * capacity * elementSize),
+              times(groups * capacity), runs(groups), heads(groups, UINT64_MAX), lastTime(groups, 0), seen(groups, 0),
+              delivered(groups, 0), lastSeen(groups, 0)
+        {
+            for (size_t group = 0; group < groups; ++group) {
+                runs[group].data = storage.data() + group * capacity * elementSize;
+                runs[group].time = times.data() + group * capacity;
+            }
+        }
+        ~Implementation() {
+            flush();
+            delete out;
+        }
+
+        size_t operator()(DPPQDCEventIterator& it) { return process(it); }
+        size_t operator()(StdBLTEventIterator& it) { return process(it); }
+
+        template <typename Iterator>
+        size_t process(Iterator& eventIterator)
+        {
+            if (started == 0)
+                started = DataHandler::getTimeMsecs();
+            size_t events = 0;
+            for (;eventIterator != eventIterator.end(); ++eventIterator)
+            {
+                events += 1;
+                typename E::EventType event = eventIterator.template event<typename E::EventType>();
+                uint16_t group = eventIterator.group();
+                XTRACE(DATAH, DEB, "Digitizer: %d_%d, time: 0x%04x", digitizerID>>16, digitizerID & 0xFFFF, event.timeTag());
+                store(event, group);
+            }
+            release(DataHandler::getTimeMsecs());
+            XTRACE(DATAH, DEB, "events parsed %d", events);
+            return events;
+        }
+        bool idle()
+        {
+            if (stats_.pending == 0 && out->empty())
+                return false;
+            const uint64_t pending = stats_.pending;
+            release(DataHandler::getTimeMsecs());
+            return stats_.pending != pending;
+        }
 
-    struct Buffer {
-      size_t groups;
+        void flush() {
+            drain();
+            write();
+        }
+        const Stats& stats() const { return stats_; }
+    };
+  /* Unsorted fast path: events are constructed straight into the buffer for
+   * the 32 bit time tag epoch of their group and buffers are only handed to
+   * the writer when full or when a new epoch begins. Events are written in
+   * readout order. Only the current and the previous epoch have a buffer -
+   * events of a group lagging further behind are dropped and counted, as
+   * their epoch has already been written.
+   */
+  template <typename E>
+  class UnsortedImplementation: public Interface
+  {
+    static_assert(std::is_pod<E>::value, "E must be POD");
+  private:
+    DataWriter& dataWriter;
+    uint32_t digitizerID;
+    struct Epoch {
       jadaq::buffer<E> *buffer;
-      uint32_t *maxLocalTime; // Array containing MaxLocalTime from the previous
-                              // insertion needed to detect reset
       uint64_t globalTimeStamp = 0;
-      void clear() {
-        buffer->clear();
-        for (size_t i = 0; i < groups; ++i) {
-          maxLocalTime[i] = 0;
-        }
-        globalTimeStamp = 0;
-      }
-      Buffer(size_t numGroups) : groups(numGroups) {}
+      uint64_t epoch = 0;
+    } previous, current;
+    Stats stats_;
+    std::vector<uint64_t> groupEpoch;
+    std::vector<uint32_t> lastTime; // last time tag per group
+    std::vector<uint8_t> seen;
+    uint64_t latest = 0;            // latest extended time over all groups
 
-      void malloc(DataWriter &dataWriter, size_t samples) {
-        buffer = new jadaq::buffer<E>(Data::maxBufferSize, E::size(samples),
-                                        sizeof(Data::Header));
-        maxLocalTime = new uint32_t[groups];
-        clear();
+    void write(Epoch &e) {
+      if (!e.buffer->empty()) {
+        dataWriter(e.buffer, digitizerID, e.globalTimeStamp);
+        e.buffer->clear();
       }
-      void free() {
-        delete buffer;
-        delete[] maxLocalTime;
+    }
+    void inline store(Epoch &e, typename E::EventType &event, uint16_t group) {
+      if (!e.buffer->try_emplace_back(event, group)) {
+        write(e);
+        e.buffer->emplace_back(event, group);
       }
-
-    } previous, current, next;
-
-    void inline store(Buffer &buffer, typename E::EventType &event,
-                      uint16_t group) {
-      buffer.maxLocalTime[group] = event.timeTag();
-      try {
-        buffer.buffer->emplace_back(event, group);
-      } catch (std::length_error &) {
-        dataWriter(buffer.buffer, digitizerID, buffer.globalTimeStamp);
-        buffer.buffer->clear();
-        buffer.buffer->emplace_back(event, group);
+      Data::setEpoch(e.buffer->back(), groupEpoch[group]);
+    }
+    /* Decode n events of stride words straight into the buffer of e */
+    void storeBatch(Epoch &e, const uint32_t *events, size_t n, size_t stride, uint16_t group) {
+      while (n > 0) {
+        size_t m = n;
+        E *out = e.buffer->allocate(m);
+        if (m == 0) {
+          write(e);
+          continue;
+        }
+        E::decode(events, m, stride, group, out);
+        for (size_t i = 0; i < m; ++i)
+          Data::setEpoch(out[i], groupEpoch[group]);
+        events += m * stride;
+        n -= m;
       }
     }
+    // time tag went backwards by more than half the range
+    static bool rollover(uint32_t last, uint32_t time) {
+      return time < last && last - time > 0x80000000u;
+    }
+    /* Epoch that puts time closest to the latest time of the other groups,
+     * for a group that starts delivering events after others rolled over */
+    uint64_t nearestEpoch(uint32_t time) const {
+      uint64_t e = latest >> 32;
+      const uint64_t t = (e << 32) | time;
+      if (e > 0 && t > latest && t - latest > 0x80000000ull)
+        e--;
+      else if (t < latest && latest - t > 0x80000000ull)
+        e++;
+      return e;
+    }
+    void updateTime(uint16_t group, uint32_t time) {
+      if (!seen[group]) {
+        seen[group] = 1;
+        groupEpoch[group] = nearestEpoch(time);
+      } else if (rollover(lastTime[group], time)) {
+        groupEpoch[group]++;
+      }
+      if (groupEpoch[group] > current.epoch) {
+        write(previous);
+        std::swap(previous, current);
+        current.globalTimeStamp = DataHandler::getTimeMsecs();
+        current.epoch = groupEpoch[group];
+      }
+      lastTime[group] = time;
+      latest = std::max(latest, (groupEpoch[group] << 32) | time);
+    }
+    /* Buffer for the epoch of group - nullptr if that epoch is gone */
+    Epoch *epochBuffer(uint16_t group) {
+      if (groupEpoch[group] == current.epoch)
+        return &current;
+      if (groupEpoch[group] == previous.epoch)
+        return &previous;
+      return nullptr;
+    }
+    void drop(size_t events, uint16_t group) {
+      if (stats_.dropped == 0)
+        XTRACE(DATAH, WAR, "Group %d lags more than one time tag epoch behind - dropping its events", group);
+      stats_.dropped += events;
+    }
 
   public:
-    Implementation(DataWriter &dw, uint32_t digID, size_t groups,
-                   size_t samples, const uint32_t *jitter)
-        : dataWriter(dw), digitizerID(digID), maxJitter(jitter),
-          previous(groups), current(groups), next(groups) {
-      previous.malloc(dataWriter, samples);
-      current.malloc(dataWriter, samples);
-      next.malloc(dataWriter, samples);
+    UnsortedImplementation(DataWriter &dw, uint32_t digID, size_t groups, size_t samples)
+        : dataWriter(dw), digitizerID(digID), groupEpoch(groups, 0), lastTime(groups, 0), seen(groups, 0) {
+      previous.buffer = new jadaq::buffer<E>(Data::maxBufferSize, E::size(samples), sizeof(Data::Header));
+      current.buffer = new jadaq::buffer<E>(Data::maxBufferSize, E::size(samples), sizeof(Data::Header));
       previous.globalTimeStamp = DataHandler::getTimeMsecs();
-      current.globalTimeStamp = DataHandler::getTimeMsecs();
+      current.globalTimeStamp = previous.globalTimeStamp;
     }
-    ~Implementation() {
+    ~UnsortedImplementation() {
       flush();
-      previous.free();
-      current.free();
-      next.free();
+      delete previous.buffer;
+      delete current.buffer;
     }
 
-      size_t operator()(DataBlockBaseIterator& eventIterator)
-        {
-            size_t events = 0;
-            for (;eventIterator != eventIterator.end(); ++eventIterator)
-            {
-                events += 1;
-                typename E::EventType event = eventIterator.event<typename E::EventType>();
-                uint16_t group = eventIterator.group();
-                XTRACE(DATAH, DEB, "Digitizer: %d_%d, time: 0x%04x", digitizerID>>16, digitizerID & 0xFFFF, event.timeTag());
-                if (current.maxLocalTime[group] < event.timeTag() + maxJitter[group]) {
-                  if (current.maxLocalTime[group] > 0 ||
-                      previous.maxLocalTime[group] == 0 ||
-                      previous.maxLocalTime[group] >=
-                      event.timeTag() + maxJitter[group]) {
-                    store(current, event, group);
-                  } else {
-                    store(previous, event, group);
-                  }
-                } else {
-                  if (next.globalTimeStamp == 0) {
-                    next.globalTimeStamp = DataHandler::getTimeMsecs();
-                  }
-                  store(next, event, group);
-        }
+    size_t operator()(DPPQDCEventIterator& it) {
+      return processGroups(it, std::integral_constant<bool, E::batchDecode>{});
+    }
+    size_t operator()(StdBLTEventIterator& it) { return process(it); }
+
+    template <typename Iterator>
+    size_t process(Iterator& eventIterator)
+    {
+      size_t events = 0;
+      for (;eventIterator != eventIterator.end(); ++eventIterator)
+      {
+        events += 1;
+        typename E::EventType event = eventIterator.template event<typename E::EventType>();
+        uint16_t group = eventIterator.group();
+        updateTime(group, event.timeTag());
+        Epoch *e = epochBuffer(group);
+        if (e)
+          store(*e, event, group);
+        else
+          drop(1, group);
       }
-      if (!next.buffer->empty()) {
-        if (previous.buffer->size() > 0) {
-          dataWriter(previous.buffer, digitizerID, previous.globalTimeStamp);
+      XTRACE(DATAH, DEB, "events parsed %d", events);
+      return events;
+    }
+
+    size_t processGroups(DPPQDCEventIterator& eventIterator, std::false_type) { return process(eventIterator); }
+    /* Batch path: decode whole group aggregates at a time, only splitting them
+     * where a time tag rollover begins a new epoch */
+    size_t processGroups(DPPQDCEventIterator& eventIterator, std::true_type)
+    {
+      size_t events = 0;
+      while (eventIterator != eventIterator.end())
+      {
+        uint16_t group = eventIterator.group();
+        const uint32_t *words = eventIterator.getEventPtr();
+        const size_t stride = eventIterator.getEventSize();
+        const size_t n = eventIterator.groupRemaining();
+        size_t i = 0;
+        while (i < n) {
+          uint32_t last = words[i * stride];
+          updateTime(group, last);
+          size_t j = i + 1;
+          for (; j < n; ++j) {
+            uint32_t time = words[j * stride];
+            if (rollover(last, time))
+              break;
+            last = time;
+          }
+          lastTime[group] = last;
+          Epoch *e = epochBuffer(group);
+          if (e)
+            storeBatch(*e, words + i * stride, j - i, stride, group);
+          else
+            drop(j - i, group);
+          i = j;
         }
-        previous.clear();
-        std::swap(current, previous);
-        std::swap(next, current);
+        events += n;
+        eventIterator.skipGroup();
       }
       XTRACE(DATAH, DEB, "events parsed %d", events);
       return events;
     }
 
     void flush() {
-      if (previous.buffer->size() > 0) {
-        dataWriter(previous.buffer, digitizerID, previous.globalTimeStamp);
-        previous.clear();
-      }
-      if (current.buffer->size() > 0) {
-        dataWriter(current.buffer, digitizerID, current.globalTimeStamp);
-        current.clear();
-      }
-      assert(next.buffer->size() == 0);
+      write(previous);
+      write(current);
     }
+    const Stats& stats() const { return stats_; }
   };
+  bool sorted = true;
+  uint32_t groupMask = ~0u;
   std::unique_ptr<Interface> instance;
 };
 
@@ -28,6 +28,7 @@
 #include "DataFormat.hpp"
 #include "container.hpp"
 #include <cstdint>
+#include <memory>
 
 class DataWriter {
 public:
@@ -63,6 +64,14 @@ private:
         virtual void operator()(const jadaq::buffer<Data::StdElement751>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
         virtual void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
         virtual void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::ListElement822>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement822> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::StdPackedElement751>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::DPPQDCPackedWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::DPPQDCPackedWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::DPPQDCPackedWaveformElement<Data::ListElement822> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::EventElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::CompressedElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
     };
     template <typename DW>
     struct Model : Concept
@@ -83,6 +92,22 @@ private:
         { val->operator()(buffer,digitizerID,globalTimeStamp); }
         void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
         { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::ListElement822>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement822> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::StdPackedElement751>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::DPPQDCPackedWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::DPPQDCPackedWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::DPPQDCPackedWaveformElement<Data::ListElement822> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::EventElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::CompressedElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
         DW* val;
     };
 
@@ -0,0 +1,301 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Writer thread placed in front of another DataWriter so that the callers
+ * do not wait for the wrapped writer, e.g. for a file on slow storage.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERASYNC_HPP
+#define JADAQ_DATAWRITERASYNC_HPP
+
+#include "BufferPool.hpp"
+#include "DataFormat.hpp"
+#include "DataWriter.hpp"
+#include "container.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Buffers are copied into blocks from the shared BufferPool and queued for
+ * the writer thread, so callers only wait when the queue is full. The writer
+ * thread stages consecutive buffers of a digitizer with the same
+ * globalTimeStamp into chunks of up to chunkSize bytes and writes a chunk when
+ * it is full, when the globalTimeStamp changes or when the queue has run dry.
+ * split() and addDigitizer() are queued as well so they stay in order with
+ * the data.
+ */
+class DataWriterAsync {
+public:
+  static constexpr const size_t depthBuckets = 16;   // bucket k counts depths below 2^k
+  static constexpr const size_t latencyBuckets = 24; // bucket k counts latencies below 2^k us
+  struct Stats {
+    uint64_t buffers = 0;   // buffers queued
+    uint64_t bytes = 0;     // bytes queued
+    uint64_t chunks = 0;    // chunks written to the wrapped writer
+    uint64_t stalls = 0;    // buffers that had to wait for room in the queue
+    uint64_t stallTime = 0; // microseconds spent waiting for room
+    size_t depth = 0;       // buffers queued now
+    size_t highWater = 0;   // most buffers queued at once
+    uint64_t depthHistogram[depthBuckets] = {};     // depth found by each queued buffer
+    uint64_t latencyHistogram[latencyBuckets] = {}; // first buffer of a chunk queued to chunk written
+  };
+
+  DataWriterAsync(DataWriter &&dataWriter_, size_t queueSize, size_t chunkSize_ = 1 << 20)
+      : dataWriter(std::move(dataWriter_)), chunkSize(std::max(chunkSize_, Data::maxBufferSize)),
+        ring(std::max(queueSize, (size_t)1)) {
+    thread = std::thread(&DataWriterAsync::run, this);
+  }
+
+  ~DataWriterAsync() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    notEmpty.notify_one();
+    thread.join();
+  }
+
+  void addDigitizer(uint32_t digitizerID) {
+    Item item;
+    item.kind = Item::Digitizer;
+    item.digitizerID = digitizerID;
+    push(std::move(item));
+  }
+
+  void split(const std::string &id) {
+    Item item;
+    item.kind = Item::Split;
+    item.id = id;
+    push(std::move(item));
+  }
+
+  template <typename E>
+  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    if (buffer->empty())
+      return;
+    Item item;
+    item.kind = Item::Data;
+    item.stage = &DataWriterAsync::stage<E>;
+    item.bytes = buffer->data_size() - buffer->header_size();
+    item.elements = buffer->size();
+    item.elementSize = item.bytes / item.elements;
+    item.data = jadaq::BufferPool::allocate(item.bytes);
+    memcpy(item.data, buffer->data() + buffer->header_size(), item.bytes);
+    item.digitizerID = digitizerID;
+    item.globalTimeStamp = globalTimeStamp;
+    push(std::move(item));
+  }
+
+  /* Wait until everything queued so far has been written */
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return count == 0 && !busy; });
+  }
+
+  Stats getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats s = stats;
+    s.depth = count;
+    return s;
+  }
+
+  /* Upper bound of the bucket holding the fraction p of a histogram */
+  static uint64_t percentile(const uint64_t *histogram, size_t buckets, double p) {
+    uint64_t total = 0;
+    for (size_t k = 0; k < buckets; ++k)
+      total += histogram[k];
+    uint64_t sum = 0;
+    for (size_t k = 0; k < buckets; ++k) {
+      sum += histogram[k];
+      if (total > 0 && sum >= p * total)
+        return 1ull << k;
+    }
+    return 0;
+  }
+
+private:
+  struct Item;
+  typedef void (*StageFunction)(DataWriterAsync &, Item &);
+  struct Item {
+    enum Kind { Data, Digitizer, Split } kind = Data;
+    StageFunction stage = nullptr;
+    char *data = nullptr; // elements, from the buffer pool
+    size_t bytes = 0;
+    size_t elements = 0;
+    size_t elementSize = 0;
+    uint32_t digitizerID = 0;
+    uint64_t globalTimeStamp = 0;
+    int64_t queued = 0; // microseconds
+    std::string id;     // of the split
+  };
+  /* Chunk being staged for a digitizer */
+  struct Stage {
+    virtual ~Stage() = default;
+    virtual bool empty() const = 0;
+    virtual void write(DataWriter &dataWriter, uint32_t digitizerID) = 0;
+    StageFunction stage;
+    size_t elementSize;
+    uint64_t globalTimeStamp = 0;
+    int64_t queued = 0; // of the first buffer in the chunk
+  };
+  template <typename E> struct StageOf : Stage {
+    jadaq::buffer<E> buffer;
+    StageOf(size_t chunkSize, size_t elementSize_)
+        : buffer(chunkSize + sizeof(Data::Header), elementSize_, sizeof(Data::Header)) {
+      this->stage = &DataWriterAsync::stage<E>;
+      this->elementSize = elementSize_;
+    }
+    bool empty() const override { return buffer.empty(); }
+    void write(DataWriter &dataWriter, uint32_t digitizerID) override {
+      dataWriter(&buffer, digitizerID, this->globalTimeStamp);
+      buffer.clear();
+    }
+  };
+
+  DataWriter dataWriter;
+  const size_t chunkSize;
+  mutable std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::condition_variable idle;
+  std::vector<Item> ring;
+  size_t head = 0;
+  size_t count = 0;
+  bool busy = false; // writer thread is handling an item
+  bool stopping = false;
+  Stats stats;
+  std::map<uint32_t, std::unique_ptr<Stage>> stages; // only used by the writer thread
+  std::thread thread;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  static size_t bucket(uint64_t value, size_t buckets) {
+    const size_t k = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    return std::min(k, buckets - 1);
+  }
+
+  void push(Item &&item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (count == ring.size()) {
+      const int64_t start = now();
+      stats.stalls++;
+      notFull.wait(lock, [this] { return count < ring.size(); });
+      stats.stallTime += now() - start;
+    }
+    item.queued = now();
+    if (item.kind == Item::Data) {
+      stats.depthHistogram[bucket(count, depthBuckets)]++;
+      stats.buffers++;
+      stats.bytes += item.bytes;
+    }
+    size_t slot = head + count;
+    if (slot >= ring.size())
+      slot -= ring.size();
+    ring[slot] = std::move(item);
+    stats.highWater = std::max(stats.highWater, ++count);
+    notEmpty.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (count == 0) {
+        // nothing more to stage for now - write what we have
+        lock.unlock();
+        writeStages();
+        lock.lock();
+        busy = false;
+        idle.notify_all();
+        notEmpty.wait(lock, [this] { return count > 0 || stopping; });
+        if (count == 0)
+          return;
+      }
+      Item item = std::move(ring[head]);
+      head = head + 1 == ring.size() ? 0 : head + 1;
+      count--;
+      busy = true;
+      notFull.notify_one();
+      lock.unlock();
+      switch (item.kind) {
+      case Item::Data:
+        item.stage(*this, item);
+        jadaq::BufferPool::deallocate(item.data);
+        break;
+      case Item::Digitizer:
+        dataWriter.addDigitizer(item.digitizerID);
+        break;
+      case Item::Split:
+        writeStages();
+        dataWriter.split(item.id);
+        break;
+      }
+      lock.lock();
+    }
+  }
+
+  template <typename E> static void stage(DataWriterAsync &self, Item &item) {
+    std::unique_ptr<Stage> &s = self.stages[item.digitizerID];
+    if (s && (s->stage != item.stage || s->elementSize != item.elementSize)) {
+      self.writeStage(*s, item.digitizerID);
+      s.reset();
+    }
+    if (!s)
+      s.reset(new StageOf<E>(self.chunkSize, item.elementSize));
+    StageOf<E> &st = static_cast<StageOf<E> &>(*s);
+    if (!st.empty() && (st.globalTimeStamp != item.globalTimeStamp || st.buffer.available() < item.elements))
+      self.writeStage(st, item.digitizerID);
+    if (st.empty()) {
+      st.globalTimeStamp = item.globalTimeStamp;
+      st.queued = item.queued;
+    }
+    st.buffer.append(item.data, item.elements);
+  }
+
+  void writeStage(Stage &s, uint32_t digitizerID) {
+    if (s.empty())
+      return;
+    s.write(dataWriter, digitizerID);
+    const int64_t latency = now() - s.queued;
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.chunks++;
+    stats.latencyHistogram[bucket(latency, latencyBuckets)]++;
+  }
+
+  void writeStages() {
+    for (auto &s : stages) {
+      if (s.second)
+        writeStage(*s.second, s.first);
+    }
+  }
+};
+
+#endif // JADAQ_DATAWRITERASYNC_HPP
@@ -0,0 +1,342 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Compress buffers in a pool of worker threads before passing them on to
+ * another DataWriter.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERCOMPRESS_HPP
+#define JADAQ_DATAWRITERCOMPRESS_HPP
+
+#include "BufferPool.hpp"
+#include "Compress.hpp"
+#include "DataFormat.hpp"
+#include "DataWriter.hpp"
+#include "container.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/* Each buffer is copied into a block from the shared BufferPool and queued.
+ * The worker threads take buffers in order and compress each into a block,
+ * see Compress.hpp. A delivery thread passes the blocks on to the wrapped
+ * writer in the order the buffers came in, as buffers of
+ * Data::CompressedElement. A buffer whose block would not fit in a packet is
+ * compressed in two or more parts instead, so a digitizer keeps writing one
+ * element type. Only an element that does not fit alone is passed on as it
+ * is. split() and addDigitizer() are queued with the data so they stay in
+ * order.
+ */
+class DataWriterCompress {
+public:
+  struct ThreadStats {
+    uint64_t buffers = 0;  // compressed by the thread
+    uint64_t bytesIn = 0;  // of elements
+    uint64_t bytesOut = 0; // of blocks
+    uint64_t busy = 0;     // microseconds spent compressing
+  };
+  struct Stats {
+    uint64_t buffers = 0;   // buffers queued
+    uint64_t parted = 0;    // buffers compressed in more than one block
+    uint64_t stored = 0;    // buffers with elements passed on uncompressed
+    uint64_t stalls = 0;    // buffers that had to wait for room in the queue
+    uint64_t stallTime = 0; // microseconds spent waiting for room
+    std::vector<ThreadStats> threads;
+  };
+
+  DataWriterCompress(DataWriter &&dataWriter_, jadaq::compress::Method method_, size_t threads, size_t queueSize)
+      : dataWriter(std::move(dataWriter_)), method(method_), jobs(std::max(queueSize, (size_t)1)),
+        threadStats(std::max(threads, (size_t)1)) {
+    for (size_t i = 0; i < threadStats.size(); ++i)
+      workers.emplace_back(&DataWriterCompress::work, this, i);
+    delivery = std::thread(&DataWriterCompress::deliver, this);
+  }
+
+  ~DataWriterCompress() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    done.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+    delivery.join();
+  }
+
+  void addDigitizer(uint32_t digitizerID) {
+    Job job;
+    job.kind = Job::Digitizer;
+    job.digitizerID = digitizerID;
+    push(std::move(job));
+  }
+
+  void split(const std::string &id) {
+    Job job;
+    job.kind = Job::Split;
+    job.id = id;
+    push(std::move(job));
+  }
+
+  static bool network() { return false; }
+
+  template <typename E>
+  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    if (buffer->empty())
+      return;
+    Job job;
+    job.kind = Job::Data;
+    job.forward = &DataWriterCompress::forward<E>;
+    job.elementType = E::type();
+    job.bytes = buffer->data_size() - buffer->header_size();
+    job.elements = buffer->size();
+    job.elementSize = job.bytes / job.elements;
+    job.headSize = headSize<E>(job.elementSize);
+    job.data = jadaq::BufferPool::allocate(job.bytes);
+    memcpy(job.data, buffer->data() + buffer->header_size(), job.bytes);
+    job.digitizerID = digitizerID;
+    job.globalTimeStamp = globalTimeStamp;
+    push(std::move(job));
+  }
+
+  /* Wait until everything queued so far has been passed on */
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return delivered == queued; });
+  }
+
+  Stats getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats s = stats;
+    s.threads = threadStats;
+    return s;
+  }
+
+private:
+  struct Job;
+  typedef void (*ForwardFunction)(DataWriter &, const Job &, size_t, size_t);
+  /* A compressed block of elements first to first + count, or those
+   * elements as they are if data is nullptr */
+  struct Block {
+    char *data = nullptr; // from the buffer pool
+    size_t size = 0;
+    size_t first = 0;
+    size_t count = 0;
+  };
+  struct Job {
+    enum Kind { Data, Digitizer, Split } kind = Data;
+    enum State { Free, Queued, Working, Done } state = Free;
+    ForwardFunction forward = nullptr; // passes the uncompressed elements on
+    uint16_t elementType = 0;
+    char *data = nullptr; // elements, from the buffer pool
+    size_t bytes = 0;
+    size_t elements = 0;
+    size_t elementSize = 0;
+    size_t headSize = 0;
+    std::vector<Block> blocks;
+    uint32_t digitizerID = 0;
+    uint64_t globalTimeStamp = 0;
+    std::string id; // of the split
+  };
+
+  DataWriter dataWriter;
+  const jadaq::compress::Method method;
+  mutable std::mutex mutex;
+  std::condition_variable ready;   // a job is queued
+  std::condition_variable done;    // the next job to deliver is done
+  std::condition_variable notFull; // a job slot is free
+  std::condition_variable idle;    // everything queued has been delivered
+  std::vector<Job> jobs;           // ring indexed by sequence number
+  uint64_t queued = 0;             // sequence number of the next job queued
+  uint64_t taken = 0;              // of the next job for a worker
+  uint64_t delivered = 0;          // of the next job to deliver
+  bool stopping = false;
+  Stats stats;
+  std::vector<ThreadStats> threadStats;
+  std::vector<std::thread> workers;
+  std::thread delivery;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  /* Bytes of an element before its 16 bit waveform samples - packed samples
+   * are treated as part of the head */
+  template <typename E> static size_t headSize(size_t elementSize) {
+    return jadaq::fixed_size<E>::value || (E::type() & Data::PackedBase) ? elementSize : E::size(0);
+  }
+
+  /* Pass count of the job's elements from first on as they are */
+  template <typename E> static void forward(DataWriter &dataWriter, const Job &job, size_t first, size_t count) {
+    jadaq::buffer<E> buffer(count * job.elementSize + sizeof(Data::Header), job.elementSize, sizeof(Data::Header));
+    buffer.append(job.data + first * job.elementSize, count);
+    dataWriter(&buffer, job.digitizerID, job.globalTimeStamp);
+  }
+
+  Job &slot(uint64_t sequence) { return jobs[sequence % jobs.size()]; }
+
+  void push(Job &&job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (queued - delivered == jobs.size()) {
+      const int64_t start = now();
+      stats.stalls++;
+      notFull.wait(lock, [this] { return queued - delivered < jobs.size(); });
+      stats.stallTime += now() - start;
+    }
+    if (job.kind == Job::Data)
+      stats.buffers++;
+    job.state = Job::Queued;
+    slot(queued++) = std::move(job);
+    ready.notify_one();
+  }
+
+  void work(size_t thread) {
+    std::vector<char> scratch;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      ready.wait(lock, [this] { return taken < queued || stopping; });
+      if (taken == queued)
+        return;
+      const uint64_t sequence = taken++;
+      Job &job = slot(sequence);
+      job.state = Job::Working;
+      if (job.kind == Job::Data) {
+        lock.unlock();
+        const int64_t start = now();
+        const size_t bytesOut = encode(job, scratch);
+        const int64_t busy = now() - start;
+        lock.lock();
+        ThreadStats &s = threadStats[thread];
+        s.buffers++;
+        s.bytesIn += job.bytes;
+        s.bytesOut += bytesOut;
+        s.busy += busy;
+      }
+      job.state = Job::Done;
+      if (sequence == delivered)
+        done.notify_one();
+    }
+  }
+
+  /* Compress the job into as few blocks as fit, halving the elements per
+   * block down to one. Returns the bytes to pass on */
+  size_t encode(Job &job, std::vector<char> &scratch) {
+    const size_t capacity = Data::maxBufferSize - sizeof(Data::Header);
+    for (size_t parts = 1;; parts *= 2) {
+      const size_t perPart = (job.elements + parts - 1) / parts;
+      size_t bytesOut = 0;
+      bool fits = true;
+      for (size_t first = 0; first < job.elements && fits; first += perPart) {
+        Block block;
+        block.first = first;
+        block.count = std::min(perPart, job.elements - first);
+        block.data = jadaq::BufferPool::allocate(Data::maxBufferSize);
+        block.size = jadaq::compress::encode(method, job.elementType, job.data + first * job.elementSize,
+                                             block.count, job.elementSize, job.headSize, block.data, capacity,
+                                             scratch);
+        if (block.size == 0) {
+          // only an element that does not fit alone is passed on as it is
+          jadaq::BufferPool::deallocate(block.data);
+          block.data = nullptr;
+          block.size = block.count * job.elementSize;
+          fits = perPart == 1;
+        }
+        if (!fits)
+          break;
+        if (block.data == nullptr && !job.blocks.empty() && job.blocks.back().data == nullptr) {
+          job.blocks.back().count += block.count;
+          job.blocks.back().size += block.size;
+        } else {
+          job.blocks.push_back(block);
+        }
+        bytesOut += block.size;
+      }
+      if (fits)
+        return bytesOut;
+      for (Block &block : job.blocks)
+        jadaq::BufferPool::deallocate(block.data);
+      job.blocks.clear();
+    }
+  }
+
+  void deliver() {
+    jadaq::buffer<Data::CompressedElement> out(Data::maxBufferSize, Data::CompressedElement::size(),
+                                                sizeof(Data::Header));
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      done.wait(lock, [this] {
+        return (delivered < queued && slot(delivered).state == Job::Done) || (stopping && delivered == queued);
+      });
+      if (delivered == queued)
+        return;
+      Job job = std::move(slot(delivered));
+      lock.unlock();
+      switch (job.kind) {
+      case Job::Data:
+        for (Block &block : job.blocks) {
+          if (block.data == nullptr) {
+            job.forward(dataWriter, job, block.first, block.count);
+            continue;
+          }
+          out.clear();
+          out.append(block.data, block.size);
+          dataWriter(&out, job.digitizerID, job.globalTimeStamp);
+          jadaq::BufferPool::deallocate(block.data);
+        }
+        jadaq::BufferPool::deallocate(job.data);
+        break;
+      case Job::Digitizer:
+        dataWriter.addDigitizer(job.digitizerID);
+        break;
+      case Job::Split:
+        dataWriter.split(job.id);
+        break;
+      }
+      lock.lock();
+      if (job.kind == Job::Data) {
+        bool stored = false;
+        for (const Block &block : job.blocks)
+          stored = stored || block.data == nullptr;
+        if (stored)
+          stats.stored++;
+        else if (job.blocks.size() > 1)
+          stats.parted++;
+      }
+      slot(delivered).state = Job::Free;
+      delivered++;
+      notFull.notify_one();
+      if (delivered == queued)
+        idle.notify_all();
+    }
+  }
+};
+
+#endif // JADAQ_DATAWRITERCOMPRESS_HPP
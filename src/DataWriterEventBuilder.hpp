@@ -0,0 +1,290 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Event builder placed in front of another DataWriter. It merges the time
+ * sorted list mode streams of all digitizers and groups hits that fall
+ * within a coincidence window into events.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITEREVENTBUILDER_HPP
+#define JADAQ_DATAWRITEREVENTBUILDER_HPP
+
+#include "DataFormat.hpp"
+#include "DataHandler.hpp"
+#include "DataWriter.hpp"
+#include "container.hpp"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/* Hits of a digitizer are queued in a ring per digitizer as they arrive -
+ * each digitizer delivers them in time order - and merged by always taking
+ * the oldest queued hit. A hit is only taken when every active digitizer
+ * has delivered hits at least as late, so events are complete when written.
+ * Digitizers that have not delivered anything for idleTime are not waited
+ * for. An event opens with its first hit and takes every hit no more than
+ * window ticks later. Events with fewer than multiplicity hits are dropped.
+ * Only DPP-QDC list mode data is built - other element types are passed
+ * through to the wrapped writer unchanged.
+ */
+class DataWriterEventBuilder {
+public:
+  struct Stats {
+    uint64_t hits = 0;     // hits taken in
+    uint64_t events = 0;   // events written
+    uint64_t rejected = 0; // events dropped for low multiplicity
+    uint64_t forced = 0;   // hits built before all digitizers had caught up
+    uint64_t late = 0;     // hits older than an event already built
+    uint64_t pending = 0;  // hits queued
+  };
+  /* digitizerID of the built event stream */
+  static constexpr const uint32_t builderID = 0xffffffff;
+
+  DataWriterEventBuilder(DataWriter &&dataWriter_, uint64_t window_, size_t multiplicity_ = 1)
+      : dataWriter(std::move(dataWriter_)), window(window_), multiplicity(multiplicity_),
+        out(Data::maxBufferSize, Data::EventElement::size(), sizeof(Data::Header)) {
+    event.reserve(out.capacity());
+    dataWriter.addDigitizer(builderID);
+  }
+
+  ~DataWriterEventBuilder() { flush(); }
+
+  void addDigitizer(uint32_t digitizerID) {
+    std::lock_guard<std::mutex> lock(mutex);
+    source(digitizerID);
+    dataWriter.addDigitizer(digitizerID);
+  }
+
+  void split(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    drain();
+    dataWriter.split(id);
+  }
+
+  void operator()(const jadaq::buffer<Data::ListElement422> *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    add(buffer, digitizerID);
+  }
+  void operator()(const jadaq::buffer<Data::ListElement8222> *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    add(buffer, digitizerID);
+  }
+  void operator()(const jadaq::buffer<Data::ListElement822> *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    add(buffer, digitizerID);
+  }
+  template <typename E>
+  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    dataWriter(buffer, digitizerID, globalTimeStamp);
+  }
+
+  /* Build and write everything queued regardless of the watermark */
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    drain();
+  }
+
+  Stats getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+private:
+  /* Hits queued per digitizer */
+  static constexpr const size_t ringSize = 1 << 16;
+  /* Milliseconds without data before a digitizer no longer holds back the
+   * others */
+  static constexpr const int64_t idleTime = 1000;
+  /* Milliseconds a partly filled output buffer may wait for more events */
+  static constexpr const int64_t maxAge = 100;
+
+  struct Hit {
+    uint64_t time;
+    uint16_t channel;
+    uint16_t charge;
+  };
+  struct Source {
+    uint32_t digitizerID;
+    std::vector<Hit> ring;
+    size_t head = 0;
+    size_t count = 0;
+    uint64_t last = 0; // latest time delivered
+    int64_t lastSeen;  // wall clock of the latest delivery
+  };
+
+  DataWriter dataWriter;
+  const uint64_t window;
+  const size_t multiplicity;
+  mutable std::mutex mutex;
+  std::map<uint32_t, size_t> sourceIndex;
+  std::vector<Source> sources;
+  std::vector<uint64_t> heads; // time of the oldest queued hit per source, empty if UINT64_MAX
+  std::vector<Data::EventElement> event;
+  uint64_t eventStart = 0;
+  uint64_t eventNo = 0;
+  uint64_t lastBuilt = 0;
+  jadaq::buffer<Data::EventElement> out;
+  uint64_t globalTimeStamp = 0;
+  Stats stats;
+
+  Source &source(uint32_t digitizerID) {
+    auto itr = sourceIndex.find(digitizerID);
+    if (itr != sourceIndex.end())
+      return sources[itr->second];
+    sourceIndex[digitizerID] = sources.size();
+    sources.emplace_back();
+    Source &s = sources.back();
+    s.digitizerID = digitizerID;
+    s.ring.resize(ringSize);
+    s.lastSeen = DataHandler::getTimeMsecs();
+    heads.push_back(UINT64_MAX);
+    return s;
+  }
+
+  /* Time of the element extended to 64 bit - 32 bit time tags roll over */
+  static uint64_t extend(const Data::ListElement422 &e, uint64_t last) {
+    uint64_t time = (last & ~0xffffffffull) | e.time;
+    if (time < last && last - time > 0x80000000ull)
+      time += 1ull << 32;
+    return time;
+  }
+  static uint64_t extend(const Data::ListElement8222 &e, uint64_t) { return e.time; }
+  static uint64_t extend(const Data::ListElement822 &e, uint64_t) { return e.time; }
+
+  template <typename E> void add(const jadaq::buffer<E> *buffer, uint32_t digitizerID) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Source &s = source(digitizerID);
+    const size_t index = &s - sources.data();
+    stats.hits += buffer->size();
+    stats.pending += buffer->size();
+    for (const E &element : *buffer) {
+      if (s.count == ringSize) {
+        // build up to the head of the full ring to make room
+        const uint64_t mark = watermark();
+        stats.forced += build(heads[index], mark);
+      }
+      const uint64_t time = extend(element, s.last);
+      size_t slot = s.head + s.count;
+      if (slot >= ringSize)
+        slot -= ringSize;
+      s.ring[slot] = Hit{time, element.channel, element.charge};
+      if (s.count++ == 0)
+        heads[index] = time;
+      s.last = std::max(s.last, time);
+    }
+    s.lastSeen = DataHandler::getTimeMsecs();
+    const uint64_t mark = watermark();
+    build(mark, mark);
+    if (!out.empty() && DataHandler::getTimeMsecs() - (int64_t)globalTimeStamp >= maxAge)
+      write();
+  }
+
+  /* Oldest delivered time over the digitizers that are not idle */
+  uint64_t watermark() const {
+    const int64_t t = DataHandler::getTimeMsecs();
+    uint64_t mark = UINT64_MAX;
+    for (const Source &s : sources) {
+      if (t - s.lastSeen < idleTime)
+        mark = std::min(mark, s.last);
+    }
+    return mark;
+  }
+
+  /* Source holding the oldest queued hit */
+  size_t oldest() const {
+    size_t index = 0;
+    uint64_t time = heads[0];
+    for (size_t i = 1; i < heads.size(); ++i) {
+      const bool older = heads[i] < time;
+      time = older ? heads[i] : time;
+      index = older ? i : index;
+    }
+    return index;
+  }
+
+  /* Merge queued hits up to and including limit into events. An event is
+   * closed once a hit outside its window is taken or mark has passed its
+   * window. Returns the number of hits taken later than mark. */
+  size_t build(uint64_t limit, uint64_t mark) {
+    size_t forced = 0;
+    if (sources.empty())
+      return forced;
+    for (size_t index = oldest(); stats.pending > 0 && heads[index] <= limit; index = oldest()) {
+      Source &s = sources[index];
+      const Hit &hit = s.ring[s.head];
+      if (!event.empty() && (hit.time < eventStart || hit.time - eventStart > window))
+        close();
+      if (event.empty())
+        eventStart = hit.time;
+      if (hit.time < lastBuilt)
+        stats.late++;
+      if (hit.time > mark)
+        forced++;
+      event.push_back(Data::EventElement{0, hit.time, s.digitizerID, hit.channel, hit.charge});
+      s.head = s.head + 1 == ringSize ? 0 : s.head + 1;
+      heads[index] = --s.count > 0 ? s.ring[s.head].time : UINT64_MAX;
+      stats.pending--;
+    }
+    if (!event.empty() && mark != UINT64_MAX && mark > eventStart && mark - eventStart > window)
+      close();
+    return forced;
+  }
+
+  void close() {
+    lastBuilt = std::max(lastBuilt, event.back().time);
+    if (event.size() < multiplicity) {
+      stats.rejected++;
+      event.clear();
+      return;
+    }
+    if (out.capacity() - out.size() < event.size() && event.size() <= out.capacity())
+      write(); // keep an event within one packet when it fits
+    for (Data::EventElement &hit : event) {
+      if (out.full())
+        write();
+      if (out.empty())
+        globalTimeStamp = DataHandler::getTimeMsecs();
+      hit.eventNo = eventNo;
+      out.append(&hit);
+    }
+    eventNo++;
+    stats.events++;
+    event.clear();
+  }
+
+  void write() {
+    if (!out.empty()) {
+      dataWriter(&out, builderID, globalTimeStamp);
+      out.clear();
+    }
+  }
+
+  void drain() {
+    build(UINT64_MAX, UINT64_MAX);
+    if (!event.empty())
+      close();
+    write();
+  }
+};
+
+#endif // JADAQ_DATAWRITEREVENTBUILDER_HPP
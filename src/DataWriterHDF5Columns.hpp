@@ -0,0 +1,408 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Write data to HDF5 file with one extendible dataset per field
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERHDF5COLUMNS_HPP
+#define JADAQ_DATAWRITERHDF5COLUMNS_HPP
+
+#include "DataFormat.hpp"
+#include "container.hpp"
+#include "xtrace.h"
+#include <H5Cpp.h>
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+/* Every digitizer gets a group with one dataset per member of the HDF5
+ * compound type of its elements - e.g. time, channel and charge - holding
+ * one row per element. Array members such as waveform samples become two
+ * dimensional datasets. The datasets are chunked and optionally filtered.
+ * An index dataset maps each globalTime to the rows written with it.
+ *
+ * With the direct option the rows of each dataset are staged until a chunk
+ * is full and the chunk is written with H5Dwrite_chunk, after shuffling and
+ * deflating it here. That skips the selection, conversion and filter
+ * pipeline of the library, and the dataset is extended once per chunk.
+ * The LZ4 filter is not applied here, so LZ4 always goes through the library.
+ */
+class DataWriterHDF5Columns {
+public:
+  enum class Compression { None, Deflate, LZ4 };
+  struct Options {
+    size_t chunkBytes = 1 << 20; // per chunk of each dataset
+    Compression compression = Compression::None;
+    int level = 4; // deflate level
+    bool direct = true; // write whole chunks with H5Dwrite_chunk
+  };
+  /* Registered id of the LZ4 filter plugin */
+  static constexpr const H5Z_filter_t lz4Filter = 32004;
+
+  DataWriterHDF5Columns(const std::string &pathname_, const std::string &basename_, const std::string &&id)
+      : DataWriterHDF5Columns(pathname_, basename_, std::move(id), Options()) {}
+
+  DataWriterHDF5Columns(const std::string &pathname_, const std::string &basename_, const std::string &&id,
+                        const Options &options_)
+      : pathname(pathname_), basename(basename_), options(options_) {
+    if (options.compression == Compression::LZ4 && !H5Zfilter_avail(lz4Filter)) {
+      XTRACE(DATAH, WAR, "LZ4 HDF5 filter plugin not found - using deflate");
+      options.compression = Compression::Deflate;
+    }
+    if (options.compression == Compression::Deflate && !H5Zfilter_avail(H5Z_FILTER_DEFLATE)) {
+      XTRACE(DATAH, WAR, "HDF5 built without deflate - writing uncompressed");
+      options.compression = Compression::None;
+    }
+    if (options.compression == Compression::LZ4)
+      options.direct = false;
+    open(id);
+  }
+
+  ~DataWriterHDF5Columns() {
+    std::lock_guard<std::mutex> lock(mutex);
+    close();
+  }
+
+  void split(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    close();
+    open(id);
+  }
+
+  void addDigitizer(uint32_t digitizerID) {
+    std::lock_guard<std::mutex> lock(mutex);
+    getDigitizer(digitizerID);
+  }
+
+  static bool network() { return false; }
+
+  template <typename E>
+  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    if (buffer->size() < 1)
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Digitizer &digitizer = getDigitizer(digitizerID);
+    const size_t elementSize = (buffer->data_size() - buffer->header_size()) / buffer->size();
+    if (digitizer.format == Data::ElementType::None) {
+      digitizer.format = E::type();
+      digitizer.elementSize = elementSize;
+      writeAttribute("JADAQ_DATA_TYPE", digitizer.group, H5::PredType::NATIVE_UINT16, &digitizer.format);
+      createColumns(digitizer, buffer->begin()->h5type());
+    } else if (digitizer.format != E::type() || digitizer.elementSize != elementSize) {
+      XTRACE(DATAH, ERR, "Element type of digitizer %u changed - dropping %zu elements", digitizerID,
+             buffer->size());
+      return;
+    }
+    const char *elements = buffer->data() + buffer->header_size();
+    const hsize_t n = buffer->size();
+    try {
+      for (Column &column : digitizer.columns) {
+        if (options.direct)
+          stage(column, elements, elementSize, n);
+        else
+          write(column, elements, elementSize, digitizer.rows, n);
+      }
+    } catch (H5::Exception &e) {
+      std::cerr << "Error while writing to HDF5 file: " << e.getDetailMsg() << "\n\t "
+                << "HDF5::write( " << digitizerID << ", " << globalTimeStamp << ", " << n << " )" << std::endl;
+      return;
+    }
+    index(digitizer, globalTimeStamp, n);
+    digitizer.rows += n;
+  }
+
+private:
+  struct Column {
+    H5::DataSet dataset;
+    H5::DataType type; // of a row, or of an array element for arrays
+    size_t offset;     // of the member in the element
+    size_t size;       // of the member
+    hsize_t width;     // array elements per row, 0 for scalar members
+    hsize_t chunkRows;
+    std::vector<char> chunk; // rows staged for the next direct write
+    hsize_t staged = 0;      // rows in chunk
+    hsize_t chunks = 0;      // chunks written directly
+  };
+  struct IndexEntry {
+    uint64_t globalTime;
+    uint64_t first; // row
+    uint64_t rows;
+  };
+  struct Digitizer {
+    H5::Group group;
+    uint16_t format = Data::ElementType::None;
+    size_t elementSize = 0;
+    std::vector<Column> columns;
+    H5::DataSet index;
+    hsize_t rows = 0;
+    hsize_t indexRows = 0;
+    IndexEntry pending{0, 0, 0}; // index entry still growing
+  };
+  const std::string &pathname;
+  const std::string &basename;
+  Options options;
+  H5::H5File *file = nullptr;
+  std::mutex mutex;
+  std::map<uint32_t, Digitizer> digitizers;
+  std::vector<char> scratch;
+  std::vector<char> compressed;
+
+  static H5::CompType indexType() {
+    H5::CompType type(sizeof(IndexEntry));
+    type.insertMember("globalTime", HOFFSET(IndexEntry, globalTime), H5::PredType::NATIVE_UINT64);
+    type.insertMember("first", HOFFSET(IndexEntry, first), H5::PredType::NATIVE_UINT64);
+    type.insertMember("rows", HOFFSET(IndexEntry, rows), H5::PredType::NATIVE_UINT64);
+    return type;
+  }
+
+  template <typename H5LOC>
+  void writeAttribute(std::string name, H5LOC &location, const H5::DataType &type, const void *data) const {
+    try {
+      H5::Attribute a = location.createAttribute(name, type, H5::DataSpace(H5S_SCALAR));
+      a.write(type, data);
+      a.close();
+    } catch (H5::Exception &e) {
+      std::cerr << "ERROR: DataWriterHDF5Columns can not writeAttribute \"" << name << "\"." << std::endl;
+      throw;
+    }
+  }
+
+  Digitizer &getDigitizer(uint32_t digitizerID) {
+    auto itr = digitizers.find(digitizerID);
+    if (itr != digitizers.end())
+      return itr->second;
+    Digitizer &digitizer = digitizers[digitizerID];
+    // same group naming as the packet table layout
+    digitizer.group = file->createGroup(std::to_string(digitizerID & 0xFFFF));
+    return digitizer;
+  }
+
+  H5::DSetCreatPropList chunked(int rank, const hsize_t *chunk) const {
+    H5::DSetCreatPropList properties;
+    properties.setChunk(rank, chunk);
+    switch (options.compression) {
+    case Compression::Deflate:
+      properties.setShuffle();
+      properties.setDeflate(options.level);
+      break;
+    case Compression::LZ4:
+      properties.setShuffle();
+      properties.setFilter(lz4Filter, H5Z_FLAG_OPTIONAL);
+      break;
+    case Compression::None:
+      break;
+    }
+    return properties;
+  }
+
+  void createColumns(Digitizer &digitizer, const H5::CompType &type) {
+    for (int i = 0; i < type.getNmembers(); ++i) {
+      Column column;
+      column.offset = type.getMemberOffset(i);
+      H5::DataType member = type.getMemberDataType(i);
+      column.size = member.getSize();
+      column.width = 0;
+      if (type.getMemberClass(i) == H5T_ARRAY) {
+        H5::ArrayType array = type.getMemberArrayType(i);
+        array.getArrayDims(&column.width);
+        column.type = array.getSuper();
+      } else {
+        column.type = member;
+      }
+      const int rank = column.width ? 2 : 1;
+      const hsize_t dims[2] = {0, column.width};
+      const hsize_t maxDims[2] = {H5S_UNLIMITED, column.width};
+      column.chunkRows = std::max<hsize_t>(1, options.chunkBytes / column.size);
+      const hsize_t chunk[2] = {column.chunkRows, column.width};
+      if (options.direct)
+        column.chunk.resize(column.chunkRows * column.size);
+      column.dataset = digitizer.group.createDataSet(type.getMemberName(i), column.type,
+                                                     H5::DataSpace(rank, dims, maxDims), chunked(rank, chunk));
+      digitizer.columns.push_back(column);
+    }
+    const hsize_t dims[1] = {0};
+    const hsize_t maxDims[1] = {H5S_UNLIMITED};
+    const hsize_t chunk[1] = {4096};
+    H5::DSetCreatPropList properties;
+    properties.setChunk(1, chunk);
+    digitizer.index = digitizer.group.createDataSet("index", indexType(), H5::DataSpace(1, dims, maxDims), properties);
+  }
+
+  /* Copy n members of size bytes, one per stride bytes of in, to out */
+  template <size_t size> static void gather(char *out, const char *in, size_t stride, hsize_t n) {
+    for (hsize_t i = 0; i < n; ++i, in += stride, out += size)
+      memcpy(out, in, size);
+  }
+  static void gather(char *out, const char *in, size_t stride, size_t size, hsize_t n) {
+    switch (size) {
+    case 1:
+      return gather<1>(out, in, stride, n);
+    case 2:
+      return gather<2>(out, in, stride, n);
+    case 4:
+      return gather<4>(out, in, stride, n);
+    case 8:
+      return gather<8>(out, in, stride, n);
+    default:
+      for (hsize_t i = 0; i < n; ++i, in += stride, out += size)
+        memcpy(out, in, size);
+    }
+  }
+
+  /* Append member column of the n elements */
+  void write(Column &column, const char *elements, size_t elementSize, hsize_t rows, hsize_t n) {
+    scratch.resize(n * column.size);
+    gather(scratch.data(), elements + column.offset, elementSize, column.size, n);
+    const int rank = column.width ? 2 : 1;
+    const hsize_t extent[2] = {rows + n, column.width};
+    column.dataset.extend(extent);
+    H5::DataSpace fileSpace = column.dataset.getSpace();
+    const hsize_t start[2] = {rows, 0};
+    const hsize_t count[2] = {n, column.width};
+    fileSpace.selectHyperslab(H5S_SELECT_SET, count, start);
+    column.dataset.write(scratch.data(), column.type, H5::DataSpace(rank, count), fileSpace);
+  }
+
+  /* Stage member column of the n elements, writing chunks as they fill */
+  void stage(Column &column, const char *elements, size_t elementSize, hsize_t n) {
+    const char *in = elements + column.offset;
+    while (n > 0) {
+      const hsize_t rows = std::min(n, column.chunkRows - column.staged);
+      gather(column.chunk.data() + column.staged * column.size, in, elementSize, column.size, rows);
+      in += rows * elementSize;
+      column.staged += rows;
+      n -= rows;
+      if (column.staged == column.chunkRows)
+        writeChunk(column);
+    }
+  }
+
+  /* Write the staged rows as the next chunk, padded to a full chunk */
+  void writeChunk(Column &column) {
+    if (column.staged == 0)
+      return;
+    memset(column.chunk.data() + column.staged * column.size, 0, (column.chunkRows - column.staged) * column.size);
+    const hsize_t offset[2] = {column.chunks * column.chunkRows, 0};
+    const hsize_t extent[2] = {offset[0] + column.chunkRows, column.width};
+    column.dataset.extend(extent);
+    const char *data = column.chunk.data();
+    size_t size = column.chunk.size();
+    if (options.compression == Compression::Deflate) {
+      shuffle(column.chunk.data(), size, column.type.getSize());
+      uLongf compressedSize = compressBound(size);
+      compressed.resize(compressedSize);
+      if (compress2((Bytef *)compressed.data(), &compressedSize, (const Bytef *)scratch.data(), size,
+                    options.level) != Z_OK)
+        throw H5::DataSetIException("DataWriterHDF5Columns::writeChunk", "deflate failed");
+      data = compressed.data();
+      size = compressedSize;
+    }
+    if (H5Dwrite_chunk(column.dataset.getId(), H5P_DEFAULT, 0, offset, size, data) < 0)
+      throw H5::DataSetIException("DataWriterHDF5Columns::writeChunk", "H5Dwrite_chunk failed");
+    column.chunks++;
+    column.staged = 0;
+  }
+
+  /* Byte transpose size bytes of elements of typeSize into scratch, like the HDF5 shuffle filter */
+  void shuffle(const char *in, size_t size, size_t typeSize) {
+    scratch.resize(size);
+    const size_t n = size / typeSize;
+    for (size_t b = 0; b < typeSize; ++b) {
+      char *out = scratch.data() + b * n;
+      for (size_t i = 0; i < n; ++i)
+        out[i] = in[i * typeSize + b];
+    }
+  }
+
+  /* Write the last partial chunk and trim the datasets to the rows written */
+  void finish(Digitizer &digitizer) {
+    for (Column &column : digitizer.columns) {
+      writeChunk(column);
+      const hsize_t extent[2] = {digitizer.rows, column.width};
+      column.dataset.extend(extent);
+    }
+  }
+
+  void index(Digitizer &digitizer, uint64_t globalTimeStamp, hsize_t n) {
+    if (digitizer.pending.rows > 0 && digitizer.pending.globalTime != globalTimeStamp)
+      writeIndex(digitizer);
+    if (digitizer.pending.rows == 0) {
+      digitizer.pending.globalTime = globalTimeStamp;
+      digitizer.pending.first = digitizer.rows;
+    }
+    digitizer.pending.rows += n;
+  }
+
+  void writeIndex(Digitizer &digitizer) {
+    if (digitizer.pending.rows == 0)
+      return;
+    const hsize_t extent[1] = {digitizer.indexRows + 1};
+    digitizer.index.extend(extent);
+    H5::DataSpace fileSpace = digitizer.index.getSpace();
+    const hsize_t start[1] = {digitizer.indexRows};
+    const hsize_t count[1] = {1};
+    fileSpace.selectHyperslab(H5S_SELECT_SET, count, start);
+    digitizer.index.write(&digitizer.pending, indexType(), H5::DataSpace(1, count), fileSpace);
+    digitizer.indexRows++;
+    digitizer.pending.rows = 0;
+  }
+
+  void open(const std::string &id) {
+    std::string filename = pathname + basename + id + ".h5";
+    try {
+      assert(file == nullptr);
+      file = new H5::H5File(filename, H5F_ACC_TRUNC);
+      H5::Group root = file->openGroup("/");
+      const std::string layout = "columns";
+      writeAttribute("JADAQ_LAYOUT", root, H5::StrType(H5::PredType::C_S1, layout.size()), layout.c_str());
+    } catch (H5::Exception &e) {
+      std::cerr << "ERROR: could not open/create HDF5-file \"" << filename << "\":" << e.getDetailMsg()
+                << std::endl;
+      throw;
+    }
+  }
+
+  void close() {
+    assert(file);
+    for (auto &itr : digitizers) {
+      if (itr.second.format == Data::ElementType::None)
+        continue;
+      try {
+        if (options.direct)
+          finish(itr.second);
+        writeIndex(itr.second);
+      } catch (H5::Exception &e) {
+        std::cerr << "Error while closing HDF5 file: " << e.getDetailMsg() << std::endl;
+      }
+    }
+    digitizers.clear();
+    file->close();
+    delete file;
+    file = nullptr;
+  }
+};
+
+#endif // JADAQ_DATAWRITERHDF5COLUMNS_HPP
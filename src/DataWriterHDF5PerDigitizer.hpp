@@ -0,0 +1,169 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Write each digitizer to its own HDF5 file, tied together by a master file
+ * of external links.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERHDF5PERDIGITIZER_HPP
+#define JADAQ_DATAWRITERHDF5PERDIGITIZER_HPP
+
+#include "DataWriter.hpp"
+#include "container.hpp"
+#include <H5Cpp.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/* Every digitizer gets its own writer, made by the factory with the basename
+ * extended by the digitizer group name, e.g. jadaq-d1-00042.h5. Writes to
+ * different digitizers only share the short lookup of the writer, so they
+ * proceed in parallel. The master file, e.g. jadaq-00042.h5, has an external
+ * link per digitizer group to its file so it reads like a single file. When
+ * the file is closed or split, the links to digitizers that wrote nothing
+ * are dropped, since their groups are never created.
+ * split() takes every digitizer's lock, so all files change at once.
+ * Unless the HDF5 library is built thread safe, writes are serialized anyway.
+ */
+class DataWriterHDF5PerDigitizer {
+public:
+  /* Make a writer for files named pathname + basename + id + ".h5" */
+  typedef std::function<DataWriter(const std::string &basename, const std::string &id)> Factory;
+
+  DataWriterHDF5PerDigitizer(const std::string &pathname_, const std::string &basename_, const std::string &&id_,
+                             Factory factory_)
+      : pathname(pathname_), basename(basename_), id(id_), factory(factory_) {
+    writeMaster(true);
+  }
+
+  ~DataWriterHDF5PerDigitizer() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_lock<std::mutex> libraryLock = lockLibrary();
+    writeMaster(false);
+  }
+
+  static bool threadSafe() {
+    hbool_t threadSafe = false;
+    H5is_library_threadsafe(&threadSafe);
+    return threadSafe;
+  }
+
+  void addDigitizer(uint32_t digitizerID) {
+    Writer &writer = getWriter(digitizerID);
+    std::unique_lock<std::mutex> libraryLock = lockLibrary();
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    writer.dataWriter.addDigitizer(digitizerID);
+  }
+
+  void split(const std::string &id_) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_lock<std::mutex> libraryLock = lockLibrary();
+    for (auto &itr : writers)
+      itr.second->mutex.lock();
+    writeMaster(false);
+    for (auto &itr : writers) {
+      itr.second->dataWriter.split(id_);
+      itr.second->written = false;
+    }
+    id = id_;
+    writeMaster(true);
+    for (auto &itr : writers)
+      itr.second->mutex.unlock();
+  }
+
+  static bool network() { return false; }
+
+  template <typename E>
+  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    Writer &writer = getWriter(digitizerID);
+    std::unique_lock<std::mutex> libraryLock = lockLibrary();
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    writer.dataWriter(buffer, digitizerID, globalTimeStamp);
+    writer.written = true;
+  }
+
+private:
+  struct Writer {
+    std::string basename; // referenced by the writer
+    DataWriter dataWriter;
+    std::mutex mutex;
+    bool written = false; // to the current file
+  };
+  const std::string &pathname;
+  const std::string &basename;
+  std::string id;
+  Factory factory;
+  /* Locks are taken in the order mutex, library, Writer::mutex */
+  std::mutex mutex; // guards writers and the master file
+  const bool parallel = threadSafe();
+  std::mutex library; // serializes HDF5 calls when the library is not thread safe
+  std::map<uint32_t, std::unique_ptr<Writer>> writers;
+
+  std::unique_lock<std::mutex> lockLibrary() {
+    std::unique_lock<std::mutex> lock(library, std::defer_lock);
+    if (!parallel)
+      lock.lock();
+    return lock;
+  }
+
+  static std::string groupName(uint32_t digitizerID) { return std::to_string(digitizerID & 0xFFFF); }
+
+  Writer &getWriter(uint32_t digitizerID) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Writer> &writer = writers[digitizerID];
+    if (!writer) {
+      std::unique_lock<std::mutex> libraryLock = lockLibrary();
+      writer.reset(new Writer);
+      writer->basename = basename + "d" + groupName(digitizerID) + "-";
+      writer->dataWriter = factory(writer->basename, id);
+      writeMaster(true);
+    }
+    return *writer;
+  }
+
+  /* (Re)write the master file with a link to each digitizer group, or only to
+   * those that have written to the current file */
+  void writeMaster(bool all) {
+    const std::string filename = pathname + basename + id + ".h5";
+    try {
+      H5::H5File master(filename, H5F_ACC_TRUNC);
+      for (auto &itr : writers) {
+        if (!all && !itr.second->written)
+          continue;
+        // relative to the master file, so the files can be moved together
+        const std::string target = itr.second->basename + id + ".h5";
+        const std::string name = groupName(itr.first);
+        H5Lcreate_external(target.c_str(), ("/" + name).c_str(), master.getId(), name.c_str(), H5P_DEFAULT,
+                           H5P_DEFAULT);
+      }
+      master.close();
+    } catch (H5::Exception &e) {
+      std::cerr << "ERROR: could not write HDF5 master file \"" << filename << "\":" << e.getDetailMsg()
+                << std::endl;
+      throw;
+    }
+  }
+};
+
+#endif // JADAQ_DATAWRITERHDF5PERDIGITIZER_HPP
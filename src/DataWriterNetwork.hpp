@@ -18,7 +18,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  * @section DESCRIPTION
- * Send collected data over the network
+ * Send collected data over the network, one UDP datagram per buffer
  *
  */
 
@@ -26,26 +26,253 @@
 #define JADAQ_DATAWRITERWORK_HPP
 
 /* Default to jumbo frame sized buffer */
+#include "BufferPool.hpp"
 #include "DataFormat.hpp"
 #include "container.hpp"
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/bind.hpp>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
 #include "xtrace.h"
 
 using boost::asio::ip::udp;
 
+/* With a batch of one every buffer is sent from the caller with send_to,
+ * one system call per datagram. With larger batches the datagram is copied
+ * into a block from the shared BufferPool and queued for a sender thread,
+ * which sends up to batch datagrams in one sendmmsg call once a batch is
+ * queued or the oldest queued datagram has waited flushTime. With gso,
+ * consecutive datagrams of equal size in a batch go to the kernel as one
+ * UDP GSO message that it splits into the same datagrams, falling back to
+ * one message per datagram if the kernel refuses.
+ */
 class DataWriterNetwork {
+public:
+  struct Options {
+    size_t batch = 32;        // datagrams per sendmmsg - 1 sends from the caller
+    uint32_t flushTime = 200; // microseconds a datagram waits for a full batch
+    size_t queueSize = 256;   // datagrams
+    bool gso = false;         // UDP generic segmentation offload
+  };
+  struct Stats {
+    uint64_t datagrams = 0; // sent
+    uint64_t bytes = 0;     // sent
+    uint64_t syscalls = 0;  // send_to or sendmmsg calls
+    uint64_t segmented = 0; // datagrams sent in GSO messages
+    uint64_t errors = 0;    // datagrams that could not be sent
+    uint64_t stalls = 0;    // datagrams that had to wait for room in the queue
+    uint64_t stallTime = 0; // microseconds spent waiting for room
+  };
+
 private:
+  struct Datagram {
+    char *data = nullptr; // from the buffer pool
+    size_t size = 0;
+    std::chrono::steady_clock::time_point queued;
+  };
+  /* A sendmmsg message - with GSO several datagrams of one size */
+  struct Message {
+    size_t first;  // datagram
+    size_t count;  // datagrams
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+  };
+  /* GSO limits: segments per message and bytes of UDP payload */
+  static constexpr const size_t gsoSegments = 64;
+  static constexpr const size_t gsoBytes = 0xffff - 8 - 20;
+
   uint64_t runID;
   boost::asio::io_service ioService;
   udp::endpoint remoteEndpoint;
   udp::socket *socket = nullptr;
   uint32_t seqNum{0};
+  Options options;
+  std::mutex sendMutex;       // numbering and sending in order
+  mutable std::mutex mutex;   // queue and stats
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::condition_variable idle;
+  std::vector<Datagram> ring;
+  size_t head = 0;
+  size_t count = 0;
+  bool sending = false; // sender thread has taken datagrams not yet sent
+  int flushes = 0;      // callers of flush() waiting
+  bool stopping = false;
+  Stats stats;
+  std::thread thread;
+  // only used by the sender thread
+  std::vector<Datagram> batch;
+  std::vector<Message> messages;
+  std::vector<struct mmsghdr> headers;
+  std::vector<struct iovec> iovecs;
+
+  static int64_t since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  void push(const char *data, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (count == ring.size()) {
+      const auto start = std::chrono::steady_clock::now();
+      stats.stalls++;
+      notFull.wait(lock, [this] { return count < ring.size(); });
+      stats.stallTime += since(start);
+    }
+    Datagram datagram;
+    datagram.data = jadaq::BufferPool::allocate(size);
+    datagram.size = size;
+    datagram.queued = std::chrono::steady_clock::now();
+    memcpy(datagram.data, data, size);
+    size_t slot = head + count;
+    if (slot >= ring.size())
+      slot -= ring.size();
+    ring[slot] = datagram;
+    count++;
+    // the sender waits for the first datagram and then for a full batch
+    if (count == 1 || count == options.batch)
+      notEmpty.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (count == 0) {
+        notEmpty.wait(lock, [this] { return count > 0 || stopping; });
+        if (count == 0)
+          return;
+      }
+      if (count < options.batch && !stopping && flushes == 0) {
+        const auto deadline = ring[head].queued + std::chrono::microseconds(options.flushTime);
+        notEmpty.wait_until(lock, deadline,
+                            [this] { return count >= options.batch || stopping || flushes > 0; });
+      }
+      const size_t n = std::min(count, options.batch);
+      batch.clear();
+      for (size_t i = 0; i < n; ++i) {
+        batch.push_back(ring[head]);
+        head = head + 1 == ring.size() ? 0 : head + 1;
+      }
+      count -= n;
+      sending = true;
+      notFull.notify_all();
+      lock.unlock();
+      Stats sent;
+      send(sent);
+      for (const Datagram &datagram : batch)
+        jadaq::BufferPool::deallocate(datagram.data);
+      lock.lock();
+      stats.datagrams += sent.datagrams;
+      stats.bytes += sent.bytes;
+      stats.syscalls += sent.syscalls;
+      stats.segmented += sent.segmented;
+      stats.errors += sent.errors;
+      sending = false;
+      if (count == 0)
+        idle.notify_all();
+    }
+  }
+
+  /* Messages for the batch from datagram first on */
+  void prepare(size_t first) {
+    messages.clear();
+    iovecs.resize(batch.size());
+    for (size_t i = first; i < batch.size();) {
+      Message message;
+      message.first = i;
+      message.count = 1;
+      if (options.gso) {
+        // equal sized datagrams, the last of them may be shorter
+        size_t bytes = batch[i].size;
+        while (i + message.count < batch.size() && message.count < gsoSegments &&
+               batch[i + message.count - 1].size == batch[i].size &&
+               batch[i + message.count].size <= batch[i].size &&
+               bytes + batch[i + message.count].size <= gsoBytes) {
+          bytes += batch[i + message.count].size;
+          message.count++;
+        }
+      }
+      messages.push_back(message);
+      i += message.count;
+    }
+    headers.assign(messages.size(), mmsghdr());
+    for (size_t m = 0; m < messages.size(); ++m) {
+      Message &message = messages[m];
+      msghdr &header = headers[m].msg_hdr;
+      for (size_t i = message.first; i < message.first + message.count; ++i) {
+        iovecs[i].iov_base = batch[i].data;
+        iovecs[i].iov_len = batch[i].size;
+      }
+      header.msg_name = remoteEndpoint.data();
+      header.msg_namelen = remoteEndpoint.size();
+      header.msg_iov = &iovecs[message.first];
+      header.msg_iovlen = message.count;
+#ifdef UDP_SEGMENT
+      if (message.count > 1) {
+        const uint16_t segment = (uint16_t)batch[message.first].size;
+        header.msg_control = message.control;
+        header.msg_controllen = sizeof(message.control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+      }
+#endif
+    }
+  }
+
+  /* Send the batch with as few sendmmsg calls as the kernel allows */
+  void send(Stats &sent) {
+    const int fd = socket->native_handle();
+    prepare(0);
+    size_t m = 0;
+    while (m < messages.size()) {
+      const int result = sendmmsg(fd, &headers[m], (unsigned int)(messages.size() - m), 0);
+      sent.syscalls++;
+      if (result < 0) {
+        if (errno == EINTR)
+          continue;
+        const Message &message = messages[m];
+        if (message.count > 1) {
+          XTRACE(DEBUG, WAR, "UDP GSO send failed - %s - sending datagrams one by one", strerror(errno));
+          options.gso = false;
+          prepare(message.first);
+          m = 0;
+          continue;
+        }
+        XTRACE(DEBUG, ERR, "ERROR sending datagram - %s", strerror(errno));
+        sent.errors++;
+        m++;
+        continue;
+      }
+      for (size_t end = m + result; m < end; ++m) {
+        const Message &message = messages[m];
+        for (size_t i = message.first; i < message.first + message.count; ++i)
+          sent.bytes += batch[i].size;
+        sent.datagrams += message.count;
+        if (message.count > 1)
+          sent.segmented += message.count;
+      }
+    }
+  }
 
 public:
   DataWriterNetwork(const std::string &address, const std::string &port, uint64_t runID_)
-      : runID(runID_) {
+      : DataWriterNetwork(address, port, runID_, Options()) {}
+
+  DataWriterNetwork(const std::string &address, const std::string &port, uint64_t runID_,
+                    const Options &options_)
+      : runID(runID_), options(options_) {
     XTRACE(DEBUG, DEB, "DataWriterNetwork() - address %s : %s", address.c_str(), port.c_str());
     try {
       udp::resolver resolver(ioService);
@@ -58,6 +285,29 @@ public:
       XTRACE(DEBUG, ERR, "ERROR in UDP connection setup to %s:%s - %s", address.c_str(), port.c_str(), e.what());
       throw;
     }
+#ifndef UDP_SEGMENT
+    if (options.gso) {
+      XTRACE(DEBUG, WAR, "jadaq is built without UDP GSO support");
+      options.gso = false;
+    }
+#endif
+    options.batch = std::max(options.batch, (size_t)1);
+    if (options.batch > 1) {
+      ring.resize(std::max(options.queueSize, options.batch));
+      thread = std::thread(&DataWriterNetwork::run, this);
+    }
+  }
+
+  ~DataWriterNetwork() {
+    if (thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      notEmpty.notify_one();
+      thread.join();
+    }
+    delete socket;
   }
 
   void addDigitizer(uint32_t digitizerID) {
@@ -69,6 +319,8 @@ public:
   template <typename E>
   void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID,
                   uint64_t globalTimeStamp) {
+    // Readout threads may share this writer - serialize sequence numbering and sending
+    std::lock_guard<std::mutex> lock(sendMutex);
     Data::Header *header = (Data::Header *)buffer->data();
     header->seqNum = seqNum;
     seqNum++;
@@ -78,8 +330,30 @@ public:
     header->version = Data::currentVersion;
     header->elementType = E::type();
     header->numElements = (uint16_t)buffer->size();
+    if (options.batch > 1) {
+      push(buffer->data(), buffer->data_size());
+      return;
+    }
     socket->send_to(boost::asio::buffer(buffer->data(), buffer->data_size()),
                     remoteEndpoint);
+    std::lock_guard<std::mutex> statsLock(mutex);
+    stats.datagrams++;
+    stats.bytes += buffer->data_size();
+    stats.syscalls++;
+  }
+
+  /* Wait until everything queued so far has been sent */
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    flushes++;
+    notEmpty.notify_one();
+    idle.wait(lock, [this] { return count == 0 && !sending; });
+    flushes--;
+  }
+
+  Stats getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
   }
 };
 
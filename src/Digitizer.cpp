@@ -26,6 +26,7 @@
 
 #include "Digitizer.hpp"
 #include "StringConversion.hpp"
+#include <cassert>
 #include <chrono>
 #include <iomanip>
 #include <regex>
@@ -300,8 +301,11 @@ Digitizer::Digitizer(CAEN_DGTZ_ConnectionType linkType_, int linkNum_, int conet
   // NULL digitizer
   if (linkType == (CAEN_DGTZ_ConnectionType)ECDC_NULL_CONNECTION) {
     id = 0xaaaabbbb;
+    familyCode = CAEN_DGTZ_XX740_FAMILY_CODE;
+    firmware = (CAEN_DGTZ_DPPFirmware_t)CAEN_DGTZ_DPPFirmware_QDC;
     return;
   }
+    familyCode = digitizer->familyCode();
     firmware = digitizer->getDPPFirmwareType();
     /* Generate an unique ID based on model and serial number.
        Despite casting to 32bit, the result _is_ unique:
@@ -313,20 +317,119 @@ Digitizer::Digitizer(CAEN_DGTZ_ConnectionType linkType_, int linkNum_, int conet
     id = digitizer->serialNumber();
 }
 
+void Digitizer::simulate(const Simulator::Settings &settings) {
+  if (!spoofed()) {
+    throw std::invalid_argument{"Only NULL digitizers can be simulated"};
+  }
+  simulator.reset(new Simulator(settings));
+  id = digitizer->serialNumber();
+  XTRACE(DIGIT, INF, "Simulating DPP-QDC digitizer %d at %d events/s", id, (int)settings.rate);
+}
+
+void Digitizer::replay(const std::string &filename, uint32_t digitizerID, bool maxSpeed, bool loop) {
+  if (!spoofed()) {
+    throw std::invalid_argument{"Only NULL digitizers can replay"};
+  }
+  player.reset(new raw::Replay(filename, digitizerID, maxSpeed, loop));
+  id = player->digitizerID();
+  familyCode = player->board().familyCode;
+  firmware = (CAEN_DGTZ_DPPFirmware_t)player->board().firmware;
+}
+
+void Digitizer::setCapture(raw::Writer *writer) {
+  capture = writer;
+  if (capture) {
+    raw::Board board{familyCode, (uint32_t)firmware, groupCount, waveforms, extras};
+    capture->board(id, board, acqWindowSize, groupMask);
+  }
+}
+
+/* Data handler for the list element type matching the firmware, waveforms, extras, time64 and packed */
+void Digitizer::initializeHandler(DataWriter &dataWriter) {
+  dataHandler.setGroupMask(groupMask);
+  switch (familyCode) {
+  case CAEN_DGTZ_XX751_FAMILY_CODE:
+    if (packed)
+      dataHandler.initialize<Data::StdPackedElement751>(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    else
+      dataHandler.initialize<Data::StdElement751>(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    break;
+  case CAEN_DGTZ_XX740_FAMILY_CODE:
+    if (waveforms && packed) {
+      if (extras)
+        dataHandler.initialize<Data::DPPQDCPackedWaveformElement<Data::ListElement8222> >(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+      else if (time64)
+        dataHandler.initialize<Data::DPPQDCPackedWaveformElement<Data::ListElement822> >(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+      else
+        dataHandler.initialize<Data::DPPQDCPackedWaveformElement<Data::ListElement422> >(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    } else if (waveforms) {
+      if (extras)
+        dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement8222> >(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+      else if (time64)
+        dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement822> >(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+      else
+        dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement422> >(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    } else if (extras) {
+      dataHandler.initialize<Data::ListElement8222>(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    } else if (time64) {
+      dataHandler.initialize<Data::ListElement822>(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    } else {
+      dataHandler.initialize<Data::ListElement422>(dataWriter,digitizerID(),groupCount,waveforms,acqWindowSize);
+    }
+    break;
+  default:
+    throw std::runtime_error("Unknown digitizer type. Not supported by jadaq::Digitizer");
+  }
+}
+
 void Digitizer::initialize(DataWriter& dataWriter)
 {
   XTRACE(DIGIT, DEB, "Digitizer::initialize()");
   XTRACE(DIGIT, DEB, "Prepare readout buffer for digitizer %s", name().c_str());
 
   // ECDC_NULL_CONNECTION
-  if (id == 0xaaaabbbb) {
+  if (player) {
+    const raw::Board &board = player->board();
+    /* room for the largest readout but no less than a real digitizer */
+    readoutBuffer.size = std::max(player->largestRecord(), (size_t)1 << 20);
+    readoutBuffer.data = (char *)malloc(readoutBuffer.size);
+    groupCount = board.groups;
+    acqWindowSize = new uint32_t[groupCount];
+    std::copy(player->acqWindowSize(), player->acqWindowSize() + groupCount, acqWindowSize);
+    groupMask = player->groupMask();
+    extras = board.extras;
+    waveforms = board.waveforms;
+    dataWriter.addDigitizer(digitizerID());
+    initializeHandler(dataWriter);
+    return;
+  }
+  if (simulator) {
+    const Simulator::Settings &settings = simulator->getSettings();
+    readoutBuffer.size = settings.bufferSize;
+    readoutBuffer.data = (char *)malloc(readoutBuffer.size);
+    groupCount = 8;
+    acqWindowSize = new uint32_t[groupCount];
+    extras = settings.extras;
+    waveforms = settings.samples;
+    for (uint32_t i = 0; i < groupCount; ++i) {
+      acqWindowSize[i] = settings.samples * 2;
+    }
+    groupMask = settings.groupMask;
+    dataWriter.addDigitizer(digitizerID());
+    initializeHandler(dataWriter);
+    return;
+  }
+  if (spoofed()) {
     readoutBuffer.size = 9000;
     readoutBuffer.data = (char *)malloc(9000);
-    uint32_t groups = 16;
-    acqWindowSize = new uint32_t[groups];
+    groupCount = 16;
+    acqWindowSize = new uint32_t[groupCount];
+    for (uint32_t i = 0; i < groupCount; ++i) {
+      acqWindowSize[i] = 0;
+    }
+    groupMask = 1;
     dataWriter.addDigitizer(digitizerID());
-    dataHandler.initialize<Data::ListElement422>(dataWriter, digitizerID(), groups,
-                                                 waveforms, acqWindowSize);
+    initializeHandler(dataWriter);
     return;
   }
 
@@ -356,12 +459,14 @@ void Digitizer::initialize(DataWriter& dataWriter)
           break;
         case CAEN_DGTZ_NotDPPFirmware:{
           waveforms = digitizer->getRecordLength()*digitizer->getNChannelEnabled();
-          acqWindowSize = new uint32_t[groups()];
-          for (uint32_t i = 0; i < groups(); ++i){
+          groupCount = groups();
+          acqWindowSize = new uint32_t[groupCount];
+          for (uint32_t i = 0; i < groupCount; ++i){
             // TODO: initialize acqWindowSize elsewhere for all digitizer types
             acqWindowSize[i] = 0; // no "jitter" expected
           }
-          dataHandler.initialize<Data::StdElement751>(dataWriter,digitizerID(), groups(), waveforms, acqWindowSize);
+          groupMask = 1; // events are not split in groups
+          initializeHandler(dataWriter);
           break;
         }
         default:
@@ -387,32 +492,19 @@ void Digitizer::initialize(DataWriter& dataWriter)
         case CAEN_DGTZ_DPPFirmware_QDC:
           {
             caen::Digitizer740DPP::BoardConfiguration bc{boardConfiguration};
-            uint32_t groups = this->groups();
-            acqWindowSize = new uint32_t[groups];
+            groupCount = groups();
+            groupMask = digitizer->getGroupEnableMask();
+            acqWindowSize = new uint32_t[groupCount];
             extras = bc.extras();
             if (bc.waveform())
                 waveforms = digitizer->getRecordLength(0);
-            for (uint32_t i = 0; i < groups; ++i)
+            for (uint32_t i = 0; i < groupCount; ++i)
             {
                 acqWindowSize[i] = std::max({digitizer->getRecordLength(i)*bc.waveform(),
                                              digitizer->getDPPPreTriggerSize(i) + digitizer->getDPPTriggerHoldOffWidth(i),
                       digitizer->getDPPGateWidth(i) - digitizer->getDPPGateOffset(i)+ digitizer->getDPPPreTriggerSize(i)}) * 2; // Lets be conservative :P
             }
-
-            if (waveforms)
-              {
-                if (extras)
-                    dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement8222> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
-                else
-                    dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement422> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
-            }
-            else if (extras)
-            {
-                dataHandler.initialize<Data::ListElement8222>(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
-            } else
-            {
-                dataHandler.initialize<Data::ListElement422>(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
-            }
+            initializeHandler(dataWriter);
             break;
           }
         case CAEN_DGTZ_NotDPPFirmware:
@@ -442,9 +534,15 @@ void Digitizer::initialize(DataWriter& dataWriter)
 
 void Digitizer::close() {
   XTRACE(DIGIT, DEB, "Closing digitizer %s", name().c_str());
-  if (id == 0xaaaabbbb)  {
+  stopPipeline();
+  if (spoofed())  {
     return;
   }
+  try {
+    disableInterrupt();
+  } catch (caen::Error &e) {
+    XTRACE(DIGIT, WAR, "Unable to disable interrupts of %s: %s", name().c_str(), e.what());
+  }
   digitizer->freeReadoutBuffer(readoutBuffer);
   if (digitizer) {
     delete digitizer;
@@ -459,9 +557,21 @@ bool Digitizer::ready() {
 }
 
 void Digitizer::startAcquisition() {
-  if (id == 0xaaaabbbb) {
+  if (simulator) {
+    simulator->start();
+  }
+  if (spoofed()) {
     return;
   }
+  if (irqEvents > 0) {
+    caen::InterruptConfig irqConf;
+    irqConf.state = CAEN_DGTZ_ENABLE;
+    irqConf.level = 1; // must be 1 for direct connection through CONET
+    irqConf.status_id = 0xaaaa;
+    irqConf.event_number = irqEvents;
+    irqConf.mode = irqMode;
+    digitizer->setInterruptConfig(irqConf);
+  }
   // fixed minimum wait for digitizer to be ready (value determined experimentally):
   std::this_thread::sleep_for(std::chrono::milliseconds(175));
     // additional wait if necessary:
@@ -470,65 +580,181 @@ void Digitizer::startAcquisition() {
   digitizer->startAcquisition();
 }
 
-void Digitizer::acquisition() {
-  XTRACE(DIGIT, DEB, "Read at most %db data from %s", readoutBuffer.size, name().c_str());
+bool Digitizer::readout(caen::ReadoutBuffer &buffer) {
+  XTRACE(DIGIT, DEB, "Read at most %db data from %s", buffer.size, name().c_str());
+
+  if (simulator) {
+    buffer.dataSize = simulator->readout(buffer.data, buffer.size);
+    return true;
+  }
+  if (player) {
+    buffer.dataSize = player->readout(buffer.data, buffer.size);
+    return true;
+  }
 
   // NULL Digitizer "readout"
-  if (id == 0xaaaabbbb) {
-    memset(readoutBuffer.data, 0x00, 2048); // emulate readData() function
-    (*(uint32_t *)(readoutBuffer.data +  0)) = 0xa0000030;  // magic value 0xa + size of
-    (*(uint32_t *)(readoutBuffer.data +  4)) = 0x00000001;  // group mask 1
-    (*(uint32_t *)(readoutBuffer.data +  8)) = 0x00000000;  // unused ?
-    (*(uint32_t *)(readoutBuffer.data + 12)) = 0x00000000; // unused ?
+  if (spoofed()) {
+    memset(buffer.data, 0x00, 2048); // emulate readData() function
+    (*(uint32_t *)(buffer.data +  0)) = 0xa000000c;  // magic value 0xa + size in words
+    (*(uint32_t *)(buffer.data +  4)) = 0x00000001;  // group mask 1
+    (*(uint32_t *)(buffer.data +  8)) = 0x00000000;  // unused ?
+    (*(uint32_t *)(buffer.data + 12)) = 0x00000000; // unused ?
 
     // Group 0 - channels 0 - 15
-    (*(uint32_t *)(readoutBuffer.data + 16)) = 0x80000020; // MSB 1 + data size 32 bytes
-    (*(uint32_t *)(readoutBuffer.data + 20)) = 0x60000001; // 0110 0 ....
+    (*(uint32_t *)(buffer.data + 16)) = 0x80000008; // MSB 1 + data size 8 words
+    (*(uint32_t *)(buffer.data + 20)) = 0x60000001; // 0110 0 ....
 
-    (*(uint32_t *)(readoutBuffer.data + 24)) = 0x01020304; // Time
-    (*(uint32_t *)(readoutBuffer.data + 28)) = 0x00001000; // subch 0, charge 4096
+    (*(uint32_t *)(buffer.data + 24)) = 0x01020304; // Time
+    (*(uint32_t *)(buffer.data + 28)) = 0x00001000; // subch 0, charge 4096
 
-    (*(uint32_t *)(readoutBuffer.data + 32)) = 0x01020305; // Time
-    (*(uint32_t *)(readoutBuffer.data + 36)) = 0x00001000; // subch 0, charge 4096
+    (*(uint32_t *)(buffer.data + 32)) = 0x01020305; // Time
+    (*(uint32_t *)(buffer.data + 36)) = 0x00001000; // subch 0, charge 4096
 
-    (*(uint32_t *)(readoutBuffer.data + 40)) = 0x01020306; // Time
-    (*(uint32_t *)(readoutBuffer.data + 44)) = 0xf0001000; // subch 15, charge 4096
+    (*(uint32_t *)(buffer.data + 40)) = 0x01020306; // Time
+    (*(uint32_t *)(buffer.data + 44)) = 0xf0001000; // subch 15, charge 4096
 
-    readoutBuffer.dataSize = 48; // emulate readData() function
-    stats.bytesRead += readoutBuffer.dataSize;
+    buffer.dataSize = 48; // emulate readData() function
+    return true;
+  }
 
-    DPPQDCEventIterator iterator{readoutBuffer};
-    size_t events = dataHandler(iterator);
-    stats.eventsFound += events;
-    //usleep(1000000);
-    return;
+  if (irqEvents > 0) {
+    try {
+      digitizer->doIRQWait(irqTimeout);
+    } catch (caen::Error &e) {
+      if (e.code() != CAEN_DGTZ_Timeout)
+        throw;
+      // nothing ready within timeout - spare the link an empty readout
+      std::lock_guard<std::mutex> lock(*statsMutex);
+      stats.irqTimeouts++;
+      buffer.dataSize = 0;
+      return false;
+    }
   }
 
   /* We use slave terminated mode like in the sample from CAEN Digitizer library
    * docs. */
-  digitizer->readData(readoutBuffer, CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT);
-  uint32_t bytesRead = readoutBuffer.dataSize;
+  digitizer->readData(buffer, CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT);
+
+  if (irqEvents > 0 && irqMode == CAEN_DGTZ_IRQ_MODE_ROAK) {
+    digitizer->rearmInterrupt();
+  }
+  return true;
+}
+
+void Digitizer::setInterruptReadout(uint16_t events, uint32_t timeout, CAEN_DGTZ_IRQMode_t mode) {
+  if (linkType != CAEN_DGTZ_OpticalLink) {
+    /* NOTE: interrupts cannot be used in case of communication via USB */
+    throw std::invalid_argument{"Interrupt readout is only supported on optical links"};
+  }
+  irqEvents = events;
+  irqTimeout = timeout;
+  irqMode = mode;
+}
+
+void Digitizer::disableInterrupt() {
+  if (irqEvents == 0 || spoofed()) {
+    return;
+  }
+  caen::InterruptConfig irqConf;
+  irqConf.state = CAEN_DGTZ_DISABLE;
+  irqConf.level = 1;
+  irqConf.status_id = 0xaaaa;
+  irqConf.event_number = irqEvents;
+  irqConf.mode = irqMode;
+  digitizer->setInterruptConfig(irqConf);
+}
+
+void Digitizer::acquisition() {
+  caen::ReadoutBuffer *buffer = &readoutBuffer;
+  if (pipeline && pipeline->spare) {
+    buffer = pipeline->spare;
+    pipeline->spare = nullptr;
+  } else if (pipeline && !pipeline->free.pop(buffer)) {
+    /* No free buffers: the decoder is not keeping up. Keep draining the
+     * digitizer into our own buffer and drop the data. */
+    buffer = &readoutBuffer;
+  }
+  uint32_t bytesRead = 0;
+  if (readout(*buffer)) {
+    bytesRead = buffer->dataSize;
+    scheduler.update(bytesRead, buffer->size);
+    std::lock_guard<std::mutex> lock(*statsMutex);
+    stats.readouts++;
+    if (bytesRead < 1) {
+      stats.emptyReadouts++;
+    }
+    stats.pollInterval = scheduler.getInterval();
+    stats.emptyRatio = scheduler.getEmptyRatio();
+  }
   XTRACE(DIGIT, DEB, "Read %db of acquired data", bytesRead);
-  stats.readouts++;
+  if (capture && bytesRead > 0) {
+    capture->readout(id, buffer->data, bytesRead);
+  }
 
   /* NOTE: check and skip if there's no actual events to handle */
   if (bytesRead < 1) {
+    if (player && player->done()) {
+      XTRACE(DIGIT, INF, "Replay of %s finished", name().c_str());
+      setActive(false);
+    }
     XTRACE(DIGIT, DEB, "No data to read - skip further handling.");
+    if (pipeline && buffer != &readoutBuffer) {
+      pipeline->spare = buffer; // free is pushed by the decode thread only
+    } else if (!pipeline) {
+      idle(); // with a pipeline the decode thread does it
+    }
     return;
   }
-  stats.bytesRead += bytesRead;
+  {
+    std::lock_guard<std::mutex> lock(*statsMutex);
+    stats.bytesRead += bytesRead;
+  }
 
+  if (pipeline) {
+    if (buffer == &readoutBuffer) {
+      {
+        std::lock_guard<std::mutex> lock(*statsMutex);
+        stats.droppedBuffers++;
+        stats.droppedBytes += bytesRead;
+      }
+      XTRACE(DIGIT, WAR, "Readout pipeline full - dropped %db from %s", bytesRead, name().c_str());
+      return;
+    }
+    pipeline->filled.push(buffer); // cannot fail - never more buffers than slots
+    std::lock_guard<std::mutex> lock(*statsMutex);
+    stats.queueDepth = pipeline->filled.size();
+    stats.queueHighWater = std::max(stats.queueHighWater, stats.queueDepth);
+    return;
+  }
+  publishDecoded(decode(*buffer));
+}
+
+void Digitizer::publishDecoded(size_t events) {
+  const DataHandler::Stats sorter = dataHandler.getStats();
+  std::lock_guard<std::mutex> lock(*statsMutex);
+  stats.eventsFound += events;
+  stats.sorter = sorter;
+  if (pipeline) {
+    stats.queueDepth = pipeline->filled.size();
+  }
+}
+
+void Digitizer::idle() {
+  if (dataHandler.idle()) {
+    publishDecoded(0);
+  }
+}
+
+size_t Digitizer::decode(caen::ReadoutBuffer &buffer) {
     // model- and firmware-dependent acquisition
-    switch (digitizer->familyCode()){
+    switch (familyCode){
     case CAEN_DGTZ_XX751_FAMILY_CODE:
       switch ((int)firmware) //Cast to int as long as CAEN_DGTZ_DPPFirmware_QDC is not part of the enumeration
         {
         case CAEN_DGTZ_NotDPPFirmware:
           {
-          StdBLTEventIterator iterator{readoutBuffer};
-          size_t events = dataHandler(iterator);
-          stats.eventsFound += events;
-          break;
+          StdBLTEventIterator iterator{buffer};
+          return dataHandler(iterator);
           }
         default:
           throw std::runtime_error("Data acquisition not implemented by jadaq::Digitizer for firmware present on " + digitizer->modelName());
@@ -551,10 +777,8 @@ void Digitizer::acquisition() {
           break;
         case CAEN_DGTZ_DPPFirmware_QDC:
           {
-            DPPQDCEventIterator iterator{readoutBuffer};
-            size_t events = dataHandler(iterator);
-            stats.eventsFound += events;
-            break;
+            DPPQDCEventIterator iterator{buffer};
+            return dataHandler(iterator);
           }
         case CAEN_DGTZ_NotDPPFirmware:
           throw std::runtime_error("Non DPP firmware not supported by jadaq::Digitizer on " + digitizer->modelName());
@@ -566,5 +790,58 @@ void Digitizer::acquisition() {
     default:
       throw std::runtime_error("Unknown digitizer type. Not supported by jadaq::Digitizer on " + digitizer->modelName());
     }
+}
+
+void Digitizer::decodeLoop() {
+  caen::ReadoutBuffer *buffer;
+  while (true) {
+    /* read before the pop: a buffer pushed before stopPipeline() cleared
+     * running is then always popped before the loop returns */
+    const bool running = pipeline->running;
+    if (pipeline->filled.pop(buffer)) {
+      const size_t events = decode(*buffer);
+      pipeline->free.push(buffer);
+      publishDecoded(events);
+    } else if (running) {
+      idle();
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    } else {
+      return; // stopped and drained
+    }
+  }
+}
+
+void Digitizer::startPipeline(size_t depth) {
+  XTRACE(DIGIT, INF, "Starting readout pipeline with %d buffers for %s", depth, name().c_str());
+  assert(!pipeline);
+  pipeline.reset(new Pipeline(depth));
+  for (caen::ReadoutBuffer &buffer : pipeline->pool) {
+    if (spoofed()) {
+      buffer.size = readoutBuffer.size;
+      buffer.data = (char *)malloc(buffer.size);
+    } else {
+      buffer = digitizer->mallocReadoutBuffer();
+    }
+    pipeline->free.push(&buffer);
+  }
+  pipeline->running = true;
+  pipeline->thread = std::thread(&Digitizer::decodeLoop, this);
+}
 
+void Digitizer::stopPipeline() {
+  if (!pipeline) {
+    return;
+  }
+  pipeline->running = false;
+  if (pipeline->thread.joinable()) {
+    pipeline->thread.join();
+  }
+  for (caen::ReadoutBuffer &buffer : pipeline->pool) {
+    if (spoofed()) {
+      free(buffer.data);
+    } else {
+      digitizer->freeReadoutBuffer(buffer);
+    }
+  }
+  pipeline.reset();
 }
@@ -29,15 +29,21 @@
 #define JADAQ_DIGITIZER_HPP
 
 #include "FunctionID.hpp"
+#include "PollScheduler.hpp"
+#include "RawCapture.hpp"
+#include "Simulator.hpp"
 #include "caen.hpp"
 #include "DataHandler.hpp"
 #include "DataWriter.hpp"
 #include <atomic>
 #include <boost/thread/thread.hpp>
 #include <chrono>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include "container.hpp"
 #include "xtrace.h"
 
 class Digitizer {
@@ -46,20 +52,81 @@ public:
     uint64_t bytesRead = 0;
     uint64_t eventsFound = 0;
     uint64_t readouts = 0;
+    uint64_t emptyReadouts = 0;
+    /* Adaptive polling */
+    uint32_t pollInterval = 0; // microseconds
+    float emptyRatio = 0.0f;   // recent fraction of empty readouts
+    /* Readout -> decode pipeline (only used with startPipeline()) */
+    uint64_t queueDepth = 0;
+    uint64_t queueHighWater = 0;
+    uint64_t droppedBuffers = 0;
+    uint64_t droppedBytes = 0;
+    /* Interrupt driven readout (only used with setInterruptReadout()) */
+    uint64_t irqTimeouts = 0;
+    /* Time sorting (only used when sorted) */
+    DataHandler::Stats sorter;
   };
 
 private:
+  /* Pool of readout buffers handed from the readout thread to a decode thread
+   * through lock-free SPSC queues: filled goes readout -> decode and free goes
+   * back decode -> readout. A buffer taken from free that came back empty is
+   * kept as spare for the next readout, so only the decode thread pushes to
+   * free. */
+  struct Pipeline {
+    std::vector<caen::ReadoutBuffer> pool;
+    jadaq::spsc_queue<caen::ReadoutBuffer *> filled;
+    jadaq::spsc_queue<caen::ReadoutBuffer *> free;
+    caen::ReadoutBuffer *spare = nullptr; // only used by the readout thread
+    std::atomic<bool> running{false};
+    std::thread thread;
+    Pipeline(size_t depth) : pool(depth), filled(depth), free(depth) {}
+  };
+
   caen::Digitizer *digitizer = nullptr;
+  uint32_t familyCode;
   CAEN_DGTZ_DPPFirmware_t firmware;
   uint32_t boardConfiguration = 0;
   uint32_t id;
   uint32_t waveforms = 0;
   bool extras = false;
+  bool time64 = false;
+  bool packed = false;
   uint32_t *acqWindowSize = nullptr;
+  uint32_t groupCount = 0; // entries in acqWindowSize
+  uint32_t groupMask = 0;  // groups enabled on the board, 0 if not known
   DataHandler dataHandler;
   std::set<uint32_t> manipulatedRegisters;
   caen::ReadoutBuffer readoutBuffer;
+  std::unique_ptr<Pipeline> pipeline;
+  PollScheduler scheduler;
+  /* Simulated DPP-QDC traffic on a NULL digitizer (only used with simulate()) */
+  std::unique_ptr<Simulator> simulator;
+  /* Recorded readouts played back on a NULL digitizer (only used with replay()) */
+  std::unique_ptr<raw::Replay> player;
+  raw::Writer *capture = nullptr;
+  /* Interrupt driven readout: wait for at least irqEvents events (0 disables) */
+  uint16_t irqEvents = 0;
+  uint32_t irqTimeout = 0; // milliseconds
+  CAEN_DGTZ_IRQMode_t irqMode = CAEN_DGTZ_IRQ_MODE_RORA;
+  /* Written by the readout thread and the decode thread, read by the main
+   * thread through getStats(). The mutex is on the heap so Digitizer stays
+   * movable. */
+  std::unique_ptr<std::mutex> statsMutex{new std::mutex};
   Stats stats;
+  /* Cleared by the readout thread when the digitizer fails or a replay ends,
+   * polled by the main thread */
+  std::unique_ptr<std::atomic<bool>> active_{new std::atomic<bool>(false)};
+  /* Returns false if no readout was attempted i.e. on IRQ timeout */
+  bool readout(caen::ReadoutBuffer &buffer);
+  bool spoofed() const { return linkType == (CAEN_DGTZ_ConnectionType)ECDC_NULL_CONNECTION; }
+  size_t decode(caen::ReadoutBuffer &buffer);
+  /* Add decoded events and the sorter statistics to stats */
+  void publishDecoded(size_t events);
+  /* Let the data handler write what is due while no data comes in */
+  void idle();
+  void initializeHandler(DataWriter &dataWriter);
+  void decodeLoop();
 
 public:
   /* Connection parameters */
@@ -67,7 +134,6 @@ public:
   const int linkNum;
   const int conetNode;
   const uint32_t VMEBaseAddress;
-  bool active = false;
   Digitizer() = delete;
   Digitizer(Digitizer &) = delete;
   Digitizer(Digitizer &&) = default;
@@ -97,16 +163,61 @@ public:
   const std::set<uint32_t> &getRegisters() const { return manipulatedRegisters; }
   bool ready();
   void startAcquisition();
-  const Stats &getStats() const { return stats; }
+  /* Block in IRQWait for up to timeout ms until events are ready instead of
+   * polling. Only supported on optical links. */
+  void setInterruptReadout(uint16_t events, uint32_t timeout, CAEN_DGTZ_IRQMode_t mode);
+  /* Turn the interrupt configured by startAcquisition() off again */
+  void disableInterrupt();
+  bool interruptReadout() const { return irqEvents > 0; }
+  /* Limits in microseconds for the adaptive poll interval */
+  void setPollRange(uint32_t min, uint32_t max) { scheduler.setRange(min, max); }
+  /* Microseconds until the next acquisition() is due - 0 if due now */
+  uint32_t pollRemaining() const {
+    return irqEvents > 0 || (player && player->fullSpeed()) ? 0 : scheduler.remaining();
+  }
+  uint16_t interruptEvents() const { return irqEvents; }
+  uint32_t interruptTimeout() const { return irqTimeout; }
+  CAEN_DGTZ_IRQMode_t interruptMode() const { return irqMode; }
+  bool active() const { return *active_; }
+  void setActive(bool active) { *active_ = active; }
+  /* Snapshot of the statistics */
+  Stats getStats() const {
+    std::lock_guard<std::mutex> lock(*statsMutex);
+    return stats;
+  }
+  /* Turn a NULL digitizer into a simulated DPP-QDC board - must be called
+   * before initialize() */
+  void simulate(const Simulator::Settings &settings);
+  const Simulator *simulation() const { return simulator.get(); }
+  /* Turn a NULL digitizer into a replay of digitizerID (0 for the first) from
+   * a raw capture file - must be called before initialize() */
+  void replay(const std::string &filename, uint32_t digitizerID, bool maxSpeed, bool loop);
+  const raw::Replay *replaying() const { return player.get(); }
+  /* Append every readout to a raw capture - must be called after initialize() */
+  void setCapture(raw::Writer *writer);
   // TODO: Sould we do somthing different than expose these functions?
   void stopAcquisition() {
-    if (id == 0xaaaabbbb) {
+    if (spoofed()) {
       return;
     }
     digitizer->stopAcquisition();
+    disableInterrupt();
   }
   void reset() { digitizer->reset(); }
+  /* Write events unsorted in readout order - must be called before initialize() */
+  void setSorted(bool sorted) { dataHandler.setSorted(sorted); }
+  /* Write DPP-QDC data without extras with 64 bit time reconstructed from
+   * time tag rollovers - must be called before initialize() */
+  void setTime64(bool t) { time64 = t; }
+  /* Write waveforms with the samples bit packed to the ADC resolution -
+   * must be called before initialize() */
+  void setPacked(bool p) { packed = p; }
   void initialize(DataWriter &dataWriter);
+  /* Decode and write data from a separate thread fed with a pool of depth
+   * readout buffers. Must be called after initialize(). */
+  void startPipeline(size_t depth);
+  /* Decode what is left in the pipeline and stop the decode thread */
+  void stopPipeline();
 };
 
 #endif // JADAQ_DIGITIZER_HPP
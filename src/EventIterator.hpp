@@ -31,7 +31,10 @@
 #include <iterator>
 #include <limits>
 
-/** abstract base class for an iterator over the elements contained in a data block */
+/** abstract base class for an iterator over the elements contained in a data block
+ * NOTE: the concrete iterators are final and shadow the virtual accessors with
+ * their own, so code templated on the concrete type (e.g. DataHandler) is free
+ * of indirect calls in the per event loop */
 class DataBlockBaseIterator{
 protected:
   const caen::ReadoutBuffer& buffer;
@@ -69,7 +72,7 @@ public:
  * StdBLTEventIterator will iterate over a transferred block of events as used in the std FW of XX751.
  * Format is described on p53 in UM3350 - V1751/VX1751 User Manual rev. 16
  */
-class StdBLTEventIterator : public DataBlockBaseIterator
+class StdBLTEventIterator final : public DataBlockBaseIterator
 {
 private:
   size_t eventSize;
@@ -103,6 +106,8 @@ public:
 
   uint32_t* getEventPtr() { return ptr; }
   size_t getEventSize() { return eventSize; };
+  template <typename T>
+  T event() { return T{ptr, eventSize}; }
 };
 
 
@@ -110,7 +115,7 @@ public:
  * DPPQDCEventIterator will iterate over a set of Board Aggregates contained in
  * one Data Block
  */
-  class DPPQDCEventIterator : public DataBlockBaseIterator{
+  class DPPQDCEventIterator final : public DataBlockBaseIterator{
 private:
   uint32_t *boardAggregateEnd;
   /*
@@ -162,6 +167,15 @@ private:
 
     bool extrasFlag() const { return extras; }
 
+    /* Number of events left in the current group aggregate */
+    size_t remaining() const { return (end - ptr) / elementSize; }
+
+    /* Skip the rest of the current group aggregate */
+    void skipGroup() {
+      ptr = end;
+      nextGroup();
+    }
+
     uint16_t currentGroup() {
       //assert(group >= 0);
       return (uint16_t)group;
@@ -240,6 +254,18 @@ public:
     }
     return *this;
   }
+  /* Group aggregate level access for batch decoding: the events from
+   * getEventPtr() up to the end of the current group aggregate all have
+   * getEventSize() words. */
+  size_t groupRemaining() const { return groupIterator.remaining(); }
+  DPPQDCEventIterator &skipGroup() {
+    groupIterator.skipGroup();
+    if (groupIterator == boardAggregateEnd) {
+      ptr = boardAggregateEnd;
+      groupIterator = nextGroupIterator();
+    }
+    return *this;
+  }
   DPPQDCEventIterator operator++(int) {
     DPPQDCEventIterator tmp(*this);
     ++*this;
@@ -274,6 +300,8 @@ public:
     uint16_t group() { return groupIterator.currentGroup(); }
     uint32_t* getEventPtr() { return groupIterator.getEventPtr(); }
     size_t getEventSize() { return groupIterator.getEventSize(); };
+    template <typename T>
+    T event() { return T{groupIterator.getEventPtr(), groupIterator.getEventSize()}; }
 };
 
 template <>
@@ -0,0 +1,88 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Adaptive poll interval for digitizer readout. Backs off exponentially while
+ * readouts come back empty and tightens the interval when the readout buffer
+ * comes back (nearly) full, aiming at a half full buffer per readout.
+ *
+ */
+
+#ifndef JADAQ_POLLSCHEDULER_HPP
+#define JADAQ_POLLSCHEDULER_HPP
+
+#include "timer.h"
+#include <algorithm>
+#include <cstdint>
+
+class PollScheduler {
+private:
+  static constexpr float targetFill = 0.5f;
+  static constexpr float fullFill = 0.9f;
+  static constexpr float smoothing = 0.05f; // weight of newest readout in averages
+  uint32_t minInterval;
+  uint32_t maxInterval;
+  uint32_t interval; // microseconds
+  float emptyRatio = 0.0f;
+  float fillRatio = 0.0f;
+  SteadyTimer timer;
+
+public:
+  /* NOTE: initial interval is the fixed grace period used to address issue #18 */
+  PollScheduler(uint32_t min = 50, uint32_t max = 10000, uint32_t initial = 750)
+      : minInterval(min), maxInterval(max),
+        interval(std::min(std::max(initial, min), max)) {}
+
+  void setRange(uint32_t min, uint32_t max) {
+    minInterval = min;
+    maxInterval = std::max(min, max);
+    interval = std::min(std::max(interval, minInterval), maxInterval);
+  }
+
+  /* Microseconds until the next readout is due - 0 if due now */
+  uint32_t remaining() const {
+    uint64_t elapsed = timer.elapsedus();
+    return elapsed >= interval ? 0 : (uint32_t)(interval - elapsed);
+  }
+
+  /* Register the outcome of a readout of bytes into a buffer of capacity */
+  void update(uint32_t bytes, uint32_t capacity) {
+    timer.reset();
+    float fill = capacity > 0 ? (float)bytes / capacity : 0.0f;
+    emptyRatio += ((bytes == 0 ? 1.0f : 0.0f) - emptyRatio) * smoothing;
+    fillRatio += (fill - fillRatio) * smoothing;
+    float factor;
+    if (bytes == 0) {
+      factor = 2.0f; // exponential back-off while idle
+    } else if (fill >= fullFill) {
+      factor = 0.5f; // we are likely leaving data behind - tighten
+    } else {
+      factor = std::min(std::max(targetFill / fill, 0.5f), 2.0f);
+    }
+    uint64_t next = (uint64_t)(interval * factor);
+    interval = (uint32_t)std::min(std::max(next, (uint64_t)minInterval), (uint64_t)maxInterval);
+  }
+
+  uint32_t getInterval() const { return interval; }
+  float getEmptyRatio() const { return emptyRatio; }
+  float getFillRatio() const { return fillRatio; }
+};
+
+#endif // JADAQ_POLLSCHEDULER_HPP
@@ -0,0 +1,151 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Capture of raw readout buffers to an append-only file and replay of them.
+ *
+ */
+
+#include "RawCapture.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include "xtrace.h"
+
+using namespace raw;
+
+static uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Writer::Writer(const std::string &filename) {
+  bool empty = std::ifstream(filename, std::ios::binary | std::ios::ate).tellg() <= 0;
+  file.open(filename, std::ios::binary | std::ios::app);
+  if (!file.is_open()) {
+    throw std::runtime_error("Could not open raw capture file: \"" + filename + "\"");
+  }
+  if (empty) {
+    FileHeader header{raw::magic, raw::version, 0};
+    file.write((const char *)&header, sizeof(header));
+    bytes += sizeof(header);
+  }
+  XTRACE(MAIN, INF, "Capturing raw readout data to %s", filename.c_str());
+}
+
+void Writer::write(RecordType type, uint32_t digitizerID, const char *data, size_t size, const char *data2,
+                   size_t size2) {
+  RecordHeader header{type, 0, digitizerID, now(), (uint32_t)(size + size2), 0};
+  std::lock_guard<std::mutex> lock(mutex);
+  file.write((const char *)&header, sizeof(header));
+  file.write(data, size);
+  if (size2 > 0) {
+    file.write(data2, size2);
+  }
+  bytes += sizeof(header) + size + size2;
+}
+
+void Writer::board(uint32_t digitizerID, const Board &board, const uint32_t *acqWindowSize, uint32_t groupMask) {
+  std::vector<uint32_t> tail(acqWindowSize, acqWindowSize + board.groups);
+  tail.push_back(groupMask);
+  write(BoardRecord, digitizerID, (const char *)&board, sizeof(board), (const char *)tail.data(),
+        tail.size() * sizeof(uint32_t));
+}
+
+void Writer::readout(uint32_t digitizerID, const char *data, size_t size) {
+  write(ReadoutRecord, digitizerID, data, size);
+}
+
+Replay::Replay(const std::string &filename_, uint32_t digitizerID, bool maxSpeed_, bool loop_)
+    : file(filename_, std::ios::binary), filename(filename_), id(digitizerID), maxSpeed(maxSpeed_), loop(loop_) {
+  if (!file.is_open()) {
+    throw std::runtime_error("Could not open raw capture file: \"" + filename + "\"");
+  }
+  FileHeader fileHeader;
+  if (!file.read((char *)&fileHeader, sizeof(fileHeader)) || fileHeader.magic != raw::magic) {
+    throw std::runtime_error("Not a raw capture file: \"" + filename + "\"");
+  }
+  if (fileHeader.version != raw::version) {
+    throw std::runtime_error("Unsupported raw capture file version " + std::to_string(fileHeader.version));
+  }
+  /* Index the Readout records of our digitizer. Time is made relative to the
+   * first record and kept monotonic across appended captures. */
+  bool described = false;
+  uint64_t first = 0;
+  uint64_t last = 0;  // raw time of previous record
+  uint64_t shift = 0; // added to raw time
+  RecordHeader header;
+  while (file.read((char *)&header, sizeof(header))) {
+    uint64_t offset = (uint64_t)file.tellg();
+    if (header.type == BoardRecord && !described && (id == 0 || header.digitizerID == id)) {
+      id = header.digitizerID;
+      file.read((char *)&board_, sizeof(board_));
+      acqWindowSize_.resize(board_.groups);
+      file.read((char *)acqWindowSize_.data(), board_.groups * sizeof(uint32_t));
+      if (header.size >= sizeof(board_) + (board_.groups + 1) * sizeof(uint32_t))
+        file.read((char *)&groupMask_, sizeof(groupMask_));
+      described = true;
+    } else if (header.type == ReadoutRecord && described && header.digitizerID == id) {
+      if (index.empty()) {
+        first = header.time;
+      } else if (header.time < last) {
+        shift += last - header.time; // new capture appended
+      }
+      last = header.time;
+      index.push_back({offset, header.size, header.time + shift - first});
+      largest = std::max(largest, (size_t)header.size);
+    }
+    file.seekg(offset + header.size);
+  }
+  if (!described) {
+    throw std::runtime_error("No digitizer " + std::to_string(digitizerID) + " in raw capture file: \"" +
+                             filename + "\"");
+  }
+  file.clear();
+  XTRACE(DIGIT, INF, "Replaying %zu readouts of digitizer %u from %s", index.size(), id, filename.c_str());
+  start();
+}
+
+void Replay::start() {
+  startTime = clock::now();
+  next = 0;
+  base = 0;
+}
+
+size_t Replay::readout(char *buffer, size_t size) {
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - startTime).count();
+  size_t bytes = 0;
+  while (next < index.size()) {
+    const Entry &entry = index[next];
+    if ((!maxSpeed && base + entry.time > elapsed) || bytes + entry.size > size) {
+      break;
+    }
+    file.seekg(entry.offset);
+    if (!file.read(buffer + bytes, entry.size)) {
+      throw std::runtime_error("Truncated raw capture file: \"" + filename + "\"");
+    }
+    bytes += entry.size;
+    if (++next == index.size() && loop) {
+      next = 0;
+      base += index.back().time;
+      loops_++;
+    }
+  }
+  return bytes;
+}
@@ -0,0 +1,138 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Capture of raw readout buffers to an append-only file and replay of them.
+ *
+ * A capture file is a FileHeader followed by records. Every record is a
+ * RecordHeader followed by size bytes: a Board record describing how the
+ * data of a digitizer is decoded, or a Readout record holding the data
+ * returned by one readout. Time is steady clock nanoseconds.
+ *
+ */
+
+#ifndef JADAQ_RAWCAPTURE_HPP
+#define JADAQ_RAWCAPTURE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace raw {
+
+static constexpr uint64_t magic = 0x574152514144414aull; // "JADAQRAW" on disk
+static constexpr uint32_t version = 1;
+
+struct FileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+};
+
+enum RecordType : uint16_t { BoardRecord = 1, ReadoutRecord = 2 };
+
+struct RecordHeader {
+  uint16_t type;
+  uint16_t reserved;
+  uint32_t digitizerID;
+  uint64_t time;
+  uint32_t size;
+  uint32_t reserved2;
+};
+
+/* Payload of a Board record - followed by groups acquisition window sizes
+ * and the group enable mask, which older captures do not have */
+struct Board {
+  uint32_t familyCode;
+  uint32_t firmware;
+  uint32_t groups;
+  uint32_t waveforms;
+  uint32_t extras;
+};
+
+/* Appends records to a capture file. Safe to share between readout threads. */
+class Writer {
+private:
+  std::ofstream file;
+  std::mutex mutex;
+  uint64_t bytes = 0;
+  void write(RecordType type, uint32_t digitizerID, const char *data, size_t size, const char *data2 = nullptr,
+             size_t size2 = 0);
+
+public:
+  explicit Writer(const std::string &filename);
+  void board(uint32_t digitizerID, const Board &board, const uint32_t *acqWindowSize, uint32_t groupMask);
+  void readout(uint32_t digitizerID, const char *data, size_t size);
+  uint64_t bytesWritten() const { return bytes; }
+};
+
+/* Plays back the Readout records of one digitizer, either at the pace they
+ * were recorded or as fast as they are read out */
+class Replay {
+private:
+  typedef std::chrono::steady_clock clock;
+  struct Entry {
+    uint64_t offset; // of the payload
+    uint32_t size;
+    uint64_t time;   // since the first record
+  };
+  std::ifstream file;
+  std::string filename;
+  uint32_t id;
+  bool maxSpeed;
+  bool loop;
+  Board board_;
+  std::vector<uint32_t> acqWindowSize_;
+  uint32_t groupMask_ = 0;
+  std::vector<Entry> index;
+  size_t next = 0;
+  uint64_t base = 0; // time added to entries after looping
+  uint64_t loops_ = 0;
+  size_t largest = 0;
+  clock::time_point startTime;
+
+public:
+  /* Replay digitizerID - or the first digitizer in the file if 0 */
+  Replay(const std::string &filename, uint32_t digitizerID, bool maxSpeed, bool loop);
+  void start();
+  /* Copy the records that are due into buffer - at most size bytes. Returns
+   * the number of bytes copied. */
+  size_t readout(char *buffer, size_t size);
+  bool done() const { return next == index.size() && !loop; }
+  uint32_t digitizerID() const { return id; }
+  const Board &board() const { return board_; }
+  const uint32_t *acqWindowSize() const { return acqWindowSize_.data(); }
+  /* Groups enabled on the board, 0 if the capture does not tell */
+  uint32_t groupMask() const { return groupMask_; }
+  /* Largest single record */
+  size_t largestRecord() const { return largest; }
+  size_t records() const { return index.size(); }
+  uint64_t loops() const { return loops_; }
+  const std::string &getFilename() const { return filename; }
+  bool fullSpeed() const { return maxSpeed; }
+  bool looping() const { return loop; }
+};
+
+} // namespace raw
+
+#endif // JADAQ_RAWCAPTURE_HPP
@@ -0,0 +1,104 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Readout of a set of digitizers either inline from the calling thread or
+ * from a dedicated (optionally CPU pinned) readout thread.
+ *
+ */
+
+#include "ReadoutThread.hpp"
+#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <pthread.h>
+#include "xtrace.h"
+
+ReadoutThread::ReadoutThread(std::vector<Digitizer *> digitizers_, int cpu_)
+    : digitizers(digitizers_), cpu(cpu_), alive_((uint16_t)digitizers.size()) {}
+
+uint16_t ReadoutThread::poll() {
+  uint16_t alive = 0;
+  uint32_t wait = UINT32_MAX;
+  for (Digitizer *digitizer : digitizers) {
+    if (digitizer->active()) {
+      try {
+        uint32_t remaining = digitizer->pollRemaining();
+        if (remaining == 0) {
+          /* keep a minimum gap between acquisition attempts to avoid potential
+           hickups on the link */
+          // NOTE: introduced to address issue #18
+          uint64_t gap = readoutTimer.elapsedus();
+          if (gap < minGap) {
+            std::this_thread::sleep_for(std::chrono::microseconds(minGap - gap));
+          }
+          digitizer->acquisition();
+          readoutTimer.reset();
+          remaining = digitizer->pollRemaining();
+        }
+        wait = std::min(wait, remaining);
+        alive++;
+      } catch (caen::Error &e) {
+        XTRACE(MAIN, ERR, "ERROR: unexpected exception during acquisition: %s (%d)", e.what(), e.code());
+        digitizer->setActive(false);
+      }
+    }
+  }
+  if (alive > 0 && wait > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(wait));
+  }
+  alive_ = alive;
+  return alive;
+}
+
+void ReadoutThread::run() {
+  if (cpu >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    if (rc != 0) {
+      XTRACE(MAIN, WAR, "Unable to pin readout thread to CPU %d (error %d)", cpu, rc);
+    }
+  }
+  for (Digitizer *digitizer : digitizers) {
+    XTRACE(MAIN, INF, "Readout thread for digitizer %s on CPU %d", digitizer->name().c_str(), cpu);
+  }
+  while (running) {
+    if (poll() == 0) {
+      XTRACE(MAIN, WAR, "No digitizers alive in readout thread -- stopping it.");
+      break;
+    }
+  }
+}
+
+void ReadoutThread::start() {
+  assert(!thread.joinable());
+  running = true;
+  thread = std::thread(&ReadoutThread::run, this);
+}
+
+void ReadoutThread::stop() {
+  running = false;
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
@@ -0,0 +1,65 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Readout of a set of digitizers either inline from the calling thread or
+ * from a dedicated (optionally CPU pinned) readout thread.
+ *
+ */
+
+#ifndef JADAQ_READOUTTHREAD_HPP
+#define JADAQ_READOUTTHREAD_HPP
+
+#include "Digitizer.hpp"
+#include "timer.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ReadoutThread {
+private:
+  std::vector<Digitizer *> digitizers;
+  int cpu;
+  std::atomic<bool> running{false};
+  std::atomic<uint16_t> alive_{0};
+  std::thread thread;
+  SteadyTimer readoutTimer;
+  static constexpr uint32_t minGap = 50; // microseconds between readouts
+  void run();
+
+public:
+  ReadoutThread(std::vector<Digitizer *> digitizers_, int cpu_ = -1);
+  ReadoutThread(const ReadoutThread &) = delete;
+  ~ReadoutThread() { stop(); }
+  /* Do one round-robin readout pass over the digitizers of this thread that
+   * are due according to their poll scheduler and sleep until the next one
+   * is due. Returns the number of digitizers still alive. */
+  uint16_t poll();
+  /* Start dedicated readout thread calling poll() until stopped */
+  void start();
+  /* Stop and join the readout thread - no-op if not started */
+  void stop();
+  uint16_t alive() const { return alive_; }
+  int pinnedCPU() const { return cpu; }
+  const std::vector<Digitizer *> &getDigitizers() const { return digitizers; }
+};
+
+#endif // JADAQ_READOUTTHREAD_HPP
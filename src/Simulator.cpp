@@ -0,0 +1,108 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Simulated VX1740D DPP-QDC digitizer. Readouts return the board aggregates
+ * that a real board would have collected since the previous readout at the
+ * configured event rate.
+ *
+ */
+
+#include "Simulator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "xtrace.h"
+
+Simulator::Simulator(const Settings &settings_)
+    : settings(settings_), generator(settings_.groupMask, settings_.extras, settings_.samples, 1000, settings_.seed) {
+  if (settings.groupMask == 0) {
+    throw std::invalid_argument{"Simulated digitizer needs at least one group enabled"};
+  }
+  if (settings.eventsPerAggregate == 0) {
+    throw std::invalid_argument{"Simulated digitizer needs at least one event per aggregate"};
+  }
+  if (settings.burstLength > settings.burstPeriod) {
+    throw std::invalid_argument{"Simulated burst cannot be longer than its period"};
+  }
+  generator.setChannelWeights(settings.channelWeights);
+  generator.setCharge(settings.spectrum, settings.chargeA, settings.chargeB);
+  generator.setTimeOffset(settings.timeOffset);
+  eventsPerAggregate = generator.groups() * settings.eventsPerAggregate;
+  aggregateBytes = generator.aggregateWords(settings.eventsPerAggregate) * sizeof(uint32_t);
+  if (aggregateBytes > settings.bufferSize) {
+    throw std::invalid_argument{"Simulated board aggregate does not fit in the readout buffer"};
+  }
+  // the board memory holds 1024 aggregates per group
+  maxPending = 1024.0 * eventsPerAggregate;
+  start();
+}
+
+void Simulator::start() {
+  startTime = clock::now();
+  pending = 0;
+  previous = 0;
+}
+
+double Simulator::rate(double t) const {
+  if (settings.burstPeriod > 0) {
+    double period = settings.burstPeriod / 1000.0;
+    if (std::fmod(t, period) < settings.burstLength / 1000.0) {
+      return settings.burstRate;
+    }
+  }
+  return settings.rate;
+}
+
+double Simulator::expected(double t) const {
+  if (settings.burstPeriod == 0) {
+    return t * settings.rate;
+  }
+  double period = settings.burstPeriod / 1000.0;
+  double length = settings.burstLength / 1000.0;
+  double periods = std::floor(t / period);
+  double within = t - periods * period;
+  return periods * (length * settings.burstRate + (period - length) * settings.rate) +
+         std::min(within, length) * settings.burstRate + std::max(within - length, 0.0) * settings.rate;
+}
+
+size_t Simulator::readout(char *buffer, size_t size) {
+  double t = std::chrono::duration<double>(clock::now() - startTime).count();
+  double now = expected(t);
+  pending += now - previous;
+  previous = now;
+  if (pending > maxPending) {
+    XTRACE(DIGIT, WAR, "Simulated board memory full - lost %d events", (int)(pending - maxPending));
+    lostEvents += (uint64_t)(pending - maxPending);
+    pending = maxPending;
+  }
+  size_t aggregates = (size_t)(pending / eventsPerAggregate);
+  if (aggregates == 0) {
+    return 0;
+  }
+  /* Time tags follow the current rate so they track the wall clock */
+  double r = rate(t);
+  if (r > 0) {
+    generator.setTimeStep(settings.clock * generator.groups() / r);
+  }
+  size_t bytes = generator.fill(buffer, size, settings.eventsPerAggregate, aggregates);
+  pending -= (double)(bytes / aggregateBytes) * eventsPerAggregate;
+  return bytes;
+}
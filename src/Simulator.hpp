@@ -0,0 +1,86 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Simulated VX1740D DPP-QDC digitizer. Readouts return the board aggregates
+ * that a real board would have collected since the previous readout at the
+ * configured event rate.
+ *
+ */
+
+#ifndef JADAQ_SIMULATOR_HPP
+#define JADAQ_SIMULATOR_HPP
+
+#include "DataGenerator.hpp"
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+class Simulator {
+public:
+  struct Settings {
+    double rate = 10000;        // events per second for the whole board
+    uint8_t groupMask = 0x01;
+    std::vector<double> channelWeights{1, 1, 1, 1, 1, 1, 1, 1};
+    generator::DPPQDC::Spectrum spectrum = generator::DPPQDC::Spectrum::Uniform;
+    double chargeA = 200;
+    double chargeB = 200 + 0x0fff;
+    uint64_t timeOffset = 0;    // first time tag (48 bit)
+    double clock = 62.5e6;      // time tag ticks per second
+    bool extras = true;
+    uint16_t samples = 0;       // waveform record length - 0 disables waveforms
+    uint32_t eventsPerAggregate = 16; // per group
+    /* Bursts of burstRate events per second lasting burstLength ms every
+     * burstPeriod ms - 0 disables */
+    uint32_t burstPeriod = 0;
+    uint32_t burstLength = 0;
+    double burstRate = 0;
+    uint32_t seed = 1;
+    size_t bufferSize = 1 << 20; // readout buffer in bytes
+  };
+
+  explicit Simulator(const Settings &settings);
+  /* Start acquisition - events are generated from now on */
+  void start();
+  /* Write the aggregates due since the previous readout - at most size
+   * bytes. Returns the number of bytes written. */
+  size_t readout(char *buffer, size_t size);
+  const Settings &getSettings() const { return settings; }
+  uint64_t events() const { return generator.events(); }
+  /* Events lost because the simulated board memory was full */
+  uint64_t lost() const { return lostEvents; }
+
+private:
+  typedef std::chrono::steady_clock clock;
+  Settings settings;
+  generator::DPPQDC generator;
+  size_t eventsPerAggregate; // for all groups
+  size_t aggregateBytes;
+  double maxPending;
+  double pending = 0;        // events due but not yet read out
+  double previous = 0;       // expected events at the previous readout
+  uint64_t lostEvents = 0;
+  clock::time_point startTime;
+  /* Expected number of events from start until t seconds */
+  double expected(double t) const;
+  double rate(double t) const;
+};
+
+#endif // JADAQ_SIMULATOR_HPP
@@ -6,10 +6,13 @@
 #define JADAQ_WAVEFORM_HPP
 
 #include "DPPQDCEvent.hpp"
+#include "WaveformDecode.hpp"
 #include <H5Cpp.h>
 #include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <ostream>
+#include <vector>
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define PRINTD(V) std::setw(MAX(sizeof(V) * 3, sizeof(#V))) << V
@@ -134,5 +137,114 @@ static inline std::ostream &operator<<(std::ostream &os, const Interval &i) {
     static inline std::ostream& operator<< (std::ostream& os, const StdWaveform& w)
     { w.printOn(os); return os; }
 
+    /* Per thread room to decode a waveform of up to size bytes before packing */
+    static inline char* waveformScratch(size_t size)
+    {
+        static thread_local std::vector<char> scratch;
+        if (scratch.size() < size)
+            scratch.resize(size);
+        return scratch.data();
+    }
+
+    /* DPPQDCWaveform with the 12 bit samples packed, two in three bytes - see
+     * waveform::pack() */
+    struct __attribute__ ((__packed__)) PackedDPPQDCWaveform
+    {
+        static constexpr const unsigned bits = 12;
+        uint16_t num_samples;
+        uint16_t trigger;
+        Interval gate;
+        Interval holdoff;
+        Interval overthreshold;
+        char samples[];
+        PackedDPPQDCWaveform() = default;
+        template <typename DPPQDCEventType>
+          void pack(const DPPQDCEventWaveform<DPPQDCEventType> & event)
+        {
+            DPPQDCWaveform& waveform =
+                *reinterpret_cast<DPPQDCWaveform*>(waveformScratch(DPPQDCWaveform::size(2 * event.size)));
+            event.waveform(waveform);
+            memcpy(this, &waveform, sizeof(PackedDPPQDCWaveform));
+            waveform::pack(reinterpret_cast<const char*>(&waveform) + offsetof(DPPQDCWaveform, samples),
+                           num_samples, bits, samples);
+        }
+        /* Unpack the samples to num_samples 16 bit values */
+        void unpack(uint16_t* out) const
+        {
+            waveform::unpack(samples, num_samples, bits, reinterpret_cast<char*>(out));
+        }
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(num_samples) << " " << PRINTD(trigger) << " " << PRINTD(gate) << " " <<
+               PRINTD(holdoff) << " " << PRINTD(overthreshold);
+            std::vector<uint16_t> s(num_samples);
+            unpack(s.data());
+            for (uint16_t sample : s)
+            {
+                os << " " <<  std::setw(5) << sample;
+            }
+        }
+        static void headerOn(std::ostream& os) { DPPQDCWaveform::headerOn(os); }
+        void insertMembers(H5::CompType& datatype, size_t offset) const
+        {
+          datatype.insertMember("num_samples", HOFFSET(PackedDPPQDCWaveform, num_samples) + offset, H5::PredType::NATIVE_UINT16);
+          datatype.insertMember("trigger", HOFFSET(PackedDPPQDCWaveform, trigger) + offset, H5::PredType::NATIVE_UINT16);
+          datatype.insertMember("gate", HOFFSET(PackedDPPQDCWaveform, gate) + offset, Interval::h5type());
+          datatype.insertMember("holdoff", HOFFSET(PackedDPPQDCWaveform, holdoff) + offset, Interval::h5type());
+          datatype.insertMember("overthreshold", HOFFSET(PackedDPPQDCWaveform, overthreshold) + offset, Interval::h5type());
+          // named for the sample width so readers can unpack without knowing the element type
+          const hsize_t n[1] = {waveform::packedSize(num_samples, bits)};
+          datatype.insertMember("samples12", HOFFSET(PackedDPPQDCWaveform, samples) + offset, H5::ArrayType(H5::PredType::NATIVE_UINT8,1,n));
+        }
+        static size_t size(size_t samples) { return sizeof(PackedDPPQDCWaveform) + waveform::packedSize(samples, bits); }
+    };
+
+    static_assert(std::is_pod<PackedDPPQDCWaveform>::value, "PackedDPPQDCWaveform must be POD");
+    static inline std::ostream& operator<< (std::ostream& os, const PackedDPPQDCWaveform& w)
+    { w.printOn(os); return os; }
+
+    /* StdWaveform with the 10 bit samples packed, four in five bytes */
+    struct __attribute__ ((__packed__)) PackedStdWaveform
+    {
+        static constexpr const unsigned bits = 10;
+        uint16_t num_samples;
+        char samples[];
+        PackedStdWaveform() = default;
+        template <typename StdEventType>
+          void pack(const StdEventWaveform<StdEventType> & event)
+        {
+            StdWaveform& waveform = *reinterpret_cast<StdWaveform*>(waveformScratch(StdWaveform::size(3 * event.size)));
+            event.waveform(waveform);
+            num_samples = waveform.num_samples;
+            waveform::pack(reinterpret_cast<const char*>(&waveform) + offsetof(StdWaveform, samples), num_samples,
+                           bits, samples);
+        }
+        void unpack(uint16_t* out) const
+        {
+            waveform::unpack(samples, num_samples, bits, reinterpret_cast<char*>(out));
+        }
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(num_samples) << " ";
+            std::vector<uint16_t> s(num_samples);
+            unpack(s.data());
+            for (uint16_t sample : s)
+            {
+                os << " " <<  std::setw(5) << sample;
+            }
+        }
+        static void headerOn(std::ostream& os) { StdWaveform::headerOn(os); }
+        void insertMembers(H5::CompType& datatype, size_t offset) const
+        {
+            datatype.insertMember("num_samples", HOFFSET(PackedStdWaveform, num_samples) + offset, H5::PredType::NATIVE_UINT16);
+            const hsize_t n[1] = {waveform::packedSize(num_samples, bits)};
+            datatype.insertMember("samples10", HOFFSET(PackedStdWaveform, samples) + offset, H5::ArrayType(H5::PredType::NATIVE_UINT8,1,n));
+        }
+        static size_t size(size_t samples) { return sizeof(uint16_t) + waveform::packedSize(samples, bits); }
+    };
+
+    static_assert(std::is_pod<PackedStdWaveform>::value, "PackedStdWaveform must be POD");
+    static inline std::ostream& operator<< (std::ostream& os, const PackedStdWaveform& w)
+    { w.printOn(os); return os; }
 
 #endif //JADAQ_WAVEFORM_HPP
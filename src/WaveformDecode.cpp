@@ -0,0 +1,488 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Waveform decoding and sample packing kernels. Every kernel has a scalar
+ * reference version and SIMD versions selected at runtime from what the CPU
+ * supports. All versions produce bit identical output.
+ *
+ */
+
+#include "WaveformDecode.hpp"
+#include "Waveform.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define JADAQ_X86
+#include <immintrin.h>
+#endif
+
+#define DVP(V, S)                                                              \
+  {                                                                            \
+    uint32_t v = (ss & (0x10001000u << (S)));                                  \
+    if ((V).start == 0xffffu) {                                                \
+      if (v) {                                                                 \
+        (V).start = (i << 1) | (v >> (28 + (S)));                              \
+        if (v == 0x1000u << (S))                                               \
+          (V).end = (i << 1) | 1;                                              \
+      }                                                                        \
+    } else {                                                                   \
+      if (v < (0x10001000u << (S)))                                            \
+        (V).end = (i << 1) | (v >> (28 + (S)));                                \
+    }                                                                          \
+  }
+
+namespace {
+
+/** DPP QDC on XX740 digitizer mixed-mode waveform decoding - reference */
+void dppqdcScalar(const uint32_t *words, size_t nWords, DPPQDCWaveform &waveform) {
+  uint16_t trigger = 0xFFFF;
+  Interval gate = {0xffff, 0xffff};
+  Interval holdoff = {0xffff, 0xffff};
+  Interval over = {0xffff, 0xffff};
+  for (uint16_t i = 0; i < nWords; ++i) {
+    uint32_t ss = words[i];
+    waveform.samples[i << 1] = (uint16_t)(ss & 0x0fff);
+    waveform.samples[i << 1 | 1] = (uint16_t)((ss >> 16) & 0x0fff);
+    // trigger
+    if (uint32_t t = (ss & 0x20002000)) {
+      trigger = (i << 1) | (t >> 29);
+    }
+    DVP(gate, 0)
+    DVP(holdoff, 2)
+    DVP(over, 3)
+  }
+  waveform.num_samples = nWords << 1;
+  waveform.trigger = trigger;
+  waveform.gate = gate;
+  waveform.holdoff = holdoff;
+  waveform.overthreshold = over;
+}
+
+/** XX751 standard firmware 10 bit sample decoding - reference */
+void std751Scalar(const uint32_t *words, size_t nWords, StdWaveform &waveform) {
+  uint16_t idx = 0;
+  for (uint16_t i = 0; i < nWords; ++i) {
+    uint32_t ss = words[i];
+    uint8_t nSamples = (uint8_t)((ss >> 30) & 0x03); // # of samples in this word, max three (2-bit value)
+    for (uint8_t s = 0; s < nSamples; ++s) {
+      waveform.samples[idx++] = (uint16_t)((ss >> (s * 10)) & 0x03ff); // 10-bit samples
+    }
+  }
+  waveform.num_samples = idx;
+}
+
+/** Sample packing - reference */
+void packScalar(const char *samples, size_t n, unsigned bits, char *packed) {
+  const uint16_t mask = (uint16_t)((1u << bits) - 1);
+  uint64_t acc = 0;
+  unsigned used = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint16_t s;
+    memcpy(&s, samples + 2 * i, sizeof(s));
+    acc |= (uint64_t)(s & mask) << used;
+    used += bits;
+    while (used >= 8) {
+      *packed++ = (char)acc;
+      acc >>= 8;
+      used -= 8;
+    }
+  }
+  if (used > 0)
+    *packed = (char)acc;
+}
+
+void unpackScalar(const char *packed, size_t n, unsigned bits, char *samples) {
+  const uint16_t mask = (uint16_t)((1u << bits) - 1);
+  uint64_t acc = 0;
+  unsigned have = 0;
+  for (size_t i = 0; i < n; ++i) {
+    while (have < bits) {
+      acc |= (uint64_t)(uint8_t)*packed++ << have;
+      have += 8;
+    }
+    uint16_t s = (uint16_t)(acc & mask);
+    acc >>= bits;
+    have -= bits;
+    memcpy(samples + 2 * i, &s, sizeof(s));
+  }
+}
+
+#ifdef JADAQ_X86
+/* The SIMD decoders collect the digital probes of up to 64 words at a time as
+ * bit masks - bit k of low[b]/high[b] is bit 12+b/28+b of word k - and then
+ * find the intervals with bit scans. b is 0: gate, 1: trigger, 2: holdoff,
+ * 3: overthreshold */
+struct Probes {
+  uint16_t trigger = 0xffff;
+  Interval interval[4] = {{0xffff, 0xffff}, {0xffff, 0xffff}, {0xffff, 0xffff}, {0xffff, 0xffff}};
+
+  /* Same result as the DVP macro applied to each word in turn: start at the
+   * first word with either bit set, end at the last following word that does
+   * not have both bits set. */
+  static inline void update(Interval &v, uint64_t low, uint64_t high, uint64_t valid, size_t base) {
+    uint64_t rest = ~(low & high) & valid;
+    if (v.start == 0xffffu) {
+      uint64_t any = (low | high) & valid;
+      if (!any)
+        return;
+      unsigned s = __builtin_ctzll(any);
+      uint16_t h = (uint16_t)((high >> s) & 1);
+      v.start = (uint16_t)(((base + s) << 1) | h);
+      if (!h)
+        v.end = (uint16_t)(((base + s) << 1) | 1);
+      rest &= s == 63 ? 0 : ~0ull << (s + 1);
+    }
+    if (rest) {
+      unsigned j = 63 - __builtin_clzll(rest);
+      v.end = (uint16_t)(((base + j) << 1) | ((high >> j) & 1));
+    }
+  }
+
+  void update(const uint64_t *low, const uint64_t *high, size_t base, size_t n) {
+    uint64_t valid = n == 64 ? ~0ull : (1ull << n) - 1;
+    if (uint64_t t = (low[1] | high[1]) & valid) {
+      unsigned j = 63 - __builtin_clzll(t);
+      trigger = (uint16_t)(((base + j) << 1) | ((high[1] >> j) & 1));
+    }
+    update(interval[0], low[0], high[0], valid, base);
+    update(interval[2], low[2], high[2], valid, base);
+    update(interval[3], low[3], high[3], valid, base);
+  }
+
+  void store(DPPQDCWaveform &waveform) const {
+    waveform.trigger = trigger;
+    waveform.gate = interval[0];
+    waveform.holdoff = interval[2];
+    waveform.overthreshold = interval[3];
+  }
+};
+
+static inline void dppqdcWord(uint32_t w, size_t k, char *out, uint64_t *low, uint64_t *high) {
+  uint32_t s = w & 0x0fff0fffu;
+  memcpy(out + 4 * k, &s, sizeof(s));
+  for (int b = 0; b < 4; ++b) {
+    low[b] |= (uint64_t)((w >> (12 + b)) & 1) << k;
+    high[b] |= (uint64_t)((w >> (28 + b)) & 1) << k;
+  }
+}
+
+static inline size_t std751Word(uint32_t w, char *out, size_t idx) {
+  unsigned nSamples = (w >> 30) & 0x03;
+  for (unsigned s = 0; s < nSamples; ++s) {
+    uint16_t sample = (uint16_t)((w >> (s * 10)) & 0x03ff);
+    memcpy(out + 2 * idx++, &sample, sizeof(sample));
+  }
+  return idx;
+}
+
+__attribute__((target("sse2")))
+size_t dppqdcSSE2(const uint32_t *words, size_t n, char *out, uint64_t *low, uint64_t *high) {
+  const __m128i mask = _mm_set1_epi32(0x0fff0fff);
+  // kept in registers - out may alias low and high as far as the compiler knows
+  uint64_t l0 = 0, l1 = 0, l2 = 0, l3 = 0, h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(words + k));
+    _mm_storeu_si128((__m128i *)(out + 4 * k), _mm_and_si128(x, mask));
+    // move each probe bit to the sign bit and collect with movemask
+    h3 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(x)) << k;
+    h2 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 1))) << k;
+    h1 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 2))) << k;
+    h0 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 3))) << k;
+    l3 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 16))) << k;
+    l2 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 17))) << k;
+    l1 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 18))) << k;
+    l0 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(x, 19))) << k;
+  }
+  low[0] |= l0;
+  low[1] |= l1;
+  low[2] |= l2;
+  low[3] |= l3;
+  high[0] |= h0;
+  high[1] |= h1;
+  high[2] |= h2;
+  high[3] |= h3;
+  return k;
+}
+
+__attribute__((target("avx2")))
+size_t dppqdcAVX2(const uint32_t *words, size_t n, char *out, uint64_t *low, uint64_t *high) {
+  const __m256i mask = _mm256_set1_epi32(0x0fff0fff);
+  // kept in registers - out may alias low and high as far as the compiler knows
+  uint64_t l0 = 0, l1 = 0, l2 = 0, l3 = 0, h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(words + k));
+    _mm256_storeu_si256((__m256i *)(out + 4 * k), _mm256_and_si256(x, mask));
+    h3 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(x)) << k;
+    h2 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 1))) << k;
+    h1 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 2))) << k;
+    h0 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 3))) << k;
+    l3 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 16))) << k;
+    l2 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 17))) << k;
+    l1 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 18))) << k;
+    l0 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(x, 19))) << k;
+  }
+  low[0] |= l0;
+  low[1] |= l1;
+  low[2] |= l2;
+  low[3] |= l3;
+  high[0] |= h0;
+  high[1] |= h1;
+  high[2] |= h2;
+  high[3] |= h3;
+  return k;
+}
+
+/* Unpacks four words at a time when all of them carry three samples - the
+ * common case - and falls back to word by word decoding otherwise, e.g. for
+ * the trailing word of each channel block */
+__attribute__((target("ssse3")))
+void std751SSSE3(const uint32_t *words, size_t nWords, StdWaveform &waveform) {
+  char *out = reinterpret_cast<char *>(&waveform) + offsetof(StdWaveform, samples);
+  const __m128i m10 = _mm_set1_epi32(0x03ff);
+  // ab = a0..a3 b0..b3 and cc = c0..c3 c0..c3 as 16 bit values, where a, b, c
+  // are the first, second and third sample of each word
+  const __m128i ab1 = _mm_setr_epi8(0, 1, 8, 9, -1, -1, 2, 3, 10, 11, -1, -1, 4, 5, 12, 13);
+  const __m128i cc1 = _mm_setr_epi8(-1, -1, -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1);
+  const __m128i ab2 = _mm_setr_epi8(-1, -1, 6, 7, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i cc2 = _mm_setr_epi8(4, 5, -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+  size_t idx = 0;
+  size_t i = 0;
+  for (; i + 4 <= nWords; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(words + i));
+    if (_mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(x, _mm_slli_epi32(x, 1)))) == 0xf) {
+      __m128i a = _mm_and_si128(x, m10);
+      __m128i b = _mm_and_si128(_mm_srli_epi32(x, 10), m10);
+      __m128i c = _mm_and_si128(_mm_srli_epi32(x, 20), m10);
+      __m128i ab = _mm_packs_epi32(a, b);
+      __m128i cc = _mm_packs_epi32(c, c);
+      __m128i lo = _mm_or_si128(_mm_shuffle_epi8(ab, ab1), _mm_shuffle_epi8(cc, cc1));
+      __m128i hi = _mm_or_si128(_mm_shuffle_epi8(ab, ab2), _mm_shuffle_epi8(cc, cc2));
+      _mm_storeu_si128((__m128i *)(out + 2 * idx), lo);
+      _mm_storel_epi64((__m128i *)(out + 2 * idx + 16), hi);
+      idx += 12;
+    } else {
+      for (size_t k = i; k < i + 4; ++k) {
+        idx = std751Word(words[k], out, idx);
+      }
+    }
+  }
+  for (; i < nWords; ++i) {
+    idx = std751Word(words[i], out, idx);
+  }
+  waveform.num_samples = (uint16_t)idx;
+}
+
+/* Eight samples at a time, which is a whole number of bytes for both 10 and
+ * 12 bits. Packing first joins pairs of samples to 20 or 24 bits in 32 bit
+ * lanes with a multiply-add, then drops the unused bytes with a shuffle.
+ * Unpacking shuffles the two bytes holding each sample into its lane and
+ * shifts it into place by multiplying by a power of two, to shift left, and
+ * shifting right - there is no per lane shift before AVX2. */
+__attribute__((target("ssse3")))
+size_t packSSSE3(const char *samples, size_t n, unsigned bits, char *packed) {
+  size_t i = 0;
+  if (bits == 12) {
+    const __m128i mask = _mm_set1_epi16(0x0fff);
+    const __m128i join = _mm_set1_epi32(0x10000001); // s0 + s1 << 12
+    const __m128i bytes = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (; i + 8 <= n; i += 8, packed += 12) {
+      __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(samples + 2 * i)), mask);
+      x = _mm_shuffle_epi8(_mm_madd_epi16(x, join), bytes);
+      _mm_storel_epi64((__m128i *)packed, x);
+      uint32_t rest = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+      memcpy(packed + 8, &rest, sizeof(rest));
+    }
+  } else if (bits == 10) {
+    const __m128i mask = _mm_set1_epi16(0x03ff);
+    const __m128i join = _mm_set1_epi32(0x04000001); // s0 + s1 << 10
+    const __m128i low = _mm_set1_epi64x(0x00000fffffll);
+    const __m128i high = _mm_set1_epi64x(0xfffff00000ll);
+    const __m128i bytes = _mm_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+    for (; i + 8 <= n; i += 8, packed += 10) {
+      __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(samples + 2 * i)), mask);
+      x = _mm_madd_epi16(x, join);
+      // join the two 20 bit halves of each 64 bit lane
+      x = _mm_or_si128(_mm_and_si128(x, low), _mm_and_si128(_mm_srli_epi64(x, 12), high));
+      x = _mm_shuffle_epi8(x, bytes);
+      _mm_storel_epi64((__m128i *)packed, x);
+      uint16_t rest = (uint16_t)_mm_extract_epi16(x, 4);
+      memcpy(packed + 8, &rest, sizeof(rest));
+    }
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+size_t unpackSSSE3(const char *packed, size_t n, unsigned bits, char *samples) {
+  const char *end = packed + waveform::packedSize(n, bits);
+  size_t i = 0;
+  if (bits == 12) {
+    const __m128i bytes = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i left = _mm_set1_epi32(0x00010010); // 1 << 4 - shift, shift is 0 or 4
+    for (; i + 8 <= n && packed + 16 <= end; i += 8, packed += 12) {
+      __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)packed), bytes);
+      x = _mm_srli_epi16(_mm_mullo_epi16(x, left), 4);
+      _mm_storeu_si128((__m128i *)(samples + 2 * i), x);
+    }
+  } else if (bits == 10) {
+    const __m128i bytes = _mm_setr_epi8(0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 6, 7, 7, 8, 8, 9);
+    const __m128i left = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1); // 1 << 6 - shift
+    for (; i + 8 <= n && packed + 16 <= end; i += 8, packed += 10) {
+      __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)packed), bytes);
+      x = _mm_srli_epi16(_mm_mullo_epi16(x, left), 6);
+      _mm_storeu_si128((__m128i *)(samples + 2 * i), x);
+    }
+  }
+  return i;
+}
+
+typedef size_t (*DPPQDCKernel)(const uint32_t *, size_t, char *, uint64_t *, uint64_t *);
+
+void dppqdcSIMD(DPPQDCKernel kernel, const uint32_t *words, size_t nWords, DPPQDCWaveform &waveform) {
+  char *out = reinterpret_cast<char *>(&waveform) + offsetof(DPPQDCWaveform, samples);
+  Probes probes;
+  for (size_t base = 0; base < nWords; base += 64) {
+    size_t n = std::min(nWords - base, (size_t)64);
+    uint64_t low[4] = {0, 0, 0, 0};
+    uint64_t high[4] = {0, 0, 0, 0};
+    size_t k = kernel(words + base, n, out + 4 * base, low, high);
+    for (; k < n; ++k) {
+      dppqdcWord(words[base + k], k, out + 4 * base, low, high);
+    }
+    probes.update(low, high, base, n);
+  }
+  waveform.num_samples = (uint16_t)(nWords << 1);
+  probes.store(waveform);
+}
+#endif // JADAQ_X86
+
+waveform::ISA detect() {
+#ifdef JADAQ_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return waveform::ISA::AVX2;
+  if (__builtin_cpu_supports("ssse3"))
+    return waveform::ISA::SSSE3;
+  if (__builtin_cpu_supports("sse2"))
+    return waveform::ISA::SSE2;
+#endif
+  return waveform::ISA::Scalar;
+}
+
+} // namespace
+
+waveform::ISA waveform::supported() {
+  static const ISA isa = detect();
+  return isa;
+}
+
+const char *waveform::name(ISA isa) {
+  switch (isa) {
+  case ISA::Scalar:
+    return "scalar";
+  case ISA::SSE2:
+    return "SSE2";
+  case ISA::SSSE3:
+    return "SSSE3";
+  case ISA::AVX2:
+    return "AVX2";
+  }
+  return "unknown";
+}
+
+void waveform::dppqdc(const uint32_t *words, size_t nWords, DPPQDCWaveform &waveform) {
+  dppqdc(words, nWords, waveform, supported());
+}
+
+void waveform::dppqdc(const uint32_t *words, size_t nWords, DPPQDCWaveform &waveform, ISA isa) {
+  switch (isa) {
+#ifdef JADAQ_X86
+  case ISA::AVX2:
+    dppqdcSIMD(dppqdcAVX2, words, nWords, waveform);
+    return;
+  case ISA::SSSE3:
+  case ISA::SSE2:
+    dppqdcSIMD(dppqdcSSE2, words, nWords, waveform);
+    return;
+#endif
+  default:
+    dppqdcScalar(words, nWords, waveform);
+  }
+}
+
+void waveform::std751(const uint32_t *words, size_t nWords, StdWaveform &waveform) {
+  std751(words, nWords, waveform, supported());
+}
+
+void waveform::std751(const uint32_t *words, size_t nWords, StdWaveform &waveform, ISA isa) {
+  switch (isa) {
+#ifdef JADAQ_X86
+  case ISA::AVX2:
+  case ISA::SSSE3:
+    std751SSSE3(words, nWords, waveform);
+    return;
+#endif
+  default:
+    std751Scalar(words, nWords, waveform);
+  }
+}
+
+void waveform::pack(const char *samples, size_t n, unsigned bits, char *packed) {
+  pack(samples, n, bits, packed, supported());
+}
+
+void waveform::pack(const char *samples, size_t n, unsigned bits, char *packed, ISA isa) {
+  size_t i = 0;
+  switch (isa) {
+#ifdef JADAQ_X86
+  case ISA::AVX2:
+  case ISA::SSSE3:
+    i = packSSSE3(samples, n, bits, packed);
+    break;
+#endif
+  default:
+    break;
+  }
+  packScalar(samples + 2 * i, n - i, bits, packed + i * bits / 8);
+}
+
+void waveform::unpack(const char *packed, size_t n, unsigned bits, char *samples) {
+  unpack(packed, n, bits, samples, supported());
+}
+
+void waveform::unpack(const char *packed, size_t n, unsigned bits, char *samples, ISA isa) {
+  size_t i = 0;
+  switch (isa) {
+#ifdef JADAQ_X86
+  case ISA::AVX2:
+  case ISA::SSSE3:
+    i = unpackSSSE3(packed, n, bits, samples);
+    break;
+#endif
+  default:
+    break;
+  }
+  unpackScalar(packed + i * bits / 8, n - i, bits, samples + 2 * i);
+}
@@ -0,0 +1,63 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Waveform decoding kernels. Every kernel has a scalar reference version and
+ * SIMD versions selected at runtime from what the CPU supports. All versions
+ * produce bit identical output.
+ *
+ */
+
+#ifndef JADAQ_WAVEFORMDECODE_HPP
+#define JADAQ_WAVEFORMDECODE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+struct DPPQDCWaveform;
+struct StdWaveform;
+
+namespace waveform {
+enum class ISA { Scalar, SSE2, SSSE3, AVX2 };
+/* Best instruction set supported by both the build and the CPU */
+ISA supported();
+const char *name(ISA isa);
+
+/* DPP-QDC mixed-mode waveform: nWords words each holding two 12 bit samples
+ * and the trigger, gate, holdoff and overthreshold digital probes */
+void dppqdc(const uint32_t *words, size_t nWords, DPPQDCWaveform &waveform);
+void dppqdc(const uint32_t *words, size_t nWords, DPPQDCWaveform &waveform, ISA isa);
+
+/* XX751 standard firmware: nWords words each holding up to three 10 bit
+ * samples with the number of samples in the top two bits */
+void std751(const uint32_t *words, size_t nWords, StdWaveform &waveform);
+void std751(const uint32_t *words, size_t nWords, StdWaveform &waveform, ISA isa);
+
+/* Packed samples: n samples of bits (10 or 12) bits each as a little endian
+ * bit stream, sample k at bit k * bits. samples points to n 16 bit samples,
+ * which may be unaligned, and packed to packedSize(n, bits) bytes */
+inline size_t packedSize(size_t n, unsigned bits) { return (n * bits + 7) / 8; }
+void pack(const char *samples, size_t n, unsigned bits, char *packed);
+void pack(const char *samples, size_t n, unsigned bits, char *packed, ISA isa);
+void unpack(const char *packed, size_t n, unsigned bits, char *samples);
+void unpack(const char *packed, size_t n, unsigned bits, char *samples, ISA isa);
+} // namespace waveform
+
+#endif // JADAQ_WAVEFORMDECODE_HPP
@@ -27,19 +27,36 @@
 #ifndef JADAQ_CONTAINER_HPP
 #define JADAQ_CONTAINER_HPP
 
+#include "BufferPool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 
 namespace jadaq {
+/* Element types whose size is known at compile time declare
+ *   static constexpr const bool fixedSize = true;
+ * A buffer of those is a plain array of T, while all other element types
+ * are stepped through by the element size given at construction. */
+template <typename T, typename = void> struct fixed_size : std::false_type {};
+template <typename T> struct fixed_size<T, typename std::enable_if<T::fixedSize>::type> : std::true_type {};
+
 template <typename T> class buffer {
 private:
+  static constexpr const bool fixed = fixed_size<T>::value;
   char *const data_raw;   // pointer to the raw allocated data
   char *const data_begin; // pointer to where we begin inserting elements
   char *const data_end;   // pointer to end of data
   size_t const element_size;
   char *next; // past end pointer
+  // constant for fixed size elements so loops over them can be vectorized
+  size_t stride() const noexcept { return fixed ? sizeof(T) : element_size; }
   void check_length() const {
-    if (next + element_size > data_end) {
+    if (next + stride() > data_end) {
       throw std::length_error{"Out of storage space."};
     }
   }
@@ -79,13 +96,27 @@ public:
 
     bool operator!=(const iterator_ &rhs) const { return ptr != rhs.ptr; }
   };
-  typedef iterator_<T> iterator;
-  typedef iterator_<const T> const_iterator;
+  typedef typename std::conditional<fixed, T *, iterator_<T>>::type iterator;
+  typedef typename std::conditional<fixed, const T *, iterator_<const T>>::type const_iterator;
+
+private:
+  template <typename IT> IT *make_iterator(char *p, IT **) const { return reinterpret_cast<IT *>(p); }
+  template <typename IT> iterator_<IT> make_iterator(char *p, iterator_<IT> *) const {
+    return iterator_<IT>{p, element_size};
+  }
+
+public:
 
+  /* Storage comes from the shared BufferPool when there is one */
   buffer(size_t raw_size, size_t object_size, size_t header_size)
-      : data_raw(new char[raw_size]), data_begin(data_raw + header_size),
+      : data_raw(BufferPool::allocate(raw_size)), data_begin(data_raw + header_size),
         data_end(data_raw + raw_size), element_size(object_size),
-        next(data_begin) {}
+        next(data_begin) {
+    if (fixed && object_size != sizeof(T)) {
+      BufferPool::deallocate(data_raw);
+      throw std::invalid_argument{"Element size does not match fixed size element type."};
+    }
+  }
 
   buffer(size_t raw_size, size_t object_size)
       : buffer(raw_size, object_size, 0) {}
@@ -102,31 +133,69 @@ public:
                          other.header_size());
   }
 
-  ~buffer() { delete[] data_raw; }
+  ~buffer() { BufferPool::deallocate(data_raw); }
 
   void push_back(const T &v) {
     check_length();
-    *next = v;
-    memcpy(next, &v, element_size);
-    next += element_size;
+    memcpy(next, &v, stride());
+    next += stride();
   }
   template <typename... Args> void emplace_back(Args &&... args) {
     check_length();
     new (reinterpret_cast<T *>(next)) T(args...);
-    next += element_size;
+    next += stride();
+  }
+  /* As emplace_back but without the exception: returns false and leaves the
+   * buffer untouched when it is full */
+  template <typename... Args> bool try_emplace_back(Args &&... args) {
+    if (full())
+      return false;
+    new (reinterpret_cast<T *>(next)) T(args...);
+    next += stride();
+    return true;
   }
 
-  void clear() { next = data_begin; }
+  /* Append a copy of the element_size bytes at p */
+  void append(const void *p) {
+    check_length();
+    memcpy(next, p, stride());
+    next += stride();
+  }
 
-  iterator begin() { return iterator{data_begin, element_size}; }
+  /* Append copies of the n elements at p */
+  void append(const void *p, size_t n) {
+    if (n > available()) {
+      throw std::length_error{"Out of storage space."};
+    }
+    memcpy(next, p, n * stride());
+    next += n * stride();
+  }
 
-  const_iterator begin() const {
-    return const_iterator{data_begin, element_size};
+  /* Reserve room for up to n consecutive elements to be constructed in place
+   * e.g. by a batch decoder. n is updated to the number of elements actually
+   * reserved, which is 0 when the buffer is full. Only valid for fixed size
+   * elements. */
+  T *allocate(size_t &n) {
+    static_assert(fixed_size<T>::value, "allocate needs a fixed size element type");
+    T *first = reinterpret_cast<T *>(next);
+    n = std::min(n, available());
+    next += n * sizeof(T);
+    return first;
   }
 
-  iterator end() { return iterator{next, element_size}; }
+  void clear() { next = data_begin; }
+
+  iterator begin() { return make_iterator(data_begin, (iterator *)nullptr); }
+
+  const_iterator begin() const { return make_iterator(data_begin, (const_iterator *)nullptr); }
+
+  iterator end() { return make_iterator(next, (iterator *)nullptr); }
+
+  const_iterator end() const { return make_iterator(next, (const_iterator *)nullptr); }
 
-  const_iterator end() const { return const_iterator{next, element_size}; }
+  T &operator[](size_t i) { return *reinterpret_cast<T *>(data_begin + i * stride()); }
+
+  const T &operator[](size_t i) const { return *reinterpret_cast<const T *>(data_begin + i * stride()); }
 
   char *data() { return data_raw; }
 
@@ -138,15 +207,22 @@ public:
 
   size_t header_size() const noexcept { return data_begin - data_raw; }
 
-  size_t size() const { return (next - data_begin) / element_size; }
+  size_t size() const { return (next - data_begin) / stride(); }
 
-  size_t capacity() const { return (data_end - data_begin) / element_size; }
+  size_t capacity() const { return (data_end - data_begin) / stride(); }
 
   size_t max_size() const noexcept { return capacity(); }
 
   bool empty() const noexcept { return next == data_begin; }
 
-  void setElements(size_t n) { next = (data_begin + element_size * n); }
+  bool full() const noexcept { return next + stride() > data_end; }
+
+  /* Number of elements that still fit */
+  size_t available() const noexcept { return (data_end - next) / stride(); }
+
+  T &back() { return *reinterpret_cast<T *>(next - stride()); }
+
+  void setElements(size_t n) { next = (data_begin + stride() * n); }
 
   void copy(const buffer<T> &other) {
     memcpy(data_raw, other.data_raw, other.data_size());
@@ -158,5 +234,62 @@ public:
     return *this;
   }
 };
+
+/* Lock-free bounded single-producer/single-consumer queue. Exactly one thread
+ * may push() and exactly one (other) thread may pop(). Capacity is rounded up
+ * to a power of two.
+ */
+template <typename T> class spsc_queue {
+private:
+  std::vector<T> slots;
+  size_t const mask;
+  std::atomic<size_t> head{0}; // next slot to pop - owned by consumer
+  // keep producer and consumer indices on separate cache lines
+  char padding[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail{0}; // next slot to push - owned by producer
+
+  static size_t roundup(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+public:
+  explicit spsc_queue(size_t capacity)
+      : slots(roundup(capacity)), mask(roundup(capacity) - 1) {}
+  spsc_queue(const spsc_queue &) = delete;
+
+  bool push(const T &v) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false; // full
+    }
+    slots[t & mask] = v;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &v) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false; // empty
+    }
+    v = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    // load head first so a concurrent reader never sees head past tail
+    size_t h = head.load(std::memory_order_acquire);
+    return tail.load(std::memory_order_acquire) - h;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  size_t capacity() const { return mask + 1; }
+};
 }
 #endif // JADAQ_CONTAINER_HPP
@@ -25,17 +25,28 @@
  */
 
 #include "Configuration.hpp"
+#include "BufferPool.hpp"
 #include "DataHandler.hpp"
 #include "DataWriter.hpp"
+#include "DataWriterAsync.hpp"
+#include "DataWriterCompress.hpp"
 #include "DataWriterHDF5.hpp"
+#include "DataWriterHDF5Columns.hpp"
+#include "DataWriterHDF5PerDigitizer.hpp"
+#include "DataWriterEventBuilder.hpp"
 #include "DataWriterNetwork.hpp"
 #include "DataWriterText.hpp"
 #include "Digitizer.hpp"
+#include "RawCapture.hpp"
+#include "ReadoutThread.hpp"
 //#include "Timer.hpp"
 #include "interrupt.hpp"
 #include <boost/program_options.hpp>
 #include <chrono>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <thread>
 #include "runno.hpp"
@@ -54,6 +65,9 @@ struct {
   bool hdf5out = false;
   float split = -1.0f;
   bool nullout = false;
+  bool unsorted = false;
+  bool time64 = false;
+  bool packed = false;
   long events = -1;
   uint32_t time = 0xffffff; // many seconds
   uint32_t stats = 0xffffff; // many seconds
@@ -63,14 +77,84 @@ struct {
   std::string *network = nullptr;
   std::string *port = nullptr;
   std::string *outConfigFile = nullptr;
+  std::string *captureFile = nullptr;
   std::vector<std::string> configFile;
+  std::string readout = "single";
+  std::vector<int> cpus;
+  int pipeline = 0;
+  uint32_t pollMin = 50;    // microseconds
+  uint32_t pollMax = 10000; // microseconds
+  int64_t eventWindow = -1; // ticks - negative disables event building
+  uint32_t eventMultiplicity = 1;
+  uint32_t poolBlocks = 1024; // 0 allocates buffers from the heap
+  bool hugePages = false;
+  int numaNode = -1;
+  uint32_t writeQueue = 256;  // buffers - 0 writes HDF5 from the readout threads
+  uint32_t writeChunk = 1024; // kB
+  bool compress = false;
+  jadaq::compress::Method compression;
+  uint32_t compressThreads = 2;
+  bool hdf5Columns = false;
+  bool hdf5PerDigitizer = false;
+  DataWriterHDF5Columns::Options hdf5Options;
+  DataWriterNetwork::Options networkOptions;
 } conf;
 
 struct {
   bool timeout{false};
   std::vector<Digitizer> * digarr;
+  const DataWriterEventBuilder * eventBuilder = nullptr;
+  const jadaq::BufferPool * bufferPool = nullptr;
+  const DataWriterCompress * compressWriter = nullptr;
+  const DataWriterNetwork * networkWriter = nullptr;
+  std::mutex asyncWritersMutex;
+  std::vector<DataWriterAsync *> asyncWriters;
 } application_control;
 
+/* Sum of the statistics of all writer threads */
+static DataWriterAsync::Stats writerStats() {
+  DataWriterAsync::Stats sum;
+  std::lock_guard<std::mutex> lock(application_control.asyncWritersMutex);
+  for (const DataWriterAsync *asyncWriter : application_control.asyncWriters) {
+    const DataWriterAsync::Stats stats = asyncWriter->getStats();
+    sum.buffers += stats.buffers;
+    sum.bytes += stats.bytes;
+    sum.chunks += stats.chunks;
+    sum.stalls += stats.stalls;
+    sum.stallTime += stats.stallTime;
+    sum.depth += stats.depth;
+    sum.highWater = std::max(sum.highWater, stats.highWater);
+    for (size_t k = 0; k < DataWriterAsync::depthBuckets; ++k)
+      sum.depthHistogram[k] += stats.depthHistogram[k];
+    for (size_t k = 0; k < DataWriterAsync::latencyBuckets; ++k)
+      sum.latencyHistogram[k] += stats.latencyHistogram[k];
+  }
+  return sum;
+}
+
+/* HDF5 writer for files named path + basename + id + ".h5" */
+static DataWriter hdf5Writer(const std::string &basename, const std::string &id) {
+  DataWriter dataWriter;
+  if (conf.hdf5Columns) {
+    dataWriter = new DataWriterHDF5Columns(*conf.path, basename, std::string(id), conf.hdf5Options);
+  } else {
+    dataWriter = new DataWriterHDF5(*conf.path, basename, std::string(id));
+  }
+  return dataWriter;
+}
+
+/* Put a writer thread in front of dataWriter */
+static DataWriter asyncWriter(DataWriter &&dataWriter) {
+  DataWriterAsync *asyncWriter = new DataWriterAsync(std::move(dataWriter), conf.writeQueue, (size_t)conf.writeChunk << 10);
+  {
+    std::lock_guard<std::mutex> lock(application_control.asyncWritersMutex);
+    application_control.asyncWriters.push_back(asyncWriter);
+  }
+  DataWriter result;
+  result = asyncWriter;
+  return result;
+}
+
 static void printStats(const std::vector<Digitizer> &digitizers, uint32_t elapsedms, uint64_t time) {
   static uint64_t oldevents=0;
   static uint64_t oldbytes=0;
@@ -79,12 +163,13 @@ static void printStats(const std::vector<Digitizer> &digitizers, uint32_t elapse
   uint64_t bytesRead = 0;
   uint64_t readouts = 0;
   printf("  Status after %ld seconds runtime:\n", time/1000);
-  printf("   DIGITIZER                        Events                  Bytes                       Readouts\n");
+  printf("   DIGITIZER                        Events                  Bytes                       Readouts      Interval   Empty\n");
   for (const Digitizer &digitizer : digitizers) {
-    const Digitizer::Stats &stats = digitizer.getStats();
-    printf("     %-10s: %6s    %15" PRIu64 "           %15" PRIu64 "           %15" PRIu64 "\n",
-           digitizer.name().c_str(), digitizer.active ? "ALIVE!" : "DEAD!",
-           stats.eventsFound, stats.bytesRead, stats.readouts);
+    const Digitizer::Stats stats = digitizer.getStats();
+    printf("     %-10s: %6s    %15" PRIu64 "           %15" PRIu64 "           %15" PRIu64 "     %7" PRIu32 "us  %5.1f%%\n",
+           digitizer.name().c_str(), digitizer.active() ? "ALIVE!" : "DEAD!",
+           stats.eventsFound, stats.bytesRead, stats.readouts,
+           stats.pollInterval, stats.emptyRatio * 100.0f);
     eventsFound += stats.eventsFound;
     bytesRead += stats.bytesRead;
     readouts += stats.readouts;
@@ -95,6 +180,80 @@ static void printStats(const std::vector<Digitizer> &digitizers, uint32_t elapse
          (eventsFound - oldevents)*1000/elapsedms,
          (bytesRead - oldbytes)*1000/elapsedms,
          (readouts - oldreadouts)*1000/elapsedms);
+  if (conf.pipeline > 0) {
+    printf("   PIPELINE                     Depth              HighWater         Dropped buffers          Dropped bytes\n");
+    for (const Digitizer &digitizer : digitizers) {
+      const Digitizer::Stats stats = digitizer.getStats();
+      printf("     %-10s:         %6" PRIu64 "/%-6d     %15" PRIu64 "         %15" PRIu64 "        %15" PRIu64 "\n",
+             digitizer.name().c_str(), stats.queueDepth, conf.pipeline, stats.queueHighWater,
+             stats.droppedBuffers, stats.droppedBytes);
+    }
+    printf("\n");
+  }
+  if (!conf.unsorted) {
+    printf("   SORTER                     Pending                 Forced                    Late                 Resets\n");
+    for (const Digitizer &digitizer : digitizers) {
+      const DataHandler::Stats stats = digitizer.getStats().sorter;
+      printf("     %-10s:  %15" PRIu64 "        %15" PRIu64 "         %15" PRIu64 "        %15" PRIu64 "\n",
+             digitizer.name().c_str(), stats.pending, stats.forced, stats.late, stats.resets);
+    }
+    printf("\n");
+  } else {
+    printf("   UNSORTED                   Dropped\n");
+    for (const Digitizer &digitizer : digitizers) {
+      const DataHandler::Stats stats = digitizer.getStats().sorter;
+      printf("     %-10s:  %15" PRIu64 "\n", digitizer.name().c_str(), stats.dropped);
+    }
+    printf("\n");
+  }
+  if (application_control.eventBuilder) {
+    const DataWriterEventBuilder::Stats stats = application_control.eventBuilder->getStats();
+    printf("   EVENTS                        Hits         Events       Rejected         Forced           Late        Pending\n");
+    printf("                      %15" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n\n",
+           stats.hits, stats.events, stats.rejected, stats.forced, stats.late, stats.pending);
+  }
+  if (!application_control.asyncWriters.empty()) {
+    const DataWriterAsync::Stats stats = writerStats();
+    const size_t depthBuckets = DataWriterAsync::depthBuckets;
+    const size_t latencyBuckets = DataWriterAsync::latencyBuckets;
+    printf("   WRITER                     Buffers   Depth p99/max         Stalls  Stall time     Chunks  Latency p50/p99\n");
+    printf("                      %15" PRIu64 "    <%5" PRIu64 "/%-6zu %14" PRIu64 " %9" PRIu64 "ms %10" PRIu64
+           "   <%6" PRIu64 "/<%-7" PRIu64 "us\n\n",
+           stats.buffers, DataWriterAsync::percentile(stats.depthHistogram, depthBuckets, 0.99), stats.highWater,
+           stats.stalls, stats.stallTime / 1000, stats.chunks,
+           DataWriterAsync::percentile(stats.latencyHistogram, latencyBuckets, 0.5),
+           DataWriterAsync::percentile(stats.latencyHistogram, latencyBuckets, 0.99));
+  }
+  if (application_control.compressWriter) {
+    const DataWriterCompress::Stats stats = application_control.compressWriter->getStats();
+    printf("   COMPRESSION                Buffers       MB in        Ratio        MB/s      Parted   Stored   Stalls\n");
+    for (size_t i = 0; i < stats.threads.size(); ++i) {
+      const DataWriterCompress::ThreadStats &thread = stats.threads[i];
+      printf("     thread %-3zu      %15" PRIu64 " %11.1f %12.2f %11.1f\n", i, thread.buffers, thread.bytesIn / 1e6,
+             thread.bytesOut ? (double)thread.bytesIn / thread.bytesOut : 0.0,
+             thread.busy ? (double)thread.bytesIn / thread.busy : 0.0);
+    }
+    printf("     Total           %15" PRIu64 " %49" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n\n", stats.buffers,
+           stats.parted, stats.stored, stats.stalls);
+  }
+  if (application_control.networkWriter) {
+    static uint64_t oldDatagrams = 0;
+    static uint64_t oldSyscalls = 0;
+    const DataWriterNetwork::Stats stats = application_control.networkWriter->getStats();
+    printf("   NETWORK                  Datagrams    Datagrams/s       Syscalls     Syscalls/s    GSO datagrams   Errors   Stalls\n");
+    printf("                      %15" PRIu64 " %12" PRIu64 "/s %14" PRIu64 " %12" PRIu64 "/s %16" PRIu64 " %8" PRIu64
+           " %8" PRIu64 "\n\n",
+           stats.datagrams, (stats.datagrams - oldDatagrams) * 1000 / elapsedms, stats.syscalls,
+           (stats.syscalls - oldSyscalls) * 1000 / elapsedms, stats.segmented, stats.errors, stats.stalls);
+    oldDatagrams = stats.datagrams;
+    oldSyscalls = stats.syscalls;
+  }
+  if (application_control.bufferPool) {
+    const jadaq::BufferPool::Stats stats = application_control.bufferPool->getStats();
+    printf("   BUFFER POOL                 Blocks          InUse      HighWater         Misses\n");
+    printf("                      %15zu %14zu %14zu %14" PRIu64 "\n\n",
+           stats.blocks, stats.inUse, stats.highWater, stats.misses);
+  }
   oldevents = eventsFound;
   oldbytes = bytesRead;
   oldreadouts = readouts;
@@ -138,6 +297,16 @@ int main(int argc, const char *argv[]) {
        ("split,s", po::value<float>()->value_name("<seconds>")->default_value(conf.split),
         "Split output file every <seconds> seconds")
        ("hdf5,H", po::bool_switch(&conf.hdf5out), "Output to hdf5 file.")
+       ("unsorted", po::bool_switch(&conf.unsorted),
+        "Write events in readout order without time sorting (fastest)")
+       ("time64", po::bool_switch(&conf.time64),
+        "Write DPP-QDC list data without extras with 64 bit time reconstructed from time tag rollovers")
+       ("packed-waveforms", po::bool_switch(&conf.packed),
+        "Write waveform samples bit packed to the ADC resolution (12 bit DPP-QDC, 10 bit XX751)")
+       ("event-window", po::value<int64_t>()->value_name("<ticks>"),
+        "Build events across digitizers from hits within <ticks> of the first hit")
+       ("event-multiplicity", po::value<uint32_t>()->value_name("<hits>")->default_value(conf.eventMultiplicity),
+        "Only write built events with at least <hits> hits")
        ("stats",  po::value<int>()->value_name("<seconds>")->default_value(conf.stats),
         "Print statistics every <seconds> seconds")
        ("path,p", po::value<std::string>()->value_name("<path>")->default_value("."),
@@ -148,6 +317,46 @@ int main(int argc, const char *argv[]) {
         "Send data over network - address to bind to.")
        ("port,P", po::value<std::string>()->value_name("<port>")->default_value("9000"),
         "Network port to bind to if sending over network")
+       ("net-batch", po::value<uint32_t>()->value_name("<datagrams>")->default_value((uint32_t)conf.networkOptions.batch),
+        "Send up to <datagrams> datagrams per sendmmsg call from a sender thread (1 sends from the readout threads)")
+       ("net-flush", po::value<uint32_t>()->value_name("<us>")->default_value(conf.networkOptions.flushTime),
+        "Send a partial batch once its oldest datagram has waited <us> microseconds")
+       ("net-gso", po::bool_switch(&conf.networkOptions.gso),
+        "Hand equal sized datagrams of a batch to the kernel as one UDP GSO message")
+       ("readout,R", po::value<std::string>()->value_name("<mode>")->default_value(conf.readout),
+        "Readout mode: single (round-robin in main thread), digitizer (thread per digitizer) or link (thread per link)")
+       ("cpus", po::value<std::string>()->value_name("<list>"),
+        "Comma separated list of CPUs to pin readout threads to")
+       ("poll-min", po::value<uint32_t>()->value_name("<us>")->default_value(conf.pollMin),
+        "Shortest adaptive poll interval per digitizer in microseconds")
+       ("poll-max", po::value<uint32_t>()->value_name("<us>")->default_value(conf.pollMax),
+        "Longest adaptive poll interval per digitizer in microseconds")
+       ("pipeline", po::value<int>()->value_name("<buffers>")->default_value(conf.pipeline),
+        "Decode in a separate thread per digitizer fed by a pool of <buffers> readout buffers (0 disables)")
+       ("hdf5-layout", po::value<std::string>()->value_name("<layout>")->default_value("packets"),
+        "HDF5 layout: packets (a table per globalTime) or columns (a dataset per field)")
+       ("hdf5-files", po::value<std::string>()->value_name("<files>")->default_value("single"),
+        "HDF5 files: single, or digitizer for a file per digitizer linked from a master file")
+       ("hdf5-chunk", po::value<uint32_t>()->value_name("<kB>")->default_value(conf.hdf5Options.chunkBytes >> 10),
+        "Chunk size of the datasets in the columns layout")
+       ("hdf5-compress", po::value<std::string>()->value_name("<filter>")->default_value("none"),
+        "Compress the columns layout: none, deflate[:<level>] or lz4 (needs the HDF5 LZ4 plugin)")
+       ("write-queue", po::value<uint32_t>()->value_name("<buffers>")->default_value(conf.writeQueue),
+        "Write HDF5 from a separate thread fed through a queue of <buffers> buffers (0 writes from the readout threads)")
+       ("write-chunk", po::value<uint32_t>()->value_name("<kB>")->default_value(conf.writeChunk),
+        "Write HDF5 in chunks of up to <kB> kilobytes per digitizer")
+       ("compress", po::value<std::string>()->value_name("<method>")->default_value("none"),
+        "Compress output buffers: none, delta, deflate, lz4 or zstd, or delta+<codec>")
+       ("compress-threads", po::value<uint32_t>()->value_name("<threads>")->default_value(conf.compressThreads),
+        "Compress in <threads> worker threads")
+       ("pool", po::value<uint32_t>()->value_name("<blocks>")->default_value(conf.poolBlocks),
+        "Take output buffers from a pool of <blocks> preallocated blocks (0 allocates from the heap)")
+       ("hugepages", po::bool_switch(&conf.hugePages),
+        "Back the buffer pool with huge pages")
+       ("numa-node", po::value<int>()->value_name("<node>"),
+        "Bind the buffer pool memory to NUMA <node>")
+       ("capture", po::value<std::string>()->value_name("<file>"),
+        "Append every raw readout buffer to <file> for later replay")
        ("config_out", po::value<std::string>()->value_name("<file>"),
         "Read back device(s) configuration and write to <file>")
        ("config", po::value<std::vector<std::string>>()->value_name("<file>"),
@@ -178,6 +387,9 @@ int main(int argc, const char *argv[]) {
       std::cerr << "No configuration file given!" << std::endl;
       return -1;
     }
+    if (vm.count("capture")) {
+      conf.captureFile = new std::string(vm["capture"].as<std::string>());
+    }
     if (vm.count("config_out")) {
       conf.outConfigFile = new std::string(vm["config_out"].as<std::string>());
     }
@@ -190,11 +402,81 @@ int main(int argc, const char *argv[]) {
     conf.time = vm["time"].as<int>();
     conf.split = vm["split"].as<float>();
     conf.stats = vm["stats"].as<int>();
+    conf.readout = vm["readout"].as<std::string>();
+    conf.pipeline = vm["pipeline"].as<int>();
+    conf.pollMin = vm["poll-min"].as<uint32_t>();
+    conf.pollMax = vm["poll-max"].as<uint32_t>();
+    if (vm.count("event-window")) {
+      conf.eventWindow = vm["event-window"].as<int64_t>();
+      if (conf.eventWindow < 0) {
+        std::cerr << "Event window cannot be negative" << std::endl;
+        return -1;
+      }
+      if (conf.unsorted) {
+        std::cerr << "Event building needs time sorted data - drop --unsorted" << std::endl;
+        return -1;
+      }
+    }
+    conf.eventMultiplicity = vm["event-multiplicity"].as<uint32_t>();
+    conf.poolBlocks = vm["pool"].as<uint32_t>();
+    conf.writeQueue = vm["write-queue"].as<uint32_t>();
+    const std::string layout = vm["hdf5-layout"].as<std::string>();
+    if (layout != "packets" && layout != "columns") {
+      std::cerr << "Unknown HDF5 layout: " << layout << std::endl;
+      return -1;
+    }
+    conf.hdf5Columns = layout == "columns";
+    const std::string files = vm["hdf5-files"].as<std::string>();
+    if (files != "single" && files != "digitizer") {
+      std::cerr << "Unknown HDF5 files: " << files << std::endl;
+      return -1;
+    }
+    conf.hdf5PerDigitizer = files == "digitizer";
+    conf.hdf5Options.chunkBytes = (size_t)vm["hdf5-chunk"].as<uint32_t>() << 10;
+    const std::string compress = vm["hdf5-compress"].as<std::string>();
+    if (compress == "lz4") {
+      conf.hdf5Options.compression = DataWriterHDF5Columns::Compression::LZ4;
+    } else if (compress == "deflate" || compress.compare(0, 8, "deflate:") == 0) {
+      conf.hdf5Options.compression = DataWriterHDF5Columns::Compression::Deflate;
+      if (compress.size() > 8)
+        conf.hdf5Options.level = std::stoi(compress.substr(8));
+    } else if (compress != "none") {
+      std::cerr << "Unknown HDF5 compression: " << compress << std::endl;
+      return -1;
+    }
+    conf.writeChunk = vm["write-chunk"].as<uint32_t>();
+    const std::string compression = vm["compress"].as<std::string>();
+    if (compression != "none") {
+      try {
+        conf.compression = jadaq::compress::parse(compression);
+      } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+      }
+      conf.compress = true;
+    }
+    conf.compressThreads = vm["compress-threads"].as<uint32_t>();
+    if (vm.count("numa-node")) {
+      conf.numaNode = vm["numa-node"].as<int>();
+    }
+    if (conf.readout != "single" && conf.readout != "digitizer" && conf.readout != "link") {
+      std::cerr << "Unknown readout mode: " << conf.readout << std::endl;
+      return -1;
+    }
+    if (vm.count("cpus")) {
+      std::stringstream cpus(vm["cpus"].as<std::string>());
+      std::string cpu;
+      while (std::getline(cpus, cpu, ',')) {
+        conf.cpus.push_back(std::stoi(cpu));
+      }
+    }
 
     if (vm.count("network")) {
       conf.network = new std::string(vm["network"].as<std::string>());
       conf.port = new std::string(vm["port"].as<std::string>());
     }
+    conf.networkOptions.batch = std::max(vm["net-batch"].as<uint32_t>(), 1u);
+    conf.networkOptions.flushTime = vm["net-flush"].as<uint32_t>();
     // else {
     //   conf.network = new std::string("127.0.0.1");
     //   conf.port = new std::string(vm["port"].as<std::string>());
@@ -207,6 +489,14 @@ int main(int argc, const char *argv[]) {
     throw;
   }
 
+  /* The pool must outlive the digitizers and data writers holding its buffers */
+  std::unique_ptr<jadaq::BufferPool> bufferPool;
+  if (conf.poolBlocks > 0) {
+    bufferPool.reset(new jadaq::BufferPool(Data::maxBufferSize, conf.poolBlocks, conf.numaNode, conf.hugePages));
+    jadaq::BufferPool::setShared(bufferPool.get());
+    application_control.bufferPool = bufferPool.get();
+  }
+
   // prepare a run number
   runno runNumber;
 
@@ -271,14 +561,36 @@ int main(int argc, const char *argv[]) {
 
   // TODO: move DataHandler creation to factory method in DataHandlerGeneric
   DataWriter dataWriter;
+  DataWriterNetwork *networkWriter = nullptr;
 
   if (conf.hdf5out) {
     XTRACE(MAIN, NOTE, "Creating DataWriter for HDF5");
     std::string extension = conf.split > 0.0f ? runNumber.toString() : "";
-    dataWriter = new DataWriterHDF5(*conf.path, *conf.basename, extension.c_str());
+    if (conf.hdf5PerDigitizer) {
+      // a writer thread per digitizer when HDF5 calls may run in parallel
+      const bool parallel = conf.writeQueue > 0 && DataWriterHDF5PerDigitizer::threadSafe();
+      if (conf.writeQueue > 0 && !parallel) {
+        XTRACE(MAIN, WAR, "HDF5 library is not thread safe - using one writer thread for all files");
+      }
+      DataWriterHDF5PerDigitizer::Factory factory = hdf5Writer;
+      if (parallel) {
+        factory = [](const std::string &basename, const std::string &id) { return asyncWriter(hdf5Writer(basename, id)); };
+      }
+      dataWriter = new DataWriterHDF5PerDigitizer(*conf.path, *conf.basename, extension.c_str(), factory);
+      if (conf.writeQueue > 0 && !parallel) {
+        dataWriter = asyncWriter(std::move(dataWriter));
+      }
+    } else {
+      dataWriter = hdf5Writer(*conf.basename, extension);
+      if (conf.writeQueue > 0) {
+        dataWriter = asyncWriter(std::move(dataWriter));
+      }
+    }
   } else if (conf.network != nullptr) {
-    XTRACE(MAIN, NOTE, "Creating DataWriter for UDP");
-    dataWriter = new DataWriterNetwork(*conf.network, *conf.port, runNumber.value());
+    XTRACE(MAIN, NOTE, "Creating DataWriter for UDP, %zu datagrams per batch", conf.networkOptions.batch);
+    networkWriter = new DataWriterNetwork(*conf.network, *conf.port, runNumber.value(), conf.networkOptions);
+    dataWriter = networkWriter;
+    application_control.networkWriter = networkWriter;
   } else if (conf.nullout) {
     XTRACE(MAIN, WAR, "Creating (dummy) DataWriter for to /dev/null");
     dataWriter = new DataWriterNull();
@@ -286,13 +598,40 @@ int main(int argc, const char *argv[]) {
     std::cerr << "No valid data handler." << std::endl;
     return -1;
   }
+  DataWriterCompress *compressWriter = nullptr;
+  if (conf.compress) {
+    XTRACE(MAIN, NOTE, "Compressing with %s in %u threads", jadaq::compress::name(conf.compression).c_str(),
+           conf.compressThreads);
+    compressWriter = new DataWriterCompress(std::move(dataWriter), conf.compression, conf.compressThreads, 256);
+    dataWriter = compressWriter;
+    application_control.compressWriter = compressWriter;
+  }
+  DataWriterEventBuilder *eventBuilder = nullptr;
+  if (conf.eventWindow >= 0) {
+    XTRACE(MAIN, NOTE, "Building events within %ld ticks", conf.eventWindow);
+    eventBuilder = new DataWriterEventBuilder(std::move(dataWriter), conf.eventWindow, conf.eventMultiplicity);
+    dataWriter = eventBuilder;
+    application_control.eventBuilder = eventBuilder;
+  }
+  std::unique_ptr<raw::Writer> capture;
+  if (conf.captureFile) {
+    capture.reset(new raw::Writer(*conf.captureFile));
+  }
   XTRACE(MAIN, INF, "Starting Acquisition");
 
   for (Digitizer &digitizer : digitizers) {
     XTRACE(MAIN, INF, "Start acquisition on digitizer %s", digitizer.name().c_str());
+    digitizer.setSorted(!conf.unsorted);
+    digitizer.setTime64(conf.time64);
+    digitizer.setPacked(conf.packed);
     digitizer.initialize(dataWriter);
+    digitizer.setCapture(capture.get());
+    digitizer.setPollRange(conf.pollMin, conf.pollMax);
+    if (conf.pipeline > 0) {
+      digitizer.startPipeline(conf.pipeline);
+    }
     digitizer.startAcquisition();
-    digitizer.active = true;
+    digitizer.setActive(true);
   }
 
   /* Set up interrupt handler */
@@ -307,41 +646,72 @@ int main(int argc, const char *argv[]) {
 
   XTRACE(MAIN, INF, "Running acquisition loop - Ctrl-C to interrupt");
 
+  /* Set up readout: either a single round-robin pass over all digitizers
+   * from the main thread or dedicated threads per digitizer or per link */
+  std::vector<std::unique_ptr<ReadoutThread>> readoutThreads;
+  if (conf.readout == "single") {
+    std::vector<Digitizer *> all;
+    for (Digitizer &digitizer : digitizers) {
+      all.push_back(&digitizer);
+    }
+    readoutThreads.emplace_back(new ReadoutThread(all));
+  } else {
+    std::map<std::pair<int, int>, std::vector<Digitizer *>> links;
+    for (Digitizer &digitizer : digitizers) {
+      if (conf.readout == "link") {
+        links[std::make_pair((int)digitizer.linkType, digitizer.linkNum)].push_back(&digitizer);
+      } else {
+        readoutThreads.emplace_back(new ReadoutThread({&digitizer}, conf.cpus.empty() ? -1 :
+                                                      conf.cpus[readoutThreads.size() % conf.cpus.size()]));
+      }
+    }
+    for (auto &link : links) {
+      readoutThreads.emplace_back(new ReadoutThread(link.second, conf.cpus.empty() ? -1 :
+                                                    conf.cpus[readoutThreads.size() % conf.cpus.size()]));
+    }
+  }
+  /* IRQWait blocks the whole readout thread, so an interrupt driven digitizer
+   * starves the others read out by the same thread */
+  for (auto &readoutThread : readoutThreads) {
+    if (readoutThread->getDigitizers().size() < 2)
+      continue;
+    for (Digitizer *digitizer : readoutThread->getDigitizers()) {
+      if (digitizer->interruptReadout()) {
+        XTRACE(MAIN, WAR, "Interrupt readout of %s blocks the other digitizers of its readout thread for up to %u ms"
+               " - consider --readout digitizer", digitizer->name().c_str(), digitizer->interruptTimeout());
+      }
+    }
+  }
+  if (conf.readout != "single") {
+    XTRACE(MAIN, INF, "Starting %d readout thread(s)", readoutThreads.size());
+    for (auto &readoutThread : readoutThreads) {
+      readoutThread->start();
+    }
+  }
+
   uint64_t eventsFound = 0;
   uint64_t readouts = 0;
   uint16_t alive = 0;
   Timer acquisitionTimer;
   Timer splitTimer;
-  SteadyTimer readoutTimer;
   while (true) {
-    // reset stats
+    if (conf.readout == "single") {
+      alive = readoutThreads.front()->poll();
+    } else {
+      // readout threads do the work - we only handle stop conditions and splitting
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      alive = 0;
+      for (auto &readoutThread : readoutThreads) {
+        alive += readoutThread->alive();
+      }
+    }
+    // accumulative stats for all digitizers
     eventsFound = 0;
     readouts = 0;
-    alive = 0;
     for (Digitizer &digitizer : digitizers) {
-      if (digitizer.active) {
-        try {
-          /* wait a certain amount of time between acquisition attempts to avoid
-           potential hickups on the link */
-          // NOTE: introduced to address issue #18, value determined experimentally
-          // TODO: make this value configurable
-          int gracePeriod = 750 - readoutTimer.elapsedus(); // microseconds
-          if (gracePeriod > 50) {std::this_thread::sleep_for(std::chrono::microseconds(gracePeriod));}
-          else {
-            // wait at least 10us before polling again
-            std::this_thread::sleep_for(std::chrono::microseconds(50));
-          }
-          readoutTimer.reset();
-          digitizer.acquisition();
-          alive++;
-        } catch (caen::Error &e) {
-          XTRACE(MAIN, ERR, "ERROR: unexpected exception during acquisition: %s (%d)", e.what(), e.code());
-          digitizer.active = false;
-        }
-      }
-      // accumulative stats for all digitizers
-      eventsFound += digitizer.getStats().eventsFound;
-      readouts += digitizer.getStats().readouts;
+      const Digitizer::Stats stats = digitizer.getStats();
+      eventsFound += stats.eventsFound;
+      readouts += stats.readouts;
     }
     if (conf.split > 0.0f) {
       if (splitTimer.timeus()/1000000 >= conf.split) {
@@ -366,6 +736,10 @@ int main(int argc, const char *argv[]) {
       break;
     }
   }
+  for (auto &readoutThread : readoutThreads) {
+    readoutThread->stop();
+  }
+  readoutThreads.clear();
 
   auto elapsed = acquisitionTimer.timeus();
   for (Digitizer &digitizer : digitizers) {
@@ -391,5 +765,44 @@ int main(int argc, const char *argv[]) {
   XTRACE(MAIN, ALW, "Collecting %u events.", eventsFound);
   XTRACE(MAIN, ALW, "Resulting in a collection rate of %.2f kHz.", eventsFound / (elapsed / 1000.0));
   XTRACE(MAIN, ALW, "Total number of readout attempts: %u.", readouts);
+  if (eventBuilder) {
+    eventBuilder->flush();
+    const DataWriterEventBuilder::Stats stats = eventBuilder->getStats();
+    XTRACE(MAIN, ALW, "Built %lu events from %lu hits.", stats.events, stats.hits);
+  }
+  if (compressWriter) {
+    compressWriter->flush();
+    const DataWriterCompress::Stats stats = compressWriter->getStats();
+    uint64_t bytesIn = 0, bytesOut = 0;
+    for (const DataWriterCompress::ThreadStats &thread : stats.threads) {
+      bytesIn += thread.bytesIn;
+      bytesOut += thread.bytesOut;
+    }
+    XTRACE(MAIN, ALW, "Compressed %.1f MB to %.1f MB (ratio %.2f), %lu buffers in parts, %lu passed on uncompressed.",
+           bytesIn / 1e6, bytesOut / 1e6, bytesOut ? (double)bytesIn / bytesOut : 0.0, stats.parted, stats.stored);
+  }
+  if (!application_control.asyncWriters.empty()) {
+    for (DataWriterAsync *asyncWriter : application_control.asyncWriters) {
+      asyncWriter->flush();
+    }
+    const DataWriterAsync::Stats stats = writerStats();
+    XTRACE(MAIN, ALW, "Wrote %lu buffers in %lu chunks, %lu waited %.2f seconds for room in the write queue.",
+           stats.buffers, stats.chunks, stats.stalls, stats.stallTime / 1e6);
+  }
+  if (networkWriter) {
+    networkWriter->flush();
+    const DataWriterNetwork::Stats stats = networkWriter->getStats();
+    XTRACE(MAIN, ALW, "Sent %lu datagrams (%.1f MB) in %lu system calls, %lu by UDP GSO, %lu failed, %lu waited %.2f seconds for room in the send queue.",
+           stats.datagrams, stats.bytes / 1e6, stats.syscalls, stats.segmented, stats.errors, stats.stalls,
+           stats.stallTime / 1e6);
+  }
+  if (capture) {
+    XTRACE(MAIN, ALW, "Captured %.1f MB of raw readout data.", capture->bytesWritten() / 1e6);
+  }
+  if (bufferPool) {
+    const jadaq::BufferPool::Stats stats = bufferPool->getStats();
+    XTRACE(MAIN, ALW, "Buffer pool high water %zu of %zu blocks, %lu taken from the heap.", stats.highWater,
+           stats.blocks, stats.misses);
+  }
   return 0;
 }